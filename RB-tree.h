@@ -5,6 +5,8 @@
 #ifndef STL_MY_ALLOCATOR_RB_TREE_H
 #define STL_MY_ALLOCATOR_RB_TREE_H
 
+#include "node_pool.h"
+
 typedef bool __rb_tree_color_type;
 const __rb_tree_color_type __rb_tree_red = false;       // 红色为0
 const __rb_tree_color_type __rb_tree_black = true;      // 黑色为1
@@ -184,12 +186,14 @@ struct __rb_tree_iterator : public __rb_tree_base_iterator {
 
 
 // RB_tree数据结构
-template <class Key, class Value, class KeyOfValue, class Compare, class Alloc = alloc>
-class rb_tree {
+// 内部保存一个分配器实例（见my_allocator.h中的__alloc_holder），无状态的分配器不占用空间
+template <class Key, class Value, class KeyOfValue, class Compare, class Alloc = node_alloc>
+class rb_tree : protected __alloc_holder<Alloc> {
 protected:
+    typedef __alloc_holder<Alloc> alloc_base;
     typedef __rb_tree_node_base* base_ptr;          // 底层节点指针
     typedef __rb_tree_node<Value> rb_tree_node;     // 上层节点
-    typedef simple_alloc<rb_tree_node, Alloc> rb_tree_node_allocator;   // 节点专属内存分配器
+    typedef __node_allocator<rb_tree_node, Alloc> rb_tree_node_allocator;   // 节点专属内存分配器，无状态的分配器通过__node_pool回收节点
     typedef __rb_tree_color_type color_type;        // 颜色类型
 
 public:
@@ -202,6 +206,9 @@ public:
     typedef rb_tree_node* link_type;        // 上层节点指针
     typedef size_t size_type;
     typedef ptrdiff_t difference_type;      // 迭代器差值类型
+    typedef Alloc allocator_type;
+
+    using alloc_base::get_allocator;
 
 protected:
     size_type node_count;       // 节点数量
@@ -209,10 +216,10 @@ protected:
     Compare key_compare;        // 函数对象，主要用来自定义键值比较
 
     // 分配一个节点的内存
-    link_type get_node() { return rb_tree_node_allocator::allocate(); }
+    link_type get_node() { return rb_tree_node_allocator::allocate(this->get_alloc()); }
 
     // 释放一个节点的内存
-    void put_node(link_type p) { rb_tree_node_allocator::deallocate(p); }
+    void put_node(link_type p) { rb_tree_node_allocator::deallocate(this->get_alloc(), p); }
 
     // 根据初值构造一个节点
     link_type create_node(const value_type& x) {
@@ -225,7 +232,7 @@ protected:
 
     // 拷贝一个节点，值和颜色
     link_type clone_node(link_type x) {
-        link_type temp = create_node(x);
+        link_type temp = create_node(x->value_field);
         temp->color = x->color;
         temp->left = nullptr;
         temp->right = nullptr;
@@ -241,25 +248,26 @@ protected:
     }
 
     // 以下三个函数负责获取header的相应指针
-    link_type& root() const { return (link_type&) header->parent; }
-    link_type& left_most() const { return (link_type&) header->left; }
-    link_type& right_most() const { return (link_type&) header->right; }
+    // 返回的是节点中base_ptr成员本身的引用，不能转换成link_type&：通过link_type&读写base_ptr对象违反严格别名规则，
+    // 打开优化（-O2）之后编译器会据此重排读写，插入时树的结构就乱了；需要link_type时读出来之后再转换
+    base_ptr& root() const { return header->parent; }
+    base_ptr& left_most() const { return header->left; }
+    base_ptr& right_most() const { return header->right; }
 
     // 以下几个函数访问上层节点的相关属性
     // 把对节点的成员对象的访问封装成函数
-    // 返回引用的目的是可以让返回值成为左值，通过这些返回值来修改节点上相应的值
-    static link_type& left(link_type x) { return (link_type&)(x->left); }
-    static link_type& right(link_type x) { return (link_type&)(x->right); }
-    static link_type& parent(link_type x) { return (link_type&)(x->parent); }
+    // left、right、parent返回值而不是引用（原因同上），修改指针时直接给节点的成员赋值
+    static link_type left(link_type x) { return (link_type)(x->left); }
+    static link_type right(link_type x) { return (link_type)(x->right); }
+    static link_type parent(link_type x) { return (link_type)(x->parent); }
     static reference value(link_type x) { return x->value_field; }
     static const Key& key(link_type x) {return KeyOfValue()(value(x)); }
     static color_type& color(link_type x) { return (color_type&)(x->color); }
 
     // 以下几个函数访问下层节点的相关属性
-    // 返回引用的目的是可以让返回值成为左值，通过这些返回值来修改节点上相应的值
-    static link_type& left(base_ptr x) { return (link_type&)(x->left); }
-    static link_type& right(base_ptr x) { return (link_type&)(x->right); }
-    static link_type& parent(base_ptr x) { return (link_type&)(x->parent); }
+    static link_type left(base_ptr x) { return (link_type)(x->left); }
+    static link_type right(base_ptr x) { return (link_type)(x->right); }
+    static link_type parent(base_ptr x) { return (link_type)(x->parent); }
     static reference value(base_ptr x) { return ((link_type)x)->value_field; }
     static const Key& key(base_ptr x) {return KeyOfValue()(value(link_type(x))); }
     static color_type& color(base_ptr x) { return (color_type&)(link_type(x)->color); }
@@ -300,27 +308,115 @@ private:
         right_most() = header;
     }
 
+    // 把x的整棵树拷贝过来，*this必须是空树
+    void copy_from(const rb_tree& x) {
+        if (x.root() == nullptr)
+            return;
+        root() = __copy((link_type) x.root(), header);
+        left_most() = minimum((link_type) root());
+        right_most() = maximum((link_type) root());
+        node_count = x.node_count;
+    }
+
 public:
     // 构造函数/析构函数
-    rb_tree(const Compare& comp = Compare()) : node_count(0), key_compare(comp) {
+    rb_tree(const Compare& comp = Compare(), const Alloc& a = Alloc())
+        : alloc_base(a), node_count(0), key_compare(comp) {
         // 对header节点进行初始化
         init();
     }
 
+    // 拷贝构造函数，新树的分配器由select_on_container_copy_construction()决定
+    rb_tree(const rb_tree& x)
+        : alloc_base(__allocator_traits<Alloc>::select_on_container_copy_construction(x.get_alloc())),
+          node_count(0), key_compare(x.key_compare) {
+        init();
+        try {
+            copy_from(x);
+        }
+        catch (...) {
+            put_node(header);
+            throw;
+        }
+    }
+
+    // 移动构造函数，直接接管x的header，x换上一个新的header
+    rb_tree(rb_tree&& x)
+        : alloc_base(x.get_alloc()), node_count(x.node_count), header(x.header), key_compare(x.key_compare) {
+        x.init();
+        x.node_count = 0;
+    }
+
     ~rb_tree() {
         clear();
         put_node(header);
     }
 
     // 拷贝赋值运算符
+    // 如果分配器需要传播，而两个分配器又不相等，原来的节点必须先用旧的分配器回收，再换成x的分配器
     rb_tree<Key, Value, KeyOfValue, Compare, Alloc>&
     operator=(const rb_tree<Key, Value, KeyOfValue, Compare, Alloc>& x) {
+        if (&x != this) {
+            clear();
+            if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment
+                && !__alloc_equal(this->get_alloc(), x.get_alloc())) {
+                put_node(header);
+                __propagate_on_copy_assign(this->get_alloc(), x.get_alloc());
+                init();
+            }
+            key_compare = x.key_compare;
+            copy_from(x);
+        }
+        return *this;
+    }
+
+    // 移动赋值运算符
+    // 分配器会传播或者两个分配器相等时，直接交换header，否则只能逐个拷贝节点
+    rb_tree<Key, Value, KeyOfValue, Compare, Alloc>&
+    operator=(rb_tree<Key, Value, KeyOfValue, Compare, Alloc>&& x) {
+        if (&x == this)
+            return *this;
+        clear();
+        key_compare = x.key_compare;
+        if (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+            || __alloc_equal(this->get_alloc(), x.get_alloc())) {
+            put_node(header);
+            __propagate_on_move_assign(this->get_alloc(), x.get_alloc());
+            header = x.header;
+            node_count = x.node_count;
+            x.init();
+            x.node_count = 0;
+        }
+        else {
+            copy_from(x);
+            x.clear();
+        }
+        return *this;
+    }
+
+    // 交换两棵树，只需要交换header、节点数量和比较函数
+    // 分配器不传播时，要求两棵树的分配器相等（与标准库相同）
+    void swap(rb_tree<Key, Value, KeyOfValue, Compare, Alloc>& x) {
+        __propagate_on_swap(this->get_alloc(), x.get_alloc());
+        std::swap(header, x.header);
+        std::swap(node_count, x.node_count);
+        std::swap(key_compare, x.key_compare);
+    }
 
+    // 销毁所有节点，只保留header
+    void clear() {
+        if (node_count != 0) {
+            __erase((link_type) root());
+            left_most() = header;
+            root() = nullptr;
+            right_most() = header;
+            node_count = 0;
+        }
     }
 
     // 一些数据结构相关的成员函数
     Compare key_comp() const { return key_compare; }
-    iterator begin() { return left_most(); }
+    iterator begin() { return (link_type) left_most(); }
     iterator end() { return header; }
     bool empty() const { return node_count == 0; }
     size_type size() const { return node_count; }
@@ -344,7 +440,7 @@ template <class Key, class Value, class KeyOfValue, class Compare, class Alloc>
 typename rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::iterator
 rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::insert_equal(const value_type &value) {
     link_type y = header;
-    link_type x = root();
+    link_type x = (link_type) root();
     while (x != nullptr) {
         y = x;
         // 将当前节点的key与value对应的key比较
@@ -365,7 +461,7 @@ template <class Key, class Value, class KeyOfValue, class Compare, class Alloc>
 pair<typename rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::iterator, bool>
 rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::insert_unique(const value_type &v) {
     link_type parent = header;
-    link_type cur = root();
+    link_type cur = (link_type) root();
     bool comp = true;
     while (cur != nullptr) {
         parent = cur;
@@ -422,9 +518,10 @@ inline void __rb_tree_rotate_left(__rb_tree_node_base* x, __rb_tree_node_base*&
     if (new_root->left != nullptr)
         new_root->left->parent = x;
     // 如果x是根节点，则需要更新new_root为根节点
+    // 根节点的父节点是header，header的left、right是最左、最右节点而不是子节点，不能修改
     if (x == root)
         root = new_root;
-    if (x == x->parent->left)
+    else if (x == x->parent->left)
         x->parent->left = new_root;
     else if (x == x->parent->right)
         x->parent->right = new_root;
@@ -442,10 +539,10 @@ inline void __rb_tree_rotate_right(__rb_tree_node_base* x, __rb_tree_node_base*&
     x->left = new_root->right;
     if (new_root->right != nullptr)
         new_root->right->parent = x;
-    // 如果x是根节点，则需要更新new_root为根节点
+    // 如果x是根节点，则需要更新new_root为根节点（同上，不能修改header的left、right）
     if (x == root)
         root = new_root;
-    if (x->parent->left == x)
+    else if (x->parent->left == x)
         x->parent->left = new_root;
     else if (x->parent->right == x)
         x->parent->right = new_root;
@@ -551,27 +648,69 @@ rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::__insert(rb_tree<Key, Value, Ke
     // 如果y不是header，并且v小于y，y是最左节点
     // 那么需要更新最左节点为待插入节点
     else if (y != header && key_compare(KeyOfValue()(v), key(y))) {
-        left(y) = z;
+        y->left = z;
         if (y == left_most()) {
             left_most() = z;
         }
     }
     // 否则如果y不是header，v大于等于y，则插入到y的右边
     else if (y != header && !key_compare(KeyOfValue()(v), key(y))) {
-        right(y) = z;
+        y->right = z;
         if (y == right_most()) {
             right_most() = z;
         }
     }
-    parent(z) = y;
-    left(z) = nullptr;
-    right(z) = nullptr;
+    z->parent = y;
+    z->left = nullptr;
+    z->right = nullptr;
 
-    __rb_tree_rebalance(z, root());
+    __rb_tree_rebalance(z, header->parent);
     ++node_count;
     return iterator(z);
 }
 
+// 拷贝以x为根的子树，新子树的根节点的父节点为p，返回新子树的根节点
+// 右子树递归拷贝，左子树沿着左边一路循环拷贝，减少递归的深度
+// 拷贝过程中发生异常时，销毁已经拷贝的部分
+template <class Key, class Value, class KeyOfValue, class Compare, class Alloc>
+typename rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::link_type
+rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::__copy(link_type x, link_type p) {
+    link_type top = clone_node(x);
+    top->parent = p;
+    try {
+        if (x->right != nullptr)
+            top->right = __copy(right(x), top);
+        p = top;
+        x = left(x);
+        while (x != nullptr) {
+            link_type y = clone_node(x);
+            p->left = y;
+            y->parent = p;
+            if (x->right != nullptr)
+                y->right = __copy(right(x), y);
+            p = y;
+            x = left(x);
+        }
+    }
+    catch (...) {
+        __erase(top);
+        throw;
+    }
+    return top;
+}
+
+// 销毁以x为根的子树，不做任何平衡调整
+// 右子树递归销毁，左子树循环销毁
+template <class Key, class Value, class KeyOfValue, class Compare, class Alloc>
+void rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::__erase(link_type x) {
+    while (x != nullptr) {
+        __erase(right(x));
+        link_type y = left(x);
+        destroy_node(x);
+        x = y;
+    }
+}
+
 // 查找结点
 template <class Key, class Value, class KeyOfValue, class Compare, class Alloc>
 typename rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::iterator
@@ -586,7 +725,7 @@ rb_tree<Key, Value, KeyOfValue, Compare, Alloc>::find(const Key &k) {
     // 因为到达这个节点后，key >= k满足，则会往这个节点的左边移动，那么在这个节点的左子树遍历时
     // 所有节点的值必然是小于key的，也就不存在key >= k的节点，所以y不会变化，所以y必定指向这个key为k的节点
     link_type y = header;
-    link_type cur = root();
+    link_type cur = (link_type) root();
     while (cur != nullptr) {
         // key(cur) < k 时 key_compare返回true
         // 所以!key_compare(key(cur), k)也就是key(cur) >= k
@@ -0,0 +1,254 @@
+//
+// 分配轨迹（trace）的记录
+//
+
+#ifndef STL_MY_ALLOCATOR_ALLOC_TRACE_H
+#define STL_MY_ALLOCATOR_ALLOC_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+// 记录模式：编译时定义__STL_ALLOC_TRACE，simple_alloc和第二级分配器的每一次分配和回收都会被记录下来（见__alloc_tracer）
+// 没有定义时__ALLOC_TRACE中的语句全部被去掉，没有任何额外开销
+#ifdef __STL_ALLOC_TRACE
+#define __ALLOC_TRACE(stmt) stmt
+#else
+#define __ALLOC_TRACE(stmt)
+#endif
+
+namespace my_std {
+    /*
+ * 记录生产环境中真实的分配序列，之后用bench/alloc_replay.cpp离线回放，比较不同分配器的吞吐量、RSS和碎片，
+ * 根据结果调整内存池的参数（size class、refill批量、chunk大小等），而不是凭感觉猜
+ *
+ * 用法：
+ *   编译时定义__STL_ALLOC_TRACE
+ *   __alloc_tracer::start("app.trace");
+ *   { __alloc_trace_tag tag(3); ... }      // 可选，这个作用域内的分配都带上调用点标签3
+ *   __alloc_tracer::stop();
+ *
+ * 文件格式：一个__alloc_trace_header，之后是若干个__alloc_trace_event，全部是本机字节序
+ * 每个线程先把事件写到自己的缓冲区，缓冲区满了、线程退出或者stop()时才批量写入文件，记录时几乎不需要加锁
+ * 所以文件中的事件按线程分块，并不按时间排序，回放时按timestamp重新排序
+ *
+ * 容器通过simple_alloc分配，simple_alloc再调用第二级分配器，为了不重复记录，只记录最外层的一次调用（见__alloc_trace_scope）
+ * 第二级分配器在refill时向第一级分配器、chunk source申请的内存不会被记录，回放时由被测的分配器自己决定
+ * 节点容器使用第二级分配器时，节点由__node_pool回收，轨迹中只有__node_pool申请整块节点的记录（见node_pool.h中的__recycle_nodes）
+ */
+
+    const static uint32_t __ALLOC_TRACE_VERSION = 1;
+    const static size_t __ALLOC_TRACE_BUFFER = 4096;     // 每个线程缓冲区中的事件个数
+
+    // 文件头
+    struct __alloc_trace_header {
+        char magic[8];          // "MYSTLTRC"
+        uint32_t version;
+        uint32_t event_size;    // sizeof(__alloc_trace_event)，回放时用来检查格式
+    };
+
+    enum __alloc_trace_op {
+        __TRACE_ALLOCATE = 0,
+        __TRACE_DEALLOCATE = 1
+    };
+
+    // 一次分配或者回收，共24Bytes
+    struct __alloc_trace_event {
+        uint64_t timestamp;     // 距离start()的纳秒数
+        uint64_t address;       // 分配出去的地址，回放时用来把回收和之前的分配对应起来
+        uint32_t size;          // 字节数，大于4GB的按4GB-1记录
+        uint16_t thread;        // 线程编号，按线程第一次记录的先后从0开始
+        uint8_t op;             // __alloc_trace_op
+        uint8_t tag;            // 调用点标签（见__alloc_trace_tag）
+    };
+
+    class __alloc_tracer {
+    private:
+        struct thread_buffer;
+
+        // 所有的全局状态，放在函数内的静态变量中，头文件中定义也只有一份
+        struct trace_state {
+            std::atomic<bool> active;
+            std::mutex file_lock;           // 保护file
+            FILE* file;
+            std::mutex registry_lock;       // 保护buffers链表
+            thread_buffer* buffers;         // 所有线程的缓冲区串成的链表
+            std::atomic<uint32_t> next_thread;
+            std::chrono::steady_clock::time_point begin;
+
+            trace_state() : active(false), file(NULL), buffers(NULL), next_thread(0) {}
+        };
+
+        static trace_state& state() {
+            static trace_state s;
+            return s;
+        }
+
+        // 每个线程的缓冲区，线程退出时把剩下的事件写入文件
+        // 锁的顺序：registry_lock -> lock -> file_lock
+        struct thread_buffer {
+            std::mutex lock;                // 只有stop()会和本线程竞争
+            thread_buffer* next;
+            uint16_t thread;
+            size_t count;
+            __alloc_trace_event events[__ALLOC_TRACE_BUFFER];
+
+            thread_buffer() : next(NULL), count(0) {
+                trace_state& s = state();
+                thread = (uint16_t) s.next_thread.fetch_add(1, std::memory_order_relaxed);
+                std::lock_guard<std::mutex> guard(s.registry_lock);
+                next = s.buffers;
+                s.buffers = this;
+            }
+
+            ~thread_buffer() {
+                trace_state& s = state();
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    flush();
+                }
+                std::lock_guard<std::mutex> guard(s.registry_lock);
+                thread_buffer** p = &s.buffers;
+                while (*p != this)
+                    p = &(*p)->next;
+                *p = next;
+            }
+
+            // 把缓冲区中的事件写入文件，调用者需要持有lock
+            void flush() {
+                if (count == 0)
+                    return;
+                trace_state& s = state();
+                std::lock_guard<std::mutex> guard(s.file_lock);
+                if (s.file != NULL)
+                    fwrite(events, sizeof(__alloc_trace_event), count, s.file);
+                count = 0;
+            }
+        };
+
+        static thread_buffer& local_buffer() {
+            static thread_local thread_buffer buffer;
+            return buffer;
+        }
+
+        // 当前线程的调用点标签
+        static uint8_t& current_tag() {
+            static thread_local uint8_t tag = 0;
+            return tag;
+        }
+
+        friend class __alloc_trace_tag;
+
+    public:
+        // 开始记录，写到path指向的文件中（覆盖原来的内容），成功时返回true
+        static bool start(const char* path) {
+            trace_state& s = state();
+            std::lock_guard<std::mutex> guard(s.file_lock);
+            if (s.file != NULL)
+                return false;
+            s.file = fopen(path, "wb");
+            if (s.file == NULL)
+                return false;
+            __alloc_trace_header header;
+            memcpy(header.magic, "MYSTLTRC", 8);
+            header.version = __ALLOC_TRACE_VERSION;
+            header.event_size = sizeof(__alloc_trace_event);
+            fwrite(&header, sizeof(header), 1, s.file);
+            s.begin = std::chrono::steady_clock::now();
+            s.active.store(true, std::memory_order_release);
+            return true;
+        }
+
+        // 停止记录，把所有线程缓冲区中剩下的事件写入文件，然后关闭文件
+        static void stop() {
+            trace_state& s = state();
+            s.active.store(false, std::memory_order_release);
+            {
+                std::lock_guard<std::mutex> registry_guard(s.registry_lock);
+                for (thread_buffer* b = s.buffers; b != NULL; b = b->next) {
+                    std::lock_guard<std::mutex> guard(b->lock);
+                    b->flush();
+                }
+            }
+            std::lock_guard<std::mutex> guard(s.file_lock);
+            if (s.file != NULL) {
+                fclose(s.file);
+                s.file = NULL;
+            }
+        }
+
+        static bool active() { return state().active.load(std::memory_order_relaxed); }
+
+        // 记录一次分配或者回收
+        static void record(__alloc_trace_op op, void* p, size_t size) {
+            trace_state& s = state();
+            if (!s.active.load(std::memory_order_relaxed) || p == NULL)
+                return;
+            thread_buffer& b = local_buffer();
+            std::lock_guard<std::mutex> guard(b.lock);
+            __alloc_trace_event& e = b.events[b.count];
+            e.timestamp = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - s.begin).count();
+            e.address = (uint64_t)(uintptr_t) p;
+            e.size = size > 0xffffffffu ? 0xffffffffu : (uint32_t) size;
+            e.thread = b.thread;
+            e.op = (uint8_t) op;
+            e.tag = current_tag();
+            if (++b.count == __ALLOC_TRACE_BUFFER)
+                b.flush();
+        }
+    };
+
+// 在作用域内给当前线程的分配加上调用点标签，离开作用域时恢复原来的标签
+// 例如给每种容器、每个模块一个编号，回放时可以按标签分别统计
+    class __alloc_trace_tag {
+    private:
+        uint8_t saved;
+
+    public:
+        explicit __alloc_trace_tag(uint8_t tag) : saved(__alloc_tracer::current_tag()) {
+            __alloc_tracer::current_tag() = tag;
+        }
+        ~__alloc_trace_tag() { __alloc_tracer::current_tag() = saved; }
+
+        __alloc_trace_tag(const __alloc_trace_tag&) = delete;
+        __alloc_trace_tag& operator=(const __alloc_trace_tag&) = delete;
+    };
+
+// 包住一次分配或者回收，只有最外层的一次会被记录
+// simple_alloc调用第二级分配器、第二级分配器再调用自己时，里面的几层不会重复记录
+    class __alloc_trace_scope {
+    private:
+        __alloc_trace_op op;
+        size_t size;
+        bool outermost;
+
+        static int& depth() {
+            static thread_local int d = 0;
+            return d;
+        }
+
+    public:
+        __alloc_trace_scope(__alloc_trace_op o, size_t n) : op(o), size(n), outermost(depth()++ == 0) {}
+        ~__alloc_trace_scope() { --depth(); }
+
+        __alloc_trace_scope(const __alloc_trace_scope&) = delete;
+        __alloc_trace_scope& operator=(const __alloc_trace_scope&) = delete;
+
+        void record(void* p) {
+            if (outermost)
+                __alloc_tracer::record(op, p, size);
+        }
+
+        // 在同一层再记录一个事件，reallocate()用它在旧内存块的回收之后记录新内存块的分配
+        void record(__alloc_trace_op o, void* p, size_t n) {
+            if (outermost)
+                __alloc_tracer::record(o, p, n);
+        }
+    };
+}
+
+#endif //STL_MY_ALLOCATOR_ALLOC_TRACE_H
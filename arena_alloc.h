@@ -0,0 +1,216 @@
+//
+// 单调（monotonic）arena分配器
+//
+
+#ifndef STL_MY_ALLOCATOR_ARENA_ALLOC_H
+#define STL_MY_ALLOCATOR_ARENA_ALLOC_H
+
+#include <stddef.h>
+#include <string.h>
+#include "first_level_alloc.h"
+
+namespace my_std {
+    /*
+ * arena分配器，接口与两级分配器相同，可以直接作为容器的Alloc模板参数，例如
+ *   typedef __arena_alloc_template<false, 0> request_arena;
+ *   vector<int, request_arena> v;  list<int, request_arena> l;
+ * arena由若干个大块（block）串成的链表构成，分配时只是把当前block的指针向后移动（bump pointer），
+ * 当前block不够时向第一级分配器申请一个更大的block（每次翻倍，直到__ARENA_MAX_BLOCK）
+ * deallocate()什么都不做，内存只能通过reset()一次性全部回收，或者通过rewind()回到之前的某个checkpoint
+ * 所以一次请求中临时创建的vector、list、rb_tree、hashtable可以一起丢弃：
+ * 先让容器离开作用域（节点的析构函数照常调用，但节点的回收是空操作），再调用reset()，不需要逐个节点free
+ *
+ * reset()保留最后（也是最大）的一个block供下一次使用，其余的还给系统，这样每次请求都不需要重新malloc
+ * 注意：reset()/rewind()之后，之前分配出去的内存全部失效，调用之前必须保证使用这些内存的容器都已经销毁
+ *
+ * 第一参数为true时，每个线程有自己的arena（thread_local），不同线程的请求互不干扰，也不需要加锁；
+ * 为false时所有线程共享同一个arena，只能在单线程中使用
+ * 第二参数与其他分配器一样，用来生成互相独立的arena
+ *
+ * 如果需要多个互相独立、生命周期各不相同的arena，可以直接创建__arena_resource实例，
+ * 再通过有状态的__arena_allocator交给容器使用（见my_allocator.h中有状态的分配器）
+ */
+
+    const static size_t __ARENA_ALIGN = 16;                 // 分配出去的内存按16Bytes对齐，与malloc相同
+    const static size_t __ARENA_MIN_BLOCK = 4096;           // 第一个block的大小
+    const static size_t __ARENA_MAX_BLOCK = 1024 * 1024;    // block翻倍增长的上限，更大的请求单独占一个block
+
+    // arena的某一个状态，rewind()时回到这个状态
+    struct __arena_checkpoint {
+        void* block;    // 当时的当前block
+        char* cur;      // 当时当前block中的分配位置
+    };
+
+// 一个arena实例，由若干个大块（block）串成的链表构成
+// __arena_alloc_template使用静态（或者thread_local）的实例，也可以直接创建实例，通过__arena_allocator交给容器使用
+    template <int inst>
+    class __arena_resource {
+    private:
+        // block的头部，block之间按申请的先后串成链表，head指向最新的block
+        struct block {
+            block* prev;
+            size_t size;        // 整个block的大小（包括头部）
+        };
+
+        const static size_t HEADER = (sizeof(block) + __ARENA_ALIGN - 1) & ~(__ARENA_ALIGN - 1);
+
+        static size_t ROUND_UP(size_t bytes) {
+            return (bytes + __ARENA_ALIGN - 1) & ~(__ARENA_ALIGN - 1);
+        }
+
+        block* head;
+        char* cur;          // 当前block中下一次分配的位置
+        char* end;          // 当前block的末尾
+        size_t reserved;    // 所有block的总大小
+
+        // 释放head之后直到keep（不包括keep）的所有block
+        void free_blocks(block* keep) {
+            while (head != keep) {
+                block* prev = head->prev;
+                reserved -= head->size;
+                __malloc_alloc_template<inst>::deallocate(head, head->size);
+                head = prev;
+            }
+        }
+
+        // 当前block不够分配n个字节时，申请一个新的block，并从中分配n个字节
+        void* allocate_block(size_t n) {
+            size_t size = head == NULL ? __ARENA_MIN_BLOCK : head->size * 2;
+            if (size > __ARENA_MAX_BLOCK)
+                size = __ARENA_MAX_BLOCK;
+            if (size < HEADER + n)
+                size = HEADER + n;
+            block* b = (block*) __malloc_alloc_template<inst>::allocate(size);
+            b->prev = head;
+            b->size = size;
+            head = b;
+            reserved += size;
+            cur = (char*)b + HEADER + n;
+            end = (char*)b + size;
+            return (char*)b + HEADER;
+        }
+
+    public:
+        __arena_resource() : head(NULL), cur(NULL), end(NULL), reserved(0) {}
+
+        // 销毁时把所有block还给系统
+        ~__arena_resource() { release(); }
+
+        // 不可拷贝，容器之间共享同一个arena要通过__arena_allocator
+        __arena_resource(const __arena_resource&) = delete;
+        __arena_resource& operator=(const __arena_resource&) = delete;
+
+        // 分配n个字节，只需要移动指针
+        void* allocate(size_t n) {
+            n = ROUND_UP(n);
+            if ((size_t)(end - cur) < n)
+                return allocate_block(n);
+            void* result = cur;
+            cur += n;
+            return result;
+        }
+
+        // 回收arena中所有的内存，只保留最新的一个block留给之后的分配
+        void reset() {
+            if (head == NULL)
+                return;
+            block* keep = head;
+            head = keep->prev;
+            free_blocks(NULL);
+            keep->prev = NULL;
+            head = keep;
+            cur = (char*)keep + HEADER;
+        }
+
+        // 把所有block都还给系统
+        void release() {
+            free_blocks(NULL);
+            cur = end = NULL;
+        }
+
+        // 记录arena当前的状态
+        __arena_checkpoint checkpoint() const {
+            __arena_checkpoint result = {head, cur};
+            return result;
+        }
+
+        // 回到checkpoint时的状态，这之后分配的内存全部回收，checkpoint之前分配的内存不受影响
+        // checkpoint之后的reset()/rewind()如果已经回收了checkpoint所在的block，则不能再回到这个checkpoint
+        void rewind(const __arena_checkpoint& cp) {
+            if (cp.block == NULL) {
+                reset();
+                return;
+            }
+            free_blocks((block*)cp.block);
+            cur = cp.cur;
+            end = (char*)head + head->size;
+        }
+
+        // 已经用掉的字节数，包括block的头部以及换block时前一个block末尾用不上的部分
+        size_t bytes_used() const {
+            if (head == NULL)
+                return 0;
+            return reserved - (end - cur);
+        }
+
+        // arena从系统申请的字节数
+        size_t bytes_reserved() const { return reserved; }
+    };
+
+    template <bool threads, int inst>
+    class __arena_alloc_template {
+    private:
+        // 多线程版本每个线程一个arena，线程退出时由__arena_resource的析构函数释放
+        static __arena_resource<inst>& resource() {
+            if (threads) {
+                static thread_local __arena_resource<inst> local;
+                return local;
+            }
+            static __arena_resource<inst> global;
+            return global;
+        }
+
+    public:
+        static void* allocate(size_t n) { return resource().allocate(n); }
+
+        // 单个内存块不回收，统一由reset()/rewind()回收
+        static void deallocate(void*, size_t) {}
+
+        static void* reallocate(void* p, size_t old_size, size_t new_size) {
+            void* result = allocate(new_size);
+            memcpy(result, p, old_size < new_size ? old_size : new_size);
+            return result;
+        }
+
+        static void reset() { resource().reset(); }
+        static void release() { resource().release(); }
+        static __arena_checkpoint checkpoint() { return resource().checkpoint(); }
+        static void rewind(const __arena_checkpoint& cp) { resource().rewind(cp); }
+        static size_t bytes_used() { return resource().bytes_used(); }
+        static size_t bytes_reserved() { return resource().bytes_reserved(); }
+    };
+
+// 有状态的arena分配器，只保存一个指向__arena_resource的指针，可以作为容器的Alloc模板参数
+// 每个容器（或者每个分片、每个租户的一组容器）可以使用自己的arena，例如
+//   __arena_resource<0> shard_arena;
+//   list<int, __arena_allocator<0> > l(__arena_allocator<0>(&shard_arena));
+// 容器拷贝、移动、交换时分配器不传播（与std::pmr相同），容器一直使用构造时指定的arena
+    template <int inst>
+    class __arena_allocator {
+    private:
+        __arena_resource<inst>* arena;
+
+    public:
+        explicit __arena_allocator(__arena_resource<inst>* r) : arena(r) {}
+
+        void* allocate(size_t n) const { return arena->allocate(n); }
+        void deallocate(void*, size_t) const {}
+
+        __arena_resource<inst>* resource() const { return arena; }
+
+        bool operator==(const __arena_allocator& x) const { return arena == x.arena; }
+        bool operator!=(const __arena_allocator& x) const { return arena != x.arena; }
+    };
+}
+
+#endif //STL_MY_ALLOCATOR_ARENA_ALLOC_H
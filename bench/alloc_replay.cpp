@@ -0,0 +1,239 @@
+//
+// 离线回放分配轨迹（见alloc_trace.h），比较不同分配器在真实分配序列下的表现
+// 用法：alloc_replay app.trace [重复次数]
+//
+// 依次对第一级分配器（malloc_alloc）、第二级分配器（内存池）、slab分配器和glibc的malloc/free回放同一个轨迹，输出：
+//   吞吐量：每次分配/回收的平均纳秒数
+//   RSS：回放过程中RSS相对回放前的最大增量
+//   碎片：RSS最大增量 / 同时存活字节数的最大值，越接近1说明额外占用的内存越少
+// 每个分配器在单独的子进程中回放，RSS不会互相影响，也不受之前分配器残留内存的影响
+// 轨迹中所有线程的事件按时间合并成一个序列，在一个线程中回放，所以第二级分配器和slab分配器使用单线程版本
+// 轨迹开始之前分配的内存块，它们的回收事件找不到对应的分配，直接跳过
+//
+
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../second_level_alloc.h"
+#include "../slab_alloc.h"
+
+using namespace my_std;
+
+// 预处理之后的一次操作，slot是内存块在回放表中的编号，回放时不需要再查找地址
+struct replay_op {
+    uint32_t size;
+    uint32_t slot;
+    bool allocate;
+};
+
+// 回放表中的一项，p为NULL表示这个slot当前没有被占用
+struct replay_block {
+    void* p;
+    size_t size;
+};
+
+struct replay_result {
+    double ns_per_op;
+    size_t rss_growth;          // RSS的最大增量（字节）
+    size_t peak_live;           // 同时存活字节数的最大值
+};
+
+struct malloc_backend {
+    static void* allocate(size_t n) { return malloc(n); }
+    static void deallocate(void* p, size_t) { free(p); }
+};
+
+typedef __malloc_alloc_template<0> first_level_backend;
+typedef __default_alloc_template<false, 0> pool_backend;
+typedef __slab_alloc_template<false, 0> slab_backend;
+
+// 读入轨迹文件，按时间排序后把地址换成slot编号
+static bool load_trace(const char* path, std::vector<replay_op>& ops, size_t& slots) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    __alloc_trace_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "MYSTLTRC", 8) != 0
+        || header.version != __ALLOC_TRACE_VERSION || header.event_size != sizeof(__alloc_trace_event)) {
+        fprintf(stderr, "%s is not a trace file of this version\n", path);
+        fclose(f);
+        return false;
+    }
+    std::vector<__alloc_trace_event> events;
+    __alloc_trace_event buf[4096];
+    size_t n;
+    while ((n = fread(buf, sizeof(__alloc_trace_event), 4096, f)) > 0)
+        events.insert(events.end(), buf, buf + n);
+    fclose(f);
+
+    // 同一个线程的事件在文件中已经是有序的，stable_sort保证时间相同的事件保持原来的先后
+    std::stable_sort(events.begin(), events.end(),
+                     [](const __alloc_trace_event& a, const __alloc_trace_event& b) {
+                         return a.timestamp < b.timestamp;
+                     });
+
+    // 地址 -> 当前占用这个地址的slot，轨迹中有几百万个事件，每次查找、插入、删除都需要是O(1)
+    std::unordered_map<uint64_t, uint32_t> live;
+    std::vector<uint32_t> free_slots;
+    slots = 0;
+    ops.reserve(events.size());
+    for (size_t i = 0; i < events.size(); i++) {
+        const __alloc_trace_event& e = events[i];
+        if (e.size == 0)
+            continue;
+        replay_op op;
+        op.size = e.size;
+        if (e.op == __TRACE_ALLOCATE) {
+            if (free_slots.empty()) {
+                op.slot = (uint32_t) slots++;
+            }
+            else {
+                op.slot = free_slots.back();
+                free_slots.pop_back();
+            }
+            op.allocate = true;
+            live[e.address] = op.slot;      // 之前的回收没有被记录到时，直接覆盖
+        }
+        else {
+            std::unordered_map<uint64_t, uint32_t>::iterator it = live.find(e.address);
+            if (it == live.end())
+                continue;
+            op.slot = it->second;
+            op.allocate = false;
+            free_slots.push_back(op.slot);
+            live.erase(it);
+        }
+        ops.push_back(op);
+    }
+    return true;
+}
+
+// 当前进程的RSS（字节）
+static size_t current_rss() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return (size_t) resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+// 回放一遍，sample为true时每隔一段时间采样RSS（不计时），为false时只计时
+template <class Alloc>
+static void replay(const std::vector<replay_op>& ops, std::vector<replay_block>& table, bool sample, replay_result& result) {
+    size_t base_rss = sample ? current_rss() : 0;
+    size_t live = 0;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops.size(); i++) {
+        const replay_op& op = ops[i];
+        if (op.allocate) {
+            void* p = Alloc::allocate(op.size);
+            // 写一个字节，让这一页真正被使用，和真实程序一样计入RSS
+            *(volatile char*) p = 0;
+            table[op.slot].p = p;
+            table[op.slot].size = op.size;
+            live += op.size;
+        }
+        else {
+            Alloc::deallocate(table[op.slot].p, op.size);
+            table[op.slot].p = NULL;
+            live -= op.size;
+        }
+        if (sample) {
+            if (live > result.peak_live)
+                result.peak_live = live;
+            if ((i & 1023) == 0) {
+                size_t rss = current_rss();
+                if (rss > base_rss && rss - base_rss > result.rss_growth)
+                    result.rss_growth = rss - base_rss;
+            }
+        }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    if (!sample)
+        result.ns_per_op = std::chrono::duration<double, std::nano>(end - begin).count() / ops.size();
+
+    // 轨迹结束时还没有回收的内存块，在这里统一回收，下一遍回放从同样的状态开始
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table[i].p != NULL) {
+            Alloc::deallocate(table[i].p, table[i].size);
+            table[i].p = NULL;
+        }
+    }
+}
+
+// 在子进程中回放rounds遍，结果通过管道返回
+template <class Alloc>
+static bool run_child(const std::vector<replay_op>& ops, size_t slots, size_t rounds, replay_result& result) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        replay_result r = {0, 0, 0};
+        replay_block empty = {NULL, 0};
+        std::vector<replay_block> table(slots, empty);
+        // 第一遍采样RSS，之后几遍计时，取最快的一次
+        replay<Alloc>(ops, table, true, r);
+        double best = 0;
+        for (size_t i = 0; i < rounds; i++) {
+            replay<Alloc>(ops, table, false, r);
+            if (i == 0 || r.ns_per_op < best)
+                best = r.ns_per_op;
+        }
+        r.ns_per_op = best;
+        ssize_t written = write(fds[1], &r, sizeof(r));
+        _exit(written == (ssize_t)sizeof(r) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return got == (ssize_t)sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+template <class Alloc>
+static void report(const char* name, const std::vector<replay_op>& ops, size_t slots, size_t rounds) {
+    replay_result r;
+    if (!run_child<Alloc>(ops, slots, rounds, r)) {
+        printf("%-16s failed\n", name);
+        return;
+    }
+    printf("%-16s %8.2f ns/op  rss: %8zu KB  peak live: %8zu KB  rss/live: %.2f\n",
+           name, r.ns_per_op, r.rss_growth / 1024, r.peak_live / 1024,
+           r.peak_live == 0 ? 0.0 : (double) r.rss_growth / r.peak_live);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace-file [rounds]\n", argv[0]);
+        return 1;
+    }
+    size_t rounds = argc > 2 ? (size_t) atoi(argv[2]) : 5;
+    if (rounds == 0)
+        rounds = 1;
+
+    std::vector<replay_op> ops;
+    size_t slots = 0;
+    if (!load_trace(argv[1], ops, slots))
+        return 1;
+    printf("%zu operations, %zu slots, %zu rounds\n", ops.size(), slots, rounds);
+
+    report<first_level_backend>("malloc_alloc", ops, slots, rounds);
+    report<pool_backend>("pool", ops, slots, rounds);
+    report<slab_backend>("slab", ops, slots, rounds);
+    report<malloc_backend>("glibc malloc", ops, slots, rounds);
+    return 0;
+}
@@ -0,0 +1,103 @@
+//
+// 节点容器在插入/删除密集负载下的微基准测试
+// 比较节点容器原来的默认分配器（第一级分配器malloc_alloc）和现在的默认分配器（第二级分配器，见my_vector.h中的node_alloc）
+//
+// 使用malloc_alloc时每个节点一次malloc/free；使用node_alloc时节点由__node_pool回收（见node_pool.h中的__recycle_nodes），
+// 整块的节点再向第二级分配器申请
+//
+// 负载：
+//   list churn：保持LIVE个节点存活，每次随机删除一个节点，再在原来的位置插入一个（list::erase/insert）
+//   list rebuild：push_back LIVE个节点后clear()
+//   rb_tree rebuild：insert_equal LIVE个随机的key后clear()（rb_tree没有删除单个节点的接口，只能整体删除）
+// my_hashtable.h在这棵树中还不能单独编译，所以没有hashtable的负载
+// 需要打开优化编译（例如cmake -DCMAKE_BUILD_TYPE=Release），否则测到的主要是没有内联的函数调用
+//
+
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include "../node_pool.h"
+
+using namespace my_std;
+
+typedef __malloc_alloc_template<0> malloc_alloc;
+typedef __default_alloc_template<true, 0> node_alloc;   // 与my_vector.h中默认的node_alloc相同
+
+#include "../my_list.h"
+#include "../RB-tree.h"
+
+const size_t LIVE = 100000;         // 同时存活的节点个数
+const size_t CHURN_OPS = 2000000;   // churn负载的删除+插入次数
+const size_t REBUILD_ROUNDS = 20;
+
+template <class T>
+struct identity_key {
+    const T& operator()(const T& x) const { return x; }
+};
+
+// 简单的线性同余随机数，保证每个分配器面对的请求序列完全相同
+static size_t next_random(unsigned long long& seed) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (size_t)(seed >> 33);
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+}
+
+template <class Alloc>
+static double list_churn() {
+    typedef list<int, Alloc> list_type;
+    static typename list_type::iterator pos[LIVE];
+    list_type l;
+    for (size_t i = 0; i < LIVE; i++)
+        pos[i] = l.insert(l.end(), (int) i);
+    unsigned long long seed = 42;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < CHURN_OPS; i++) {
+        size_t k = next_random(seed) % LIVE;
+        typename list_type::iterator next = l.erase(pos[k]);
+        pos[k] = l.insert(next, (int) i);
+    }
+    return elapsed_ns(begin) / (2 * CHURN_OPS);
+}
+
+template <class Alloc>
+static double list_rebuild() {
+    list<int, Alloc> l;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < REBUILD_ROUNDS; round++) {
+        for (size_t i = 0; i < LIVE; i++)
+            l.push_back((int) i);
+        l.clear();
+    }
+    return elapsed_ns(begin) / (2 * LIVE * REBUILD_ROUNDS);
+}
+
+// 插入和clear()都包含树本身的操作（查找插入位置、旋转），这部分与分配器无关
+template <class Alloc>
+static double rb_tree_rebuild() {
+    rb_tree<int, int, identity_key<int>, std::less<int>, Alloc> t;
+    unsigned long long seed = 7;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < REBUILD_ROUNDS; round++) {
+        for (size_t i = 0; i < LIVE; i++)
+            t.insert_equal((int) next_random(seed));
+        t.clear();
+    }
+    return elapsed_ns(begin) / (2 * LIVE * REBUILD_ROUNDS);
+}
+
+// 一个分配器下的全部负载
+template <class Alloc>
+static void run(const char* alloc_name) {
+    printf("%-14s list churn %7.2f  list rebuild %7.2f  rb_tree rebuild %7.2f  ns/op\n",
+           alloc_name, list_churn<Alloc>(), list_rebuild<Alloc>(), rb_tree_rebuild<Alloc>());
+}
+
+int main() {
+    printf("%zu live nodes, %zu churn ops, %zu rebuild rounds\n", LIVE, CHURN_OPS, REBUILD_ROUNDS);
+    run<malloc_alloc>("malloc_alloc");
+    run<node_alloc>("node_alloc");
+    return 0;
+}
@@ -0,0 +1,62 @@
+//
+// 自适应refill批量的微基准测试
+// 混合负载：大部分请求集中在几种热门的小内存块上（模拟rb_tree、list的节点），少量分散在其他大小上
+// 分别在固定批量和自适应批量下运行，比较refill的次数和分配/回收的吞吐量
+//
+
+#define __STL_ALLOC_STATS
+#include <chrono>
+#include <stdio.h>
+#include "../second_level_alloc.h"
+
+using namespace my_std;
+
+const size_t ROUNDS = 50;
+const size_t LIVE = 20000;      // 每一轮同时存活的内存块个数
+
+// 简单的线性同余随机数，保证两次运行的请求序列完全相同
+static size_t next_size(unsigned long long& seed) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    unsigned r = (unsigned)(seed >> 33);
+    if (r % 10 < 8) {
+        static const size_t hot[] = {24, 40, 48, 64};
+        return hot[r % 4];
+    }
+    return r % 4096 + 1;
+}
+
+template <class Alloc>
+static void run(const char* name, bool adaptive) {
+    Alloc::set_adaptive_refill(adaptive);
+    static void* blocks[LIVE];
+    static size_t sizes[LIVE];
+    unsigned long long seed = 42;
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < LIVE; i++) {
+            sizes[i] = next_size(seed);
+            blocks[i] = Alloc::allocate(sizes[i]);
+        }
+        for (size_t i = 0; i < LIVE; i++)
+            Alloc::deallocate(blocks[i], sizes[i]);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    __alloc_stats_snapshot stats = Alloc::stats();
+    size_t refills = 0;
+    for (int i = 0; i < __NFREELISTS; i++)
+        refills += stats.classes[i].refill_calls;
+    double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+    printf("%-22s refills: %8zu  heap: %8zu KB  %.2f ns/op\n",
+           name, refills, stats.heap_size / 1024, ns / (2.0 * ROUNDS * LIVE));
+}
+
+int main() {
+    // 不同的inst参数是互相独立的分配器，各自从空的内存池开始
+    run<__default_alloc_template<false, 100> >("fixed (single)", false);
+    run<__default_alloc_template<false, 101> >("adaptive (single)", true);
+    run<__default_alloc_template<true, 102> >("fixed (threads)", false);
+    run<__default_alloc_template<true, 103> >("adaptive (threads)", true);
+    return 0;
+}
@@ -7,16 +7,49 @@
 
 #include <new>
 #include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #define __THROW_BAD_ALLOC throw std::bad_alloc()
 
+// 统计模式：编译时定义__STL_ALLOC_STATS，两级分配器会统计各种调用次数（见stats()）
+// 没有定义时__ALLOC_STAT中的语句全部被去掉，计数器也不存在，没有任何额外开销
+#ifdef __STL_ALLOC_STATS
+#define __ALLOC_STAT(stmt) stmt
+#else
+#define __ALLOC_STAT(stmt)
+#endif
+
 namespace my_std {
 
 /*
- * 实现第一级分配器，针对大于128Bytes内存块的管理
+ * 实现第一级分配器，针对大于32KB内存块的管理
  * 主要是直接使用malloc()和free()来实现
+ *
+ * Linux上不小于__MREMAP_THRESHOLD的内存块直接通过匿名mmap申请，reallocate()时通过mremap扩大或缩小，
+ * 内核只需要修改页表，不需要拷贝数据，几GB的vector扩容也不会拷贝（见vector::insert_aux）
+ * 所以deallocate()/reallocate()传入的大小必须与申请时相同，分配器根据大小判断内存块是malloc的还是mmap的
  */
 
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+#define __STL_USE_MREMAP
+    const static size_t __MREMAP_THRESHOLD = 16 * 1024 * 1024;    // 不小于这个大小的内存块通过mmap申请
+#endif
+
+// 第一级分配器的统计数据，由stats()返回
+    struct __malloc_alloc_stats {
+        size_t allocate_calls;
+        size_t deallocate_calls;
+        size_t reallocate_calls;
+        size_t oom_calls;           // 进入oom_malloc()/oom_realloc()的次数
+        size_t bytes_in_use;        // 已分配但还没有回收的字节数
+        size_t bytes_high_water;    // bytes_in_use的最大值
+    };
+
 // 没有template类型参数，只有非类型参数inst，在类中没有使用。但是可以通过传入不同的值来生成不同的类
     template <int inst>
     class __malloc_alloc_template {
@@ -25,7 +58,7 @@ namespace my_std {
         // 第三个是函数指针（指向错误处理函数的指针），所代表的函数将用来处理内存不足的情况
         // oom : out of memory.
         static void *oom_malloc(size_t);
-        static void *oom_realloc(void *, size_t);
+        static void *oom_realloc(void *, size_t, size_t);
         // 处理内存分配出错（也就是oom）的情况，由用户指定内存分配出错后执行的操作
         // 与c++的set_new_handler()功能相似，只不过这个是我们自己定义的
         // 只有使用::operator new()和::operator delete()才可以使用set_new_handler()来指定操作
@@ -33,31 +66,122 @@ namespace my_std {
         // 一般都是尝试释放一部分内存空间，使得有足够的空间进行分配
         static void (* __malloc_alloc_oom_handler)();
 
+#ifdef __STL_ALLOC_STATS
+        // 第一级分配器可能被多个线程同时使用，所以计数器都是原子变量
+        static std::atomic<size_t> allocate_calls;
+        static std::atomic<size_t> deallocate_calls;
+        static std::atomic<size_t> reallocate_calls;
+        static std::atomic<size_t> oom_calls;
+        static std::atomic<size_t> bytes_in_use;
+        static std::atomic<size_t> bytes_high_water;
+
+        // 已分配字节数增加n，同时更新最大值
+        static void count_bytes(size_t n) {
+            size_t now = bytes_in_use.fetch_add(n, std::memory_order_relaxed) + n;
+            size_t high = bytes_high_water.load(std::memory_order_relaxed);
+            while (now > high && !bytes_high_water.compare_exchange_weak(high, now, std::memory_order_relaxed)) {}
+        }
+#endif
+
+        // 以下三个函数根据大小选择malloc或者mmap，失败时返回0，由调用者决定是否进入oom处理
+#ifdef __STL_USE_MREMAP
+        static bool IS_MAPPED(size_t n) { return n >= __MREMAP_THRESHOLD; }
+
+        // 上调为页大小的倍数
+        static size_t PAGE_ROUND_UP(size_t n) {
+            size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            return (n + page - 1) & ~(page - 1);
+        }
+#endif
+
+        static void *raw_malloc(size_t n) {
+#ifdef __STL_USE_MREMAP
+            if (IS_MAPPED(n)) {
+                void* p = mmap(NULL, PAGE_ROUND_UP(n), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                return p == MAP_FAILED ? 0 : p;
+            }
+#endif
+            return malloc(n);
+        }
+
+        static void raw_free(void *p, size_t n) {
+#ifdef __STL_USE_MREMAP
+            if (IS_MAPPED(n)) {
+                munmap(p, PAGE_ROUND_UP(n));
+                return;
+            }
+#endif
+            (void) n;
+            free(p);
+        }
+
+        // 失败时p保持不变
+        static void *raw_realloc(void *p, size_t old_size, size_t new_size) {
+#ifdef __STL_USE_MREMAP
+            if (IS_MAPPED(old_size) && IS_MAPPED(new_size)) {
+                void* result = mremap(p, PAGE_ROUND_UP(old_size), PAGE_ROUND_UP(new_size), MREMAP_MAYMOVE);
+                return result == MAP_FAILED ? 0 : result;
+            }
+            // 从malloc换到mmap或者反过来，只能申请新的内存块再拷贝
+            if (IS_MAPPED(old_size) || IS_MAPPED(new_size)) {
+                void* result = raw_malloc(new_size);
+                if (result == 0)
+                    return 0;
+                memcpy(result, p, old_size < new_size ? old_size : new_size);
+                raw_free(p, old_size);
+                return result;
+            }
+#endif
+            (void) old_size;
+            return realloc(p, new_size);
+        }
+
     public:
 
         // 首先是分配内存空间函数allocate()，n为字节数
-        // 借助malloc(n)来申请内存空间
+        // 借助malloc(n)来申请内存空间，很大的内存块使用mmap
         static void *allocate(size_t n) {
-            void *result = malloc(n);       // 直接使用malloc()实现
+            __ALLOC_STAT(allocate_calls.fetch_add(1, std::memory_order_relaxed));
+            __ALLOC_STAT(count_bytes(n));
+            void *result = raw_malloc(n);       // 直接使用malloc()实现
             // 如果malloc()无法申请，则改用oom_malloc()
             if (result == 0)
                 result = oom_malloc(n);
             return result;
         }
 
-        // 释放内存空间函数deallocate()，p为需要释放的内存空间位置
-        // 直接使用free(p)
+        // 释放内存空间函数deallocate()，p为需要释放的内存空间位置，n必须与申请时的大小相同
+        // 直接使用free(p)，mmap申请的内存块使用munmap
         static void deallocate(void *p, size_t n) {
-            free(p);
+            __ALLOC_STAT(deallocate_calls.fetch_add(1, std::memory_order_relaxed));
+            __ALLOC_STAT(bytes_in_use.fetch_sub(n, std::memory_order_relaxed));
+            raw_free(p, n);
         }
 
         // 重分配内存空间函数reallocate()，p为需要重分配的内存空间位置
-        // 也是借助reallocate(p, new_size)来实现
+        // 也是借助realloc(p, new_size)来实现，mmap申请的内存块使用mremap
         static void *reallocate(void *p, size_t old_size, size_t new_size) {
-            void *result = realloc(p, new_size);
+            __ALLOC_STAT(reallocate_calls.fetch_add(1, std::memory_order_relaxed));
+            __ALLOC_STAT(bytes_in_use.fetch_sub(old_size, std::memory_order_relaxed));
+            __ALLOC_STAT(count_bytes(new_size));
+            void *result = raw_realloc(p, old_size, new_size);
             // 如果realloc()无法分配，则改用oom_realloc()
             if (result == 0)
-                result = oom_realloc(p, new_size);
+                result = oom_realloc(p, old_size, new_size);
+            return result;
+        }
+
+        // 返回统计数据的快照。没有定义__STL_ALLOC_STATS时全部为0
+        static __malloc_alloc_stats stats() {
+            __malloc_alloc_stats result = {0, 0, 0, 0, 0, 0};
+#ifdef __STL_ALLOC_STATS
+            result.allocate_calls = allocate_calls.load(std::memory_order_relaxed);
+            result.deallocate_calls = deallocate_calls.load(std::memory_order_relaxed);
+            result.reallocate_calls = reallocate_calls.load(std::memory_order_relaxed);
+            result.oom_calls = oom_calls.load(std::memory_order_relaxed);
+            result.bytes_in_use = bytes_in_use.load(std::memory_order_relaxed);
+            result.bytes_high_water = bytes_high_water.load(std::memory_order_relaxed);
+#endif
             return result;
         }
     };
@@ -67,11 +191,32 @@ namespace my_std {
     template <int inst>
     void (* __malloc_alloc_template<inst>::__malloc_alloc_oom_handler)() = 0;
 
+#ifdef __STL_ALLOC_STATS
+    template <int inst>
+    std::atomic<size_t> __malloc_alloc_template<inst>::allocate_calls(0);
+
+    template <int inst>
+    std::atomic<size_t> __malloc_alloc_template<inst>::deallocate_calls(0);
+
+    template <int inst>
+    std::atomic<size_t> __malloc_alloc_template<inst>::reallocate_calls(0);
+
+    template <int inst>
+    std::atomic<size_t> __malloc_alloc_template<inst>::oom_calls(0);
+
+    template <int inst>
+    std::atomic<size_t> __malloc_alloc_template<inst>::bytes_in_use(0);
+
+    template <int inst>
+    std::atomic<size_t> __malloc_alloc_template<inst>::bytes_high_water(0);
+#endif
+
 // 接着是oom_malloc()，负责在oom时执行分配内存空间的操作
     template <int inst>
     void* __malloc_alloc_template<inst>::oom_malloc(size_t n) {
         void (* my_alloc_handler)();
         void* result;
+        __ALLOC_STAT(oom_calls.fetch_add(1, std::memory_order_relaxed));
 
         // 循环，不断尝试释放、分配、再释放、再分配
         while (true) {
@@ -83,7 +228,7 @@ namespace my_std {
             // 如果错误处理函数不为空，调用错误处理函数，在函数中企图释放内存
             my_alloc_handler();
             // 接着重新尝试分配内存空间
-            result = malloc(n);
+            result = raw_malloc(n);
             // 如果分配成功，则返回；如果失败，则重新释放后再分配
             if (result != 0)
                 return result;
@@ -93,9 +238,10 @@ namespace my_std {
 
 // 最后是oom_realloc()，负责在oom时执行内存空间重分配的操作
     template <int inst>
-    void* __malloc_alloc_template<inst>::oom_realloc(void *p, size_t new_size) {
+    void* __malloc_alloc_template<inst>::oom_realloc(void *p, size_t old_size, size_t new_size) {
         void* result;
         void (* my_alloc_handler)();
+        __ALLOC_STAT(oom_calls.fetch_add(1, std::memory_order_relaxed));
 
         // 循环，不断尝试释放、分配、再释放、再分配
         while (true) {
@@ -107,7 +253,7 @@ namespace my_std {
             // 如果错误处理函数不为空，调用错误处理函数，在函数中企图释放内存
             my_alloc_handler();
             // 接着重新尝试分配内存空间
-            result = realloc(p, new_size);
+            result = raw_realloc(p, old_size, new_size);
             // 如果分配成功，则返回；如果失败，则重新释放后再分配
             if (result != 0)
                 return result;
@@ -78,6 +78,12 @@ namespace JJ {
             typedef allocator<U> other;
         };
 
+        allocator() {}
+
+        // rebind之后的分配器可以从原来的分配器构造，allocator没有状态，什么都不用做
+        template <class U>
+        allocator(const allocator<U>&) {}
+
         // 主要负责分配n个T对象大小的内存空间，借助_allocate()实现
         // hint用于局部性
         pointer allocate(size_type n, const void* hind = 0) {
@@ -114,6 +120,13 @@ namespace JJ {
 
     };
 
+    // allocator没有状态，任意两个allocator分配的内存都可以互相回收
+    template <class T, class U>
+    inline bool operator==(const allocator<T>&, const allocator<U>&) { return true; }
+
+    template <class T, class U>
+    inline bool operator!=(const allocator<T>&, const allocator<U>&) { return false; }
+
 }
 
 
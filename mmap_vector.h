@@ -0,0 +1,330 @@
+//
+// 以文件为存储的vector（内存映射）
+//
+
+#ifndef STL_MY_ALLOCATOR_MMAP_VECTOR_H
+#define STL_MY_ALLOCATOR_MMAP_VECTOR_H
+
+#include <type_traits>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "first_level_alloc.h"
+#include "my_allocator.h"
+#include "my_vector.h"
+
+/*
+ * mmap_vector<T, Growth>，元素直接存放在通过mmap(MAP_SHARED)映射的文件中，只能存放可以按字节拷贝（trivially copyable）的T
+ * 启动时不需要把几十GB的记录逐个push_back进vector：open()只是建立映射，页在第一次访问时才由内核从page cache中读入，
+ * 多个进程映射同一个文件时共用page cache中的同一份数据
+ * 迭代器就是T*，与vector相同，my_stl_algo.h中的sort()、lower_bound()等可以直接使用
+ *
+ * 用法：
+ *   mmap_vector<record> v;
+ *   if (!v.open("records.bin", __MMAP_READ_ONLY)) ...   // 失败时返回false，errno为失败的原因
+ *   v.advise(MADV_RANDOM);                              // 按访问模式给内核提示（madvise）
+ *   lower_bound(v.begin(), v.end(), key);
+ *
+ * 打开方式：
+ *   __MMAP_READ_ONLY：只读打开，文件不会被修改；push_back、append、erase、增加元素的resize以及扩容都抛出bad_alloc，
+ *                     通过非const的operator[]、front()、迭代器等写元素时不会出错，但只写到本进程私有的页上（MAP_PRIVATE，写时复制）
+ *   __MMAP_READ_WRITE：读写映射，文件不存在时创建，原有的记录保留；对元素的修改直接写入page cache，由内核写回文件
+ *   __MMAP_TRUNCATE：与__MMAP_READ_WRITE相同，只是打开时清空文件
+ * 文件的长度必须是sizeof(T)的整数倍，每sizeof(T)个字节是一个元素；否则open()失败，errno为EINVAL，
+ * 因为可写时close()要把文件截断为整数个元素，末尾不足一个元素的字节会被删掉
+ *
+ * 扩容时先用ftruncate()把文件扩大到新的容量，再用mremap()扩大映射（内核只修改页表，不拷贝数据），
+ * 没有mremap的系统上重新mmap一次；新的容量由增长策略决定，默认按页增长（见my_vector.h中的__vector_growth_paged）
+ * 打开期间文件的长度是容量而不是元素个数，close()（以及析构）时把文件截断为size()个元素，
+ * 截断失败时close()返回false（析构函数无法报告，需要确认结果时先调用close()）
+ * 扩容之后映射的地址可能改变，原来的迭代器、指针都会失效
+ */
+
+enum __mmap_mode {
+    __MMAP_READ_ONLY,
+    __MMAP_READ_WRITE,
+    __MMAP_TRUNCATE
+};
+
+template <class T, class Growth = __vector_growth_paged>
+class mmap_vector {
+    static_assert(std::is_trivially_copyable<T>::value, "mmap_vector can only hold trivially copyable types");
+
+public:
+    typedef T           value_type;
+    typedef value_type* pointer;
+    typedef value_type* iterator;
+    typedef const value_type* const_iterator;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef size_t      size_type;
+    typedef ptrdiff_t   difference_type;
+
+protected:
+    int fd;                     // 映射的文件，-1表示没有打开
+    bool writable;
+    iterator start;             // 映射的起始地址，容量为0时为NULL
+    iterator finish;
+    iterator end_of_storage;    // 文件中最后一个元素之后的位置
+
+    static size_t page_round_up(size_t n) {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        return (n + page - 1) & ~(page - 1);
+    }
+
+    // 只读时也映射为可写，但是是私有映射：通过非const的引用写元素时只复制这一页，不会写回文件，也不会因为页不可写而崩溃
+    int map_flags() const { return writable ? MAP_SHARED : MAP_PRIVATE; }
+
+    // 只读打开时，会修改元素的操作与扩容相同，抛出bad_alloc
+    void check_writable() const {
+        if (!writable)
+            __THROW_BAD_ALLOC;
+    }
+
+    // 容量为n个元素时映射的长度
+    static size_t map_bytes(size_type n) { return page_round_up(n * sizeof(T)); }
+
+    // 把文件的长度调整为n个元素
+    bool resize_file(size_type n) { return ftruncate(fd, (off_t)(n * sizeof(T))) == 0; }
+
+    // 把文件和映射都调整为new_cap个元素，元素个数不变，失败时抛出bad_alloc，原来的映射保持不变
+    void remap(size_type new_cap) {
+        const size_type n = size();
+        const size_t old_map = start == NULL ? 0 : map_bytes(capacity());
+        const size_t new_map = map_bytes(new_cap);
+        if (fd < 0 || !resize_file(new_cap))
+            __THROW_BAD_ALLOC;
+        void* p = start;
+        if (new_map == 0) {
+            if (start != NULL)
+                munmap(start, old_map);
+            p = NULL;
+        }
+        else if (start == NULL) {
+            p = mmap(NULL, new_map, PROT_READ | PROT_WRITE, map_flags(), fd, 0);
+        }
+        else if (new_map != old_map) {
+#ifdef __STL_USE_MREMAP
+            p = mremap(start, old_map, new_map, MREMAP_MAYMOVE);
+#else
+            // 新旧两个映射都是同一个文件，先建立新的映射再解除旧的，数据不需要拷贝
+            p = mmap(NULL, new_map, PROT_READ | PROT_WRITE, map_flags(), fd, 0);
+            if (p != MAP_FAILED)
+                munmap(start, old_map);
+#endif
+        }
+        if (p == MAP_FAILED) {
+            // 映射失败，尽量把文件恢复为原来的容量，原来的映射仍然有效
+            int saved = errno;
+            resize_file(capacity());
+            errno = saved;
+            __THROW_BAD_ALLOC;
+        }
+        start = (iterator) p;
+        finish = start + n;
+        end_of_storage = start + new_cap;
+    }
+
+    void steal(mmap_vector& x) {
+        fd = x.fd;
+        writable = x.writable;
+        start = x.start;
+        finish = x.finish;
+        end_of_storage = x.end_of_storage;
+        x.fd = -1;
+        x.start = x.finish = x.end_of_storage = 0;
+    }
+
+public:
+    mmap_vector() : fd(-1), writable(false), start(0), finish(0), end_of_storage(0) {}
+
+    mmap_vector(mmap_vector&& x) noexcept { steal(x); }
+
+    mmap_vector& operator=(mmap_vector&& x) noexcept {
+        if (&x != this) {
+            close();
+            steal(x);
+        }
+        return *this;
+    }
+
+    mmap_vector(const mmap_vector&) = delete;
+    mmap_vector& operator=(const mmap_vector&) = delete;
+
+    ~mmap_vector() { close(); }
+
+    // 打开并映射path，原来打开的文件先关闭；失败时返回false，errno为失败的原因
+    // 文件的长度不是sizeof(T)的整数倍时失败，errno为EINVAL
+    bool open(const char* path, __mmap_mode mode = __MMAP_READ_ONLY) {
+        close();
+        int flags = O_RDONLY;
+        if (mode == __MMAP_READ_WRITE)
+            flags = O_RDWR | O_CREAT;
+        else if (mode == __MMAP_TRUNCATE)
+            flags = O_RDWR | O_CREAT | O_TRUNC;
+        int f = ::open(path, flags, 0644);
+        if (f < 0)
+            return false;
+        struct stat st;
+        if (fstat(f, &st) != 0) {
+            ::close(f);
+            return false;
+        }
+        if ((size_type) st.st_size % sizeof(T) != 0) {
+            ::close(f);
+            errno = EINVAL;
+            return false;
+        }
+        const size_type n = (size_type) st.st_size / sizeof(T);
+        void* p = NULL;
+        if (n != 0) {
+            p = mmap(NULL, map_bytes(n), PROT_READ | PROT_WRITE, mode == __MMAP_READ_ONLY ? MAP_PRIVATE : MAP_SHARED, f, 0);
+            if (p == MAP_FAILED) {
+                ::close(f);
+                return false;
+            }
+        }
+        fd = f;
+        writable = mode != __MMAP_READ_ONLY;
+        start = (iterator) p;
+        finish = end_of_storage = start + n;
+        return true;
+    }
+
+    bool is_open() const { return fd >= 0; }
+
+    // 解除映射，可写时把文件截断为size()个元素，然后关闭文件
+    // 任何一步失败都返回false，errno为第一个失败的原因；无论成功与否，之后都不再持有这个文件
+    bool close() {
+        if (fd < 0)
+            return true;
+        bool ok = true;
+        int saved = 0;
+        if (start != NULL && munmap(start, map_bytes(capacity())) != 0) {
+            ok = false;
+            saved = errno;
+        }
+        if (writable && !resize_file(size()) && ok) {
+            ok = false;
+            saved = errno;
+        }
+        if (::close(fd) != 0 && ok) {
+            ok = false;
+            saved = errno;
+        }
+        fd = -1;
+        start = finish = end_of_storage = 0;
+        if (!ok)
+            errno = saved;
+        return ok;
+    }
+
+    iterator begin() { return start; }
+    iterator end() { return finish; }
+    const_iterator begin() const { return start; }
+    const_iterator end() const { return finish; }
+    size_type size() const { return (size_type)(finish - start); }
+    size_type capacity() const { return (size_type)(end_of_storage - start); }
+    bool empty() const { return start == finish; }
+    reference operator[](size_type n) { return start[n]; }
+    const_reference operator[](size_type n) const { return start[n]; }
+    reference front() { return *start; }
+    reference back() { return *(finish - 1); }
+    pointer data() { return start; }
+
+    // 把文件和映射扩大到至少n个元素
+    void reserve(size_type n) {
+        if (n > capacity())
+            remap(n);
+    }
+
+    // 把文件和映射缩小到size()个元素
+    void shrink_to_fit() {
+        if (finish != end_of_storage)
+            remap(size());
+    }
+
+    void push_back(const T& x) {
+        check_writable();
+        if (finish == end_of_storage) {
+            T x_copy = x;       // x可能就是映射中的元素，扩容之后地址就失效了
+            remap(Growth::next_capacity(size(), size() + 1, sizeof(T)));
+            construct(finish, x_copy);
+        }
+        else {
+            construct(finish, x);
+        }
+        ++finish;
+    }
+
+    // 在尾端追加[first, last)，容量不够时只扩容一次，然后整块拷贝
+    void append(const T* first, const T* last) {
+        const size_type n = (size_type)(last - first);
+        if (n == 0)
+            return;
+        check_writable();
+        if (size() + n > capacity()) {
+            // 区间在映射之内时，扩容之后按偏移重新定位
+            const bool inside = first >= start && first < end_of_storage;
+            const size_type offset = inside ? (size_type)(first - start) : 0;
+            remap(Growth::next_capacity(size(), size() + n, sizeof(T)));
+            if (inside)
+                first = start + offset;
+        }
+        memmove((void*) finish, (const void*) first, n * sizeof(T));
+        finish += n;
+    }
+
+    void pop_back() { --finish; }
+
+    iterator erase(iterator first, iterator last) {
+        check_writable();
+        memmove((void*) first, (const void*) last, (size_type)(finish - last) * sizeof(T));
+        finish -= last - first;
+        return first;
+    }
+
+    iterator erase(iterator position) { return erase(position, position + 1); }
+
+    void resize(size_type new_size, const T& x) {
+        if (new_size <= size()) {
+            finish = start + new_size;
+            return;
+        }
+        check_writable();
+        T x_copy = x;
+        reserve(new_size);
+        for (iterator end = start + new_size; finish != end; ++finish)
+            construct(finish, x_copy);
+    }
+
+    void resize(size_type new_size) { resize(new_size, T()); }
+
+    void clear() { finish = start; }
+
+    // 给内核的访问模式提示，例如MADV_SEQUENTIAL（顺序扫描，加大预读）、MADV_RANDOM（随机访问，关闭预读）、
+    // MADV_WILLNEED（马上要用，提前读入）、MADV_DONTNEED（暂时不用，可以回收这部分page cache）
+    bool advise(int advice) {
+        return start == NULL || madvise((void*) start, map_bytes(capacity()), advice) == 0;
+    }
+
+    // 只对[first, last)所在的页给出提示
+    bool advise(iterator first, iterator last, int advice) {
+        if (first == last)
+            return true;
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        char* begin = (char*)((uintptr_t) first & ~(uintptr_t)(page - 1));
+        return madvise((void*) begin, (size_t)((char*) last - begin), advice) == 0;
+    }
+
+    // 把修改过的页写回文件，async为true时只是安排写回，不等待完成；失败时返回false，errno为失败的原因
+    bool sync(bool async = false) {
+        return start == NULL || msync((void*) start, map_bytes(capacity()), async ? MS_ASYNC : MS_SYNC) == 0;
+    }
+};
+
+#endif //STL_MY_ALLOCATOR_MMAP_VECTOR_H
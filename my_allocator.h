@@ -6,6 +6,9 @@
 #define STL_MY_ALLOCATOR_MY_ALLOCATOR_H
 
 #include <new>          // 为了使用placement new，在已申请的内存空间上对对象进行初始化
+#include <type_traits>  // is_empty，判断分配器是否有状态
+#include <utility>      // forward、move_if_noexcept
+#include <string.h>
 #include "second_level_alloc.h"
 #include "my_type_traits.h"
 
@@ -24,6 +27,12 @@ namespace my_std {
         new(p) T1(value);       // 使用placement new，调用的构造函数是T1::T1(value)
     }
 
+// 带任意个参数的construct，参数完美转发给T的构造函数，用于移动构造和emplace
+    template <class T, class... Args>
+    inline void construct(T* p, Args&&... args) {
+        new(p) T(std::forward<Args>(args)...);
+    }
+
 // 最基础的destroy函数，接受一个指向需要析构的对象的内存空间的指针p
     template <class T>
     inline void destroy(T* p) {
@@ -80,39 +89,414 @@ namespace my_std {
  * 接着就是实现分配内存空间和回收内存空间的函数
  * allocate()和deallocate()
  * 这个分配器分成两个分配器，第一级分配器和第二级分配器
- * 第一级分配器主要负责管理大于128字节的内存块，而第二级分配器主要负责管理小于128字节的小内存块，基于memory pool整理
+ * 第一级分配器主要负责管理大于32KB的内存块，而第二级分配器主要负责管理小于32KB的小内存块，基于memory pool整理
+ */
+
+/*
+ * 按指定边界对齐的分配
+ * 第二级分配器只保证__ALIGN（8Bytes）对齐，第一级分配器保证malloc的对齐（一般是16Bytes）
+ * 需要更大的对齐（例如alignas(32)的SIMD类型、按cache line对齐的每线程数据）时，多申请align个字节，
+ * 在其中找到对齐的位置返回，并把底层分配器返回的原始地址保存在对齐地址的前面，回收时取出原始地址
+ * |__原始地址__|...|__保存的原始地址__|__对齐的地址（返回给用户）__........|
+ * 要求align是2的幂，并且不小于sizeof(void*)
  */
+    template <class Alloc>
+    inline void* __aligned_allocate(Alloc& a, size_t bytes, size_t align) {
+        char* raw = (char*) a.allocate(bytes + align);
+        // 原始地址至少按sizeof(void*)对齐，所以向后移动一个指针再上调到align的倍数，不会超出多申请的align个字节
+        char* aligned = (char*)(((size_t)raw + sizeof(void*) + align - 1) & ~(align - 1));
+        ((void**)aligned)[-1] = raw;
+        return aligned;
+    }
+
+    template <class Alloc>
+    inline void __aligned_deallocate(Alloc& a, void* p, size_t bytes, size_t align) {
+        a.deallocate(((void**)p)[-1], bytes + align);
+    }
+
+// 元素是否可以按字节搬动：把对象的字节拷贝到新的地址之后，直接把旧的地址当作未初始化的内存，效果与移动构造再析构相同
+// 默认只有trivially copyable的类型可以，内部只保存指针、不保存指向自身的指针的类型（例如大多数句柄、智能指针）可以特化为true_type
+// vector扩容时，这样的元素可以通过分配器的reallocate()整块搬动，见vector::insert_aux
+    template <class T>
+    struct __is_trivially_relocatable : std::integral_constant<bool, std::is_trivially_copyable<T>::value> {};
+
+// 分配器是否提供reallocate(void* p, size_t old_size, size_t new_size)
+    template <class Alloc, class = void>
+    struct __has_reallocate : std::false_type {};
+
+    template <class Alloc>
+    struct __has_reallocate<Alloc, decltype((void) std::declval<Alloc&>().reallocate((void*)0, size_t(), size_t()))>
+            : std::true_type {};
+
+    template <class Alloc>
+    inline void* __alloc_reallocate(Alloc& a, void* p, size_t old_size, size_t new_size, std::true_type) {
+        return a.reallocate(p, old_size, new_size);
+    }
+
+    template <class Alloc>
+    inline void* __alloc_reallocate(Alloc& a, void* p, size_t old_size, size_t new_size, std::false_type) {
+        void* result = a.allocate(new_size);
+        memcpy(result, p, old_size < new_size ? old_size : new_size);
+        a.deallocate(p, old_size);
+        return result;
+    }
 
 // 首先使用一个类，内部封装了底层的两级分配器，相当于提供一个外层接口
 // 通过模板参数Alloc来决定使用的是哪一个底层的分配器
+// 不带分配器参数的版本只能用于无状态的分配器（两级分配器、arena等）
+// 带分配器参数的版本通过分配器实例来分配，容器都使用这个版本，所以也可以使用有状态的分配器
+// alignof(T)大于__ALIGN时，自动按alignof(T)对齐（见__aligned_allocate），所以容器不需要关心元素的对齐要求
     template <class T, class Alloc = __default_alloc_template<false, 1>>
     class simple_alloc {
+    private:
+        // 是否需要比底层分配器更大的对齐
+        const static bool over_aligned = alignof(T) > (size_t)__ALIGN;
+
+        // 记录模式下（__STL_ALLOC_TRACE）记录容器的每一次分配和回收，底层分配器不会重复记录，见alloc_trace.h
+        static void* raw_allocate(Alloc& a, size_t bytes) {
+            __ALLOC_TRACE(__alloc_trace_scope trace(__TRACE_ALLOCATE, bytes));
+            void* result = over_aligned ? __aligned_allocate(a, bytes, alignof(T)) : a.allocate(bytes);
+            __ALLOC_TRACE(trace.record(result));
+            return result;
+        }
+
+        static void raw_deallocate(Alloc& a, void* p, size_t bytes) {
+            __ALLOC_TRACE(__alloc_trace_scope trace(__TRACE_DEALLOCATE, bytes));
+            __ALLOC_TRACE(trace.record(p));
+            if (over_aligned)
+                __aligned_deallocate(a, p, bytes, alignof(T));
+            else
+                a.deallocate(p, bytes);
+        }
+
     public:
         // 用于分配内存空间，分配n个T大小的空间
         // 内部调用底层的allocate()，也就是两级分配器
         static T *allocate(size_t n) {
-            if (n == 0)
-                return 0;
-            return (T*) Alloc::allocate(n * sizeof(T));     // 将具体空间大小转换为字节
+            Alloc a;
+            return allocate(a, n);
         }
 
         // 分配一个T大小的空间
         static T *allocate(void) {
-            return (T*) Alloc::allocate(sizeof(T));
+            Alloc a;
+            return allocate(a);
         }
 
         // 回收p指向的内存中n个T大小的空间
         static void deallocate(T *p, size_t n) {
-            if (n != 0)
-                Alloc::deallocate(p, n * sizeof(T));
+            Alloc a;
+            deallocate(a, p, n);
         }
 
         // 回收一个T大小的空间
         static void deallocate(T *p) {
-            Alloc::deallocate(p, sizeof(T));
+            Alloc a;
+            deallocate(a, p);
+        }
+
+        // 以下是通过分配器实例a进行分配和回收的版本
+        static T *allocate(Alloc& a, size_t n) {
+            if (n == 0)
+                return 0;
+            return (T*) raw_allocate(a, n * sizeof(T));     // 将具体空间大小转换为字节
+        }
+
+        static T *allocate(Alloc& a) {
+            return (T*) raw_allocate(a, sizeof(T));
         }
 
+        static void deallocate(Alloc& a, T *p, size_t n) {
+            if (n != 0)
+                raw_deallocate(a, p, n * sizeof(T));
+        }
+
+        static void deallocate(Alloc& a, T *p) {
+            raw_deallocate(a, p, sizeof(T));
+        }
+
+        // 把p指向的old_n个T大小的空间调整为new_n个，内容按字节搬过去，返回新的地址
+        // 只能用于可以按字节搬动的元素（见__is_trivially_relocatable）
+        // 分配器提供reallocate()时交给它，例如第一级分配器可以原地扩大或者通过mremap重新映射，否则申请新的空间再拷贝
+        static T *reallocate(Alloc& a, T *p, size_t old_n, size_t new_n) {
+            if (old_n == 0)
+                return allocate(a, new_n);
+            if (new_n == 0) {
+                deallocate(a, p, old_n);
+                return 0;
+            }
+            // 需要额外对齐的空间，地址前面保存着原始指针，不能交给底层分配器的reallocate()
+            if (over_aligned || !__has_reallocate<Alloc>::value) {
+                T* result = allocate(a, new_n);
+                memcpy((void*)result, (void*)p, (old_n < new_n ? old_n : new_n) * sizeof(T));
+                deallocate(a, p, old_n);
+                return result;
+            }
+            __ALLOC_TRACE(__alloc_trace_scope trace(__TRACE_DEALLOCATE, old_n * sizeof(T)));
+            __ALLOC_TRACE(trace.record(p));
+            T* result = (T*) __alloc_reallocate(a, p, old_n * sizeof(T), new_n * sizeof(T), __has_reallocate<Alloc>());
+            __ALLOC_TRACE(trace.record(__TRACE_ALLOCATE, result, new_n * sizeof(T)));
+            return result;
+        }
+    };
+
+
+// 在result开始的未初始化空间上，用[first, last)的元素移动构造，返回构造结束的位置
+// 与std::move_if_noexcept相同，移动构造函数可能抛出异常而元素又可以拷贝时改为拷贝构造，这样出现异常时原来的元素不受影响
+// 构造失败时析构已经构造的元素，再抛出异常
+    template <class T>
+    inline T* __uninitialized_move_if_noexcept(T* first, T* last, T* result) {
+        T* cur = result;
+        try {
+            for (; first != last; ++first, ++cur)
+                construct(cur, std::move_if_noexcept(*first));
+        }
+        catch (...) {
+            destroy(result, cur);
+            throw;
+        }
+        return cur;
+    }
+
+    template <class T>
+    inline T* __uninitialized_default_n_aux(T* first, size_t n, std::true_type) {
+        return first + n;
+    }
+
+    template <class T>
+    inline T* __uninitialized_default_n_aux(T* first, size_t n, std::false_type) {
+        T* cur = first;
+        try {
+            for (; n > 0; --n, ++cur)
+                new(cur) T;
+        }
+        catch (...) {
+            destroy(first, cur);
+            throw;
+        }
+        return cur;
+    }
+
+// 在first开始的n个未初始化位置上默认初始化（default-initialize）元素，返回构造结束的位置
+// T可以平凡默认构造时（int、double、POD结构体等）默认初始化什么都不做，不会写入内存，元素的值是不确定的
+// 其他类型调用默认构造函数，构造失败时析构已经构造的元素，再抛出异常
+    template <class T>
+    inline T* __uninitialized_default_n(T* first, size_t n) {
+        return __uninitialized_default_n_aux(first, n, std::is_trivially_default_constructible<T>());
+    }
+
+/*
+ * --------------------------------------------------------------------------------------------------
+ * 有状态的分配器
+ * 两级分配器的allocate()/deallocate()都是静态函数，所有容器共用同一个内存池
+ * 为了让每个容器可以使用自己的内存池或者arena（例如每个分片、每个租户一个），容器内部保存一个分配器实例，通过实例来分配内存
+ * 分配器只需要提供allocate(size_t bytes)和deallocate(void* p, size_t bytes)两个函数（静态或者非静态都可以），以及拷贝构造
+ * 有状态的分配器还需要提供operator==，两个分配器相等表示一个分配的内存可以由另一个回收
+ * 无状态（空类）的分配器通过空基类优化（EBO）保存，不占用容器的空间
+ */
+
+// 分配器在容器拷贝、移动、交换时的传播规则，与std::allocator_traits相同，默认都不传播
+// 有状态的分配器可以特化这个模板来修改规则
+    template <class Alloc>
+    struct __allocator_traits {
+        // 容器拷贝赋值时，是否把分配器也赋值过去
+        static const bool propagate_on_container_copy_assignment = false;
+        // 容器移动赋值时，是否把分配器也移动过去
+        static const bool propagate_on_container_move_assignment = false;
+        // 容器交换时，是否把分配器也交换
+        static const bool propagate_on_container_swap = false;
+        // 空类的分配器没有状态，任意两个实例都相等
+        static const bool is_always_equal = std::is_empty<Alloc>::value;
+
+        // 拷贝构造容器时，新容器使用的分配器
+        static Alloc select_on_container_copy_construction(const Alloc& a) { return a; }
+    };
+
+    template <class Alloc>
+    inline bool __alloc_equal(const Alloc&, const Alloc&, std::true_type) { return true; }
+
+    template <class Alloc>
+    inline bool __alloc_equal(const Alloc& a, const Alloc& b, std::false_type) { return a == b; }
+
+// 判断两个分配器是否相等，也就是一个分配的内存能否由另一个回收
+// 无状态的分配器不需要提供operator==
+    template <class Alloc>
+    inline bool __alloc_equal(const Alloc& a, const Alloc& b) {
+        return __alloc_equal(a, b, std::integral_constant<bool, __allocator_traits<Alloc>::is_always_equal>());
+    }
+
+// 容器移动赋值时是否一定能直接接管对方的内存（分配器会传播，或者任意两个实例都相等）
+// 这时移动赋值既不申请内存也不逐个移动元素，容器据此把移动赋值声明为noexcept
+    template <class Alloc>
+    struct __move_assign_steals
+        : std::integral_constant<bool, __allocator_traits<Alloc>::propagate_on_container_move_assignment
+                                       || __allocator_traits<Alloc>::is_always_equal> {};
+
+// 容器保存分配器实例的基类
+// 有状态的分配器作为成员保存
+    template <class Alloc, bool = std::is_empty<Alloc>::value>
+    class __alloc_holder {
+    protected:
+        Alloc alloc_instance;
+
+        __alloc_holder(const Alloc& a) : alloc_instance(a) {}
+
+        Alloc& get_alloc() { return alloc_instance; }
+        const Alloc& get_alloc() const { return alloc_instance; }
+
+    public:
+        Alloc get_allocator() const { return alloc_instance; }
+    };
+
+// 无状态的分配器（空类）作为基类保存，空基类优化之后不占用空间
+    template <class Alloc>
+    class __alloc_holder<Alloc, true> : private Alloc {
+    protected:
+        __alloc_holder(const Alloc& a) : Alloc(a) {}
+
+        Alloc& get_alloc() { return *this; }
+        const Alloc& get_alloc() const { return *this; }
+
+    public:
+        Alloc get_allocator() const { return *this; }
+    };
+
+// 按照传播规则处理容器拷贝赋值、移动赋值、交换时的分配器
+    template <class Alloc>
+    inline void __propagate_on_copy_assign(Alloc& to, const Alloc& from) {
+        if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment)
+            to = from;
+    }
+
+    template <class Alloc>
+    inline void __propagate_on_move_assign(Alloc& to, Alloc& from) {
+        if (__allocator_traits<Alloc>::propagate_on_container_move_assignment)
+            to = std::move(from);
+    }
+
+    template <class Alloc>
+    inline void __propagate_on_swap(Alloc& a, Alloc& b) {
+        if (__allocator_traits<Alloc>::propagate_on_container_swap) {
+            Alloc tmp = a;
+            a = b;
+            b = tmp;
+        }
+    }
+
+    const static size_t __CACHE_LINE_SIZE = 64;     // cache line的大小
+
+/*
+ * 对齐分配器适配器，把Alloc分配的每一块内存都按Align对齐，可以作为容器的Alloc模板参数
+ * 用于需要比元素本身的alignof更大的对齐的场合，例如让vector/deque的缓冲区按cache line（64Bytes）对齐，
+ * SIMD代码可以使用对齐的load/store，每个线程的槽位也不会和其他数据共享cache line：
+ *   vector<float, __aligned_alloc<alloc, __CACHE_LINE_SIZE> > v;
+ *   deque<int, __aligned_alloc<alloc, __CACHE_LINE_SIZE> > d;
+ * 每次分配额外多用Align个字节（见__aligned_allocate），所以只适合vector/deque这样按大块分配的容器，
+ * 节点容器的元素需要对齐时直接给元素类型加上alignas，simple_alloc会自动处理
+ * Alloc为空类时通过私有继承保存，适配器本身也是空类，不占用容器的空间
+ */
+    template <class Alloc, size_t Align>
+    class __aligned_alloc : private Alloc {
+        static_assert((Align & (Align - 1)) == 0 && Align >= sizeof(void*),
+                      "Align must be a power of two and at least sizeof(void*)");
+    public:
+        __aligned_alloc() {}
+        explicit __aligned_alloc(const Alloc& a) : Alloc(a) {}
+
+        void* allocate(size_t n) { return __aligned_allocate(inner(), n, Align); }
+        void deallocate(void* p, size_t n) { __aligned_deallocate(inner(), p, n, Align); }
+
+        Alloc& inner() { return *this; }
+        const Alloc& inner() const { return *this; }
+
+        bool operator==(const __aligned_alloc& x) const { return __alloc_equal(inner(), x.inner()); }
+        bool operator!=(const __aligned_alloc& x) const { return !(*this == x); }
+    };
+
+// 对齐分配器适配器的传播规则与被适配的分配器相同
+    template <class Alloc, size_t Align>
+    struct __allocator_traits<__aligned_alloc<Alloc, Align> > {
+        typedef __aligned_alloc<Alloc, Align> allocator_type;
+
+        static const bool propagate_on_container_copy_assignment = __allocator_traits<Alloc>::propagate_on_container_copy_assignment;
+        static const bool propagate_on_container_move_assignment = __allocator_traits<Alloc>::propagate_on_container_move_assignment;
+        static const bool propagate_on_container_swap = __allocator_traits<Alloc>::propagate_on_container_swap;
+        static const bool is_always_equal = __allocator_traits<Alloc>::is_always_equal;
+
+        static allocator_type select_on_container_copy_construction(const allocator_type& a) {
+            return allocator_type(__allocator_traits<Alloc>::select_on_container_copy_construction(a.inner()));
+        }
+    };
+
+/*
+ * 符合标准Allocator要求的适配器，底层转发给Alloc（默认是多线程版本的第二级分配器）
+ * simple_alloc只是一组静态函数，没有rebind、相等比较和传播规则，不能交给std容器使用
+ * 这个适配器补齐了这些要求，std::vector、std::unordered_map以及第三方代码都可以使用我们的内存池：
+ *   std::unordered_map<int, std::string, std::hash<int>, std::equal_to<int>,
+ *                      __allocator<std::pair<const int, std::string> > > m;
+ * 小内存块走内存池的free-list，大于__MAX_BYTES的交给第一级分配器，对齐和记录模式与simple_alloc相同
+ * Alloc也可以是有状态的分配器（例如__arena_allocator），此时需要把分配器实例传给构造函数，
+ * 传播规则和相等比较都按照Alloc的__allocator_traits
+ */
+    template <class T, class Alloc = __default_alloc_template<true, 0> >
+    class __allocator : private __alloc_holder<Alloc> {
+    private:
+        typedef __alloc_holder<Alloc> alloc_base;
+        typedef simple_alloc<T, Alloc> data_allocator;
+
+        template <class U, class A> friend class __allocator;
+
+    public:
+        typedef T               value_type;
+        typedef T*              pointer;
+        typedef const T*        const_pointer;
+        typedef T&              reference;
+        typedef const T&        const_reference;
+        typedef size_t          size_type;
+        typedef ptrdiff_t       difference_type;
+
+        template <class U>
+        struct rebind {
+            typedef __allocator<U, Alloc> other;
+        };
+
+        typedef std::integral_constant<bool, __allocator_traits<Alloc>::propagate_on_container_copy_assignment>
+                propagate_on_container_copy_assignment;
+        typedef std::integral_constant<bool, __allocator_traits<Alloc>::propagate_on_container_move_assignment>
+                propagate_on_container_move_assignment;
+        typedef std::integral_constant<bool, __allocator_traits<Alloc>::propagate_on_container_swap>
+                propagate_on_container_swap;
+        typedef std::integral_constant<bool, __allocator_traits<Alloc>::is_always_equal> is_always_equal;
+
+        __allocator() : alloc_base(Alloc()) {}
+        explicit __allocator(const Alloc& a) : alloc_base(a) {}
+
+        // rebind之后的分配器使用同一个底层分配器
+        template <class U>
+        __allocator(const __allocator<U, Alloc>& x) : alloc_base(x.get_alloc()) {}
+
+        T* allocate(size_type n, const void* = 0) {
+            if (n > max_size())
+                throw std::bad_alloc();
+            return data_allocator::allocate(this->get_alloc(), n);
+        }
+
+        void deallocate(T* p, size_type n) { data_allocator::deallocate(this->get_alloc(), p, n); }
+
+        size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+        __allocator select_on_container_copy_construction() const {
+            return __allocator(__allocator_traits<Alloc>::select_on_container_copy_construction(this->get_alloc()));
+        }
+
+        // 底层的分配器
+        const Alloc& underlying() const { return this->get_alloc(); }
+
+        template <class U>
+        bool operator==(const __allocator<U, Alloc>& x) const { return __alloc_equal(this->get_alloc(), x.get_alloc()); }
 
+        template <class U>
+        bool operator!=(const __allocator<U, Alloc>& x) const { return !(*this == x); }
     };
 }
 
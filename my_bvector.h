@@ -0,0 +1,641 @@
+//
+// 按位存储的vector<bool>
+//
+
+#ifndef STL_MY_ALLOCATOR_MY_BVECTOR_H
+#define STL_MY_ALLOCATOR_MY_BVECTOR_H
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include "my_allocator.h"
+#include "my_vector.h"
+
+/*
+ * vector<bool, Alloc, Growth>的特化版本，与SGI STL的bit_vector相同，每个元素只占1位
+ * 元素按64位的字（__bit_word）存放，第i个元素是第i / 64个字的第i % 64位：
+ * |__字0：元素0~63__|__字1：元素64~127__|......
+ * 内存只有主模板（每个元素1Byte）的1/8，遍历时cache能装下8倍的元素
+ *
+ * 不能返回bool&，operator[]和迭代器返回代理对象__bit_reference，通过它读写对应的位
+ * 迭代器__bit_iterator由字的地址和位的偏移组成，是随机访问迭代器
+ *
+ * count、find、fill、copy、copy_backward针对__bit_iterator重载，整个字一起处理，不再逐位进行：
+ *   count：每个字一次popcount（用-mpopcnt或者-march=native编译时就是一条popcnt指令）
+ *   find：跳过全0（找false时全1）的字，找到之后用ctz得到位的偏移
+ *   fill：中间的字直接整个赋值，首尾不完整的字用掩码
+ *   copy：每次搬动一个字，源和目的的偏移不同时由相邻两个字拼出来
+ * 两个vector<bool>之间的&=、|=、^=以及flip()都是逐字的简单循环，打开优化时编译器会自动向量化成SIMD指令
+ * 直接调用std::count等带std::前缀的版本不会用到这里的重载
+ */
+
+typedef uint64_t __bit_word;
+const static int __WORD_BIT = 64;       // 一个字的位数
+
+inline int __bit_popcount(__bit_word x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x != 0; x &= x - 1)
+        ++n;
+    return n;
+#endif
+}
+
+inline int __bit_lowest(__bit_word x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int bit = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// 第offset位及以上的位为1
+inline __bit_word __bit_mask_from(unsigned int offset) { return ~(__bit_word)0 << offset; }
+
+// 第offset位以下的位为1
+inline __bit_word __bit_mask_below(unsigned int offset) {
+    return offset == 0 ? 0 : ~(__bit_word)0 >> (__WORD_BIT - offset);
+}
+
+// 一个位的代理引用
+struct __bit_reference {
+    __bit_word* p;
+    __bit_word mask;
+
+    __bit_reference(__bit_word* x, __bit_word y) : p(x), mask(y) {}
+
+    operator bool() const { return (*p & mask) != 0; }
+
+    __bit_reference& operator=(bool x) {
+        if (x)
+            *p |= mask;
+        else
+            *p &= ~mask;
+        return *this;
+    }
+
+    __bit_reference& operator=(const __bit_reference& x) { return *this = bool(x); }
+
+    bool operator==(const __bit_reference& x) const { return bool(*this) == bool(x); }
+    bool operator<(const __bit_reference& x) const { return !bool(*this) && bool(x); }
+
+    void flip() { *p ^= mask; }
+};
+
+// 代理引用是临时对象，交换的是两个位的值
+inline void swap(__bit_reference x, __bit_reference y) {
+    bool tmp = x;
+    x = y;
+    y = tmp;
+}
+
+struct __bit_iterator_base {
+    typedef random_access_iterator_tag iterator_category;
+    typedef bool value_type;
+    typedef ptrdiff_t difference_type;
+
+    __bit_word* p;              // 所在的字
+    unsigned int offset;        // 在字中的第几位
+
+    __bit_iterator_base(__bit_word* x, unsigned int y) : p(x), offset(y) {}
+
+    void bump_up() {
+        if (offset++ == __WORD_BIT - 1) {
+            offset = 0;
+            ++p;
+        }
+    }
+
+    void bump_down() {
+        if (offset-- == 0) {
+            offset = __WORD_BIT - 1;
+            --p;
+        }
+    }
+
+    void incr(ptrdiff_t i) {
+        ptrdiff_t n = i + offset;
+        p += n / __WORD_BIT;
+        n = n % __WORD_BIT;
+        if (n < 0) {
+            n += __WORD_BIT;
+            --p;
+        }
+        offset = (unsigned int) n;
+    }
+
+    bool operator==(const __bit_iterator_base& x) const { return p == x.p && offset == x.offset; }
+    bool operator!=(const __bit_iterator_base& x) const { return !(*this == x); }
+    bool operator<(const __bit_iterator_base& x) const {
+        return p < x.p || (p == x.p && offset < x.offset);
+    }
+    bool operator>(const __bit_iterator_base& x) const { return x < *this; }
+    bool operator<=(const __bit_iterator_base& x) const { return !(x < *this); }
+    bool operator>=(const __bit_iterator_base& x) const { return !(*this < x); }
+};
+
+inline ptrdiff_t operator-(const __bit_iterator_base& x, const __bit_iterator_base& y) {
+    return __WORD_BIT * (x.p - y.p) + (ptrdiff_t) x.offset - (ptrdiff_t) y.offset;
+}
+
+struct __bit_iterator : public __bit_iterator_base {
+    typedef __bit_reference reference;
+    typedef __bit_reference* pointer;
+    typedef __bit_iterator iterator;
+
+    __bit_iterator() : __bit_iterator_base(0, 0) {}
+    __bit_iterator(__bit_word* x, unsigned int y) : __bit_iterator_base(x, y) {}
+
+    reference operator*() const { return reference(p, (__bit_word)1 << offset); }
+    reference operator[](difference_type i) const { return *(*this + i); }
+
+    iterator& operator++() { bump_up(); return *this; }
+    iterator operator++(int) { iterator tmp = *this; bump_up(); return tmp; }
+    iterator& operator--() { bump_down(); return *this; }
+    iterator operator--(int) { iterator tmp = *this; bump_down(); return tmp; }
+    iterator& operator+=(difference_type i) { incr(i); return *this; }
+    iterator& operator-=(difference_type i) { incr(-i); return *this; }
+    iterator operator+(difference_type i) const { iterator tmp = *this; return tmp += i; }
+    iterator operator-(difference_type i) const { iterator tmp = *this; return tmp -= i; }
+};
+
+struct __bit_const_iterator : public __bit_iterator_base {
+    typedef bool reference;
+    typedef bool const_reference;
+    typedef const bool* pointer;
+    typedef __bit_const_iterator const_iterator;
+
+    __bit_const_iterator() : __bit_iterator_base(0, 0) {}
+    __bit_const_iterator(__bit_word* x, unsigned int y) : __bit_iterator_base(x, y) {}
+    __bit_const_iterator(const __bit_iterator& x) : __bit_iterator_base(x.p, x.offset) {}
+
+    const_reference operator*() const { return (*p & ((__bit_word)1 << offset)) != 0; }
+    const_reference operator[](difference_type i) const { return *(*this + i); }
+
+    const_iterator& operator++() { bump_up(); return *this; }
+    const_iterator operator++(int) { const_iterator tmp = *this; bump_up(); return tmp; }
+    const_iterator& operator--() { bump_down(); return *this; }
+    const_iterator operator--(int) { const_iterator tmp = *this; bump_down(); return tmp; }
+    const_iterator& operator+=(difference_type i) { incr(i); return *this; }
+    const_iterator& operator-=(difference_type i) { incr(-i); return *this; }
+    const_iterator operator+(difference_type i) const { const_iterator tmp = *this; return tmp += i; }
+    const_iterator operator-(difference_type i) const { const_iterator tmp = *this; return tmp -= i; }
+};
+
+/*
+ * --------------------------------------------------------------------------------------------------
+ * 逐字进行的算法
+ */
+
+// [first, last)中1的个数
+inline ptrdiff_t __bit_count(const __bit_iterator_base& first, const __bit_iterator_base& last) {
+    // 空区间不能读*first.p：空vector的p为NULL，first为end()时p可能已经是缓冲区的末尾
+    if (first == last)
+        return 0;
+    if (first.p == last.p)
+        return __bit_popcount(*first.p & __bit_mask_from(first.offset) & __bit_mask_below(last.offset));
+    ptrdiff_t n = __bit_popcount(*first.p & __bit_mask_from(first.offset));
+    for (const __bit_word* q = first.p + 1; q < last.p; ++q)
+        n += __bit_popcount(*q);
+    // last.offset为0时last.p可能已经是缓冲区的末尾，不能读
+    if (last.offset != 0)
+        n += __bit_popcount(*last.p & __bit_mask_below(last.offset));
+    return n;
+}
+
+// [first, last)中第一个等于value的位，返回它的字和偏移，没有的话返回last
+inline __bit_iterator_base __bit_find(const __bit_iterator_base& first, const __bit_iterator_base& last, bool value) {
+    if (first == last)
+        return last;
+    // 找false时把字取反，都变成找第一个1
+    const __bit_word flip = value ? 0 : ~(__bit_word)0;
+    __bit_word* p = first.p;
+    __bit_word w = (*p ^ flip) & __bit_mask_from(first.offset);
+    for (;;) {
+        if (p == last.p) {
+            w &= __bit_mask_below(last.offset);
+            return w != 0 ? __bit_iterator_base(p, __bit_lowest(w)) : last;
+        }
+        if (w != 0)
+            return __bit_iterator_base(p, __bit_lowest(w));
+        ++p;
+        if (p == last.p && last.offset == 0)
+            return last;
+        w = *p ^ flip;
+    }
+}
+
+// 从(p, offset)开始读出k个位（1 <= k <= 64），放在结果的低位
+inline __bit_word __bit_get(const __bit_word* p, unsigned int offset, unsigned int k) {
+    __bit_word bits = p[0] >> offset;
+    if (offset + k > (unsigned int) __WORD_BIT)
+        bits |= p[1] << (__WORD_BIT - offset);
+    return k == (unsigned int) __WORD_BIT ? bits : bits & __bit_mask_below(k);
+}
+
+// 把bits的低k位写到(p, offset)开始的位置，要求offset + k <= 64
+inline void __bit_set(__bit_word* p, unsigned int offset, unsigned int k, __bit_word bits) {
+    __bit_word mask = (k == (unsigned int) __WORD_BIT ? ~(__bit_word)0 : __bit_mask_below(k)) << offset;
+    *p = (*p & ~mask) | ((bits << offset) & mask);
+}
+
+// 把[first, last)复制到result开始的位置，每次搬动目的字中剩下的部分，最多一个字
+// 与copy()相同，result在first之前时区间可以重叠
+inline __bit_iterator __bit_copy(__bit_iterator_base first, __bit_iterator_base last, __bit_iterator result) {
+    ptrdiff_t n = last - first;
+    while (n > 0) {
+        unsigned int k = __WORD_BIT - result.offset;
+        if ((ptrdiff_t) k > n)
+            k = (unsigned int) n;
+        __bit_set(result.p, result.offset, k, __bit_get(first.p, first.offset, k));
+        first.incr(k);
+        result.incr(k);
+        n -= k;
+    }
+    return result;
+}
+
+// 从后往前复制，与copy_backward()相同，result在last之后时区间可以重叠
+inline __bit_iterator __bit_copy_backward(__bit_iterator_base first, __bit_iterator_base last, __bit_iterator result) {
+    ptrdiff_t n = last - first;
+    while (n > 0) {
+        unsigned int k = result.offset == 0 ? __WORD_BIT : result.offset;
+        if ((ptrdiff_t) k > n)
+            k = (unsigned int) n;
+        last.incr(-(ptrdiff_t) k);
+        result.incr(-(ptrdiff_t) k);
+        __bit_set(result.p, result.offset, k, __bit_get(last.p, last.offset, k));
+        n -= k;
+    }
+    return result;
+}
+
+inline ptrdiff_t count(__bit_const_iterator first, __bit_const_iterator last, const bool& value) {
+    ptrdiff_t ones = __bit_count(first, last);
+    return value ? ones : (last - first) - ones;
+}
+
+inline ptrdiff_t count(__bit_iterator first, __bit_iterator last, const bool& value) {
+    return count(__bit_const_iterator(first), __bit_const_iterator(last), value);
+}
+
+inline __bit_const_iterator find(__bit_const_iterator first, __bit_const_iterator last, const bool& value) {
+    __bit_iterator_base i = __bit_find(first, last, value);
+    return __bit_const_iterator(i.p, i.offset);
+}
+
+inline __bit_iterator find(__bit_iterator first, __bit_iterator last, const bool& value) {
+    __bit_iterator_base i = __bit_find(first, last, value);
+    return __bit_iterator(i.p, i.offset);
+}
+
+inline void fill(__bit_iterator first, __bit_iterator last, const bool& value) {
+    if (first == last)
+        return;
+    const __bit_word v = value ? ~(__bit_word)0 : 0;
+    if (first.p == last.p) {
+        __bit_word mask = __bit_mask_from(first.offset) & __bit_mask_below(last.offset);
+        *first.p = (*first.p & ~mask) | (v & mask);
+        return;
+    }
+    __bit_word mask = __bit_mask_from(first.offset);
+    *first.p = (*first.p & ~mask) | (v & mask);
+    for (__bit_word* q = first.p + 1; q < last.p; ++q)
+        *q = v;
+    if (last.offset != 0) {
+        mask = __bit_mask_below(last.offset);
+        *last.p = (*last.p & ~mask) | (v & mask);
+    }
+}
+
+inline __bit_iterator copy(__bit_const_iterator first, __bit_const_iterator last, __bit_iterator result) {
+    return __bit_copy(first, last, result);
+}
+
+inline __bit_iterator copy(__bit_iterator first, __bit_iterator last, __bit_iterator result) {
+    return __bit_copy(first, last, result);
+}
+
+inline __bit_iterator copy_backward(__bit_const_iterator first, __bit_const_iterator last, __bit_iterator result) {
+    return __bit_copy_backward(first, last, result);
+}
+
+inline __bit_iterator copy_backward(__bit_iterator first, __bit_iterator last, __bit_iterator result) {
+    return __bit_copy_backward(first, last, result);
+}
+
+/*
+ * --------------------------------------------------------------------------------------------------
+ * vector<bool>
+ */
+
+template <class Alloc, class Growth>
+class vector<bool, Alloc, Growth> : protected __alloc_holder<Alloc> {
+public:
+    typedef bool                    value_type;
+    typedef size_t                  size_type;
+    typedef ptrdiff_t               difference_type;
+    typedef __bit_reference         reference;
+    typedef bool                    const_reference;
+    typedef __bit_reference*        pointer;
+    typedef const bool*             const_pointer;
+    typedef __bit_iterator          iterator;
+    typedef __bit_const_iterator    const_iterator;
+    typedef Alloc                   allocator_type;
+
+    using __alloc_holder<Alloc>::get_allocator;
+
+protected:
+    typedef __alloc_holder<Alloc> alloc_base;
+    typedef simple_alloc<__bit_word, Alloc> data_allocator;
+
+    iterator start;
+    iterator finish;
+    __bit_word* end_of_storage;     // 缓冲区的末尾（字）
+
+    // n个位需要的字数
+    static size_type words(size_type n) { return (n + __WORD_BIT - 1) / __WORD_BIT; }
+
+    void deallocate() {
+        if (start.p != NULL)
+            data_allocator::deallocate(this->get_alloc(), start.p, (size_type)(end_of_storage - start.p));
+    }
+
+    // 申请刚好放得下n个位的缓冲区，元素的值没有初始化
+    void initialize(size_type n) {
+        start = iterator();
+        end_of_storage = 0;
+        if (n != 0) {
+            __bit_word* q = data_allocator::allocate(this->get_alloc(), words(n));
+            start = iterator(q, 0);
+            end_of_storage = q + words(n);
+        }
+        finish = start + n;
+    }
+
+    // 把容量调整为new_words个字（不少于size()需要的字数），字是平凡类型，直接通过reallocate()搬动
+    void reallocate_storage(size_type new_words) {
+        const size_type n = size();
+        __bit_word* q = data_allocator::reallocate(this->get_alloc(), start.p,
+                                                   (size_type)(end_of_storage - start.p), new_words);
+        start = iterator(q, 0);
+        finish = start + n;
+        end_of_storage = q + new_words;
+    }
+
+    // 在position处腾出n个位，返回腾出的第一个位置；容量不够时按增长策略（以字为单位）扩容
+    iterator make_room(iterator position, size_type n) {
+        const size_type index = (size_type)(position - start);
+        if (size() + n > capacity())
+            reallocate_storage(Growth::next_capacity(words(size()), words(size() + n), sizeof(__bit_word)));
+        position = start + index;
+        iterator old_finish = finish;
+        finish += n;
+        __bit_copy_backward(position, old_finish, finish);
+        return position;
+    }
+
+    template <class Integer>
+    void insert_dispatch(iterator position, Integer n, Integer x, std::true_type) {
+        insert(position, (size_type) n, (bool) x);
+    }
+
+    template <class InputIterator>
+    void insert_dispatch(iterator position, InputIterator first, InputIterator last, std::false_type) {
+        range_insert(position, first, last, typename iterator_traits<InputIterator>::iterator_category());
+    }
+
+    template <class InputIterator>
+    void range_insert(iterator position, InputIterator first, InputIterator last, input_iterator_tag) {
+        for (; first != last; ++first) {
+            position = insert(position, *first);
+            ++position;
+        }
+    }
+
+    template <class ForwardIterator>
+    void range_insert(iterator position, ForwardIterator first, ForwardIterator last, forward_iterator_tag) {
+        position = make_room(position, (size_type) distance(first, last));
+        for (; first != last; ++first, ++position)
+            *position = *first;
+    }
+
+    // 接管x的缓冲区，x变成空的
+    void steal(vector& x) {
+        start = x.start;
+        finish = x.finish;
+        end_of_storage = x.end_of_storage;
+        x.start = x.finish = iterator();
+        x.end_of_storage = 0;
+    }
+
+    // 把x的元素按字复制过来，容量不够时重新申请
+    void copy_from(const vector& x) {
+        const size_type n = x.size();
+        if (n > capacity()) {
+            deallocate();
+            initialize(n);
+        }
+        if (n != 0)
+            memcpy(start.p, x.start.p, words(n) * sizeof(__bit_word));
+        finish = start + n;
+    }
+
+public:
+    iterator begin() { return start; }
+    iterator end() { return finish; }
+    const_iterator begin() const { return start; }
+    const_iterator end() const { return finish; }
+    size_type size() const { return (size_type)(finish - start); }
+    size_type capacity() const { return (size_type)(end_of_storage - start.p) * __WORD_BIT; }
+    bool empty() const { return start == finish; }
+    reference operator[](size_type n) { return *(begin() + n); }
+    const_reference operator[](size_type n) const { return *(begin() + n); }
+    reference front() { return *begin(); }
+    reference back() { return *(end() - 1); }
+
+    explicit vector(const Alloc& a = Alloc()) : alloc_base(a), start(), finish(), end_of_storage(0) {}
+
+    vector(size_type n, bool value, const Alloc& a = Alloc()) : alloc_base(a) {
+        initialize(n);
+        fill(start.p, end_of_storage, value ? ~(__bit_word)0 : 0);
+    }
+    vector(int n, bool value, const Alloc& a = Alloc()) : alloc_base(a) {
+        initialize((size_type) n);
+        fill(start.p, end_of_storage, value ? ~(__bit_word)0 : 0);
+    }
+    vector(long n, bool value, const Alloc& a = Alloc()) : alloc_base(a) {
+        initialize((size_type) n);
+        fill(start.p, end_of_storage, value ? ~(__bit_word)0 : 0);
+    }
+    explicit vector(size_type n, const Alloc& a = Alloc()) : alloc_base(a) {
+        initialize(n);
+        fill(start.p, end_of_storage, (__bit_word)0);
+    }
+
+    vector(const vector& x)
+        : alloc_base(__allocator_traits<Alloc>::select_on_container_copy_construction(x.get_alloc())),
+          start(), finish(), end_of_storage(0) {
+        copy_from(x);
+    }
+
+    // 移动构造，直接接管x的字数组；声明为noexcept（与vector的主模板相同），vector<vector<bool>>扩容时才会移动而不是拷贝
+    vector(vector&& x) noexcept : alloc_base(x.get_alloc()) { steal(x); }
+
+    vector& operator=(const vector& x) {
+        if (&x != this) {
+            if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment
+                && !__alloc_equal(this->get_alloc(), x.get_alloc())) {
+                deallocate();
+                initialize(0);
+            }
+            __propagate_on_copy_assign(this->get_alloc(), x.get_alloc());
+            copy_from(x);
+        }
+        return *this;
+    }
+
+    vector& operator=(vector&& x) noexcept(__move_assign_steals<Alloc>::value) {
+        if (&x == this)
+            return *this;
+        if (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+            || __alloc_equal(this->get_alloc(), x.get_alloc())) {
+            deallocate();
+            __propagate_on_move_assign(this->get_alloc(), x.get_alloc());
+            steal(x);
+        }
+        else {
+            copy_from(x);
+            x.clear();
+        }
+        return *this;
+    }
+
+    void swap(vector& x) {
+        __propagate_on_swap(this->get_alloc(), x.get_alloc());
+        std::swap(start, x.start);
+        std::swap(finish, x.finish);
+        std::swap(end_of_storage, x.end_of_storage);
+    }
+
+    ~vector() { deallocate(); }
+
+    void push_back(bool x) {
+        if (finish.p != end_of_storage) {
+            *finish = x;
+            ++finish;
+        }
+        else
+            insert(end(), x);
+    }
+
+    template <class... Args>
+    void emplace_back(Args&&... args) { push_back(bool(std::forward<Args>(args)...)); }
+
+    void pop_back() { --finish; }
+
+    iterator insert(iterator position, bool x) {
+        position = make_room(position, 1);
+        *position = x;
+        return position;
+    }
+
+    void insert(iterator position, size_type n, bool x) {
+        if (n == 0)
+            return;
+        position = make_room(position, n);
+        fill(position, position + n, x);
+    }
+
+    template <class InputIterator>
+    void insert(iterator position, InputIterator first, InputIterator last) {
+        insert_dispatch(position, first, last, std::is_integral<InputIterator>());
+    }
+
+    void assign(size_type n, bool x) {
+        clear();
+        insert(end(), n, x);
+    }
+
+    template <class InputIterator>
+    void assign(InputIterator first, InputIterator last) {
+        clear();
+        insert(end(), first, last);
+    }
+
+    iterator erase(iterator position) {
+        __bit_copy(position + 1, finish, position);
+        --finish;
+        return position;
+    }
+
+    iterator erase(iterator first, iterator last) {
+        finish = __bit_copy(last, finish, first);
+        return first;
+    }
+
+    void resize(size_type new_size, bool x = false) {
+        if (new_size < size())
+            erase(begin() + new_size, end());
+        else
+            insert(end(), new_size - size(), x);
+    }
+
+    void clear() { finish = start; }
+
+    void reserve(size_type n) {
+        if (n > capacity())
+            reallocate_storage(words(n));
+    }
+
+    void shrink_to_fit() {
+        if (start == finish) {
+            deallocate();
+            initialize(0);
+        }
+        else if (words(size()) < (size_type)(end_of_storage - start.p)) {
+            reallocate_storage(words(size()));
+        }
+    }
+
+    // 所有的位取反
+    void flip() {
+        __bit_word* p = start.p;
+        for (size_type i = words(size()); i > 0; --i, ++p)
+            *p = ~*p;
+    }
+
+    // 逐字的位运算，x的长度需要与*this相同
+    vector& operator&=(const vector& x) {
+        __bit_word* p = start.p;
+        const __bit_word* q = x.start.p;
+        for (size_type i = 0, n = words(size()); i < n; ++i)
+            p[i] &= q[i];
+        return *this;
+    }
+
+    vector& operator|=(const vector& x) {
+        __bit_word* p = start.p;
+        const __bit_word* q = x.start.p;
+        for (size_type i = 0, n = words(size()); i < n; ++i)
+            p[i] |= q[i];
+        return *this;
+    }
+
+    vector& operator^=(const vector& x) {
+        __bit_word* p = start.p;
+        const __bit_word* q = x.start.p;
+        for (size_type i = 0, n = words(size()); i < n; ++i)
+            p[i] ^= q[i];
+        return *this;
+    }
+};
+
+#endif //STL_MY_ALLOCATOR_MY_BVECTOR_H
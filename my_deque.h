@@ -85,7 +85,7 @@ struct __deque_iterator {
     pointer operator->() const { return &(operator*()); }
 
     // 迭代器相减，实际上就是指针相减
-    difference_type operator-(self& iter) {
+    difference_type operator-(const self& iter) const {
         return static_cast<difference_type>(buffer_size()*(this->map_node - iter.map_node - 1)
                                                 + this->cur - this->first
                                                 + iter.last - iter.cur);
@@ -232,8 +232,11 @@ struct __deque_iterator {
 };
 
 // T为保存的数据类型，Alloc为内存分配器类型，Buf_size为变量参数，保存每块缓冲区的大小
+// deque内部保存一个分配器实例（见my_allocator.h中的__alloc_holder），缓冲区和map都通过这个实例分配
 template <class T, class Alloc = alloc, size_t Buf_size = 0>
-class deque {
+class deque : protected __alloc_holder<Alloc> {
+protected:
+    typedef __alloc_holder<Alloc> alloc_base;
 public:
     typedef T value_type;
     typedef value_type* pointer;
@@ -243,6 +246,9 @@ public:
     typedef ptrdiff_t difference_type;
 
     typedef __deque_iterator<T, T&, T*, Buf_size> iterator;
+    typedef Alloc allocator_type;
+
+    using alloc_base::get_allocator;
 
     // 返回指向第一个元素的迭代器
     iterator begin() { return start; }
@@ -275,13 +281,95 @@ public:
 
     // 构造函数，负责生成一个deque，由n个value组成
     // 主要分成两个步骤，申请map和缓冲区的内存，以及构造对象
-    deque(int n, const value_type& value) {
+    deque(int n, const value_type& value, const Alloc& a = Alloc())
+        : alloc_base(a), map(0), map_size(0) {
         fill_initialize(n, value);
     }
 
-    // 返回缓冲区中的元素个数
-    size_type buffer_size() {
-        return Buf_size / sizeof(value_type);
+    // 默认构造函数，产生一个空的deque，只有一个缓冲区
+    explicit deque(const Alloc& a = Alloc()) : alloc_base(a), map(0), map_size(0) {
+        create_map_and_buffer(0);
+    }
+
+    // 拷贝构造函数，新deque的分配器由select_on_container_copy_construction()决定
+    deque(const deque& x)
+        : alloc_base(__allocator_traits<Alloc>::select_on_container_copy_construction(x.get_alloc())),
+          map(0), map_size(0) {
+        create_map_and_buffer(x.size());
+        // 拷贝某个元素时抛出异常，析构函数不会被调用，需要回收所有缓冲区和map（uninitialized_copy已经析构了拷贝好的元素）
+        try {
+            uninitialized_copy(x.start, x.finish, start);
+        }
+        catch (...) {
+            for (map_pointer node = start.map_node; node <= finish.map_node; ++node)
+                buffer_allocator::deallocate(this->get_alloc(), *node, buffer_size());
+            map_allocator::deallocate(this->get_alloc(), map, map_size);
+            throw;
+        }
+    }
+
+    // 移动构造函数，先建一个空的deque，再与x交换，x变成空的deque
+    // 声明为noexcept，这样vector<deque<T>>扩容时会移动而不是拷贝里面的deque；申请空deque的map失败时程序终止
+    deque(deque&& x) noexcept : alloc_base(x.get_alloc()), map(0), map_size(0) {
+        create_map_and_buffer(0);
+        swap_data(x);
+    }
+
+    // 析构函数，clear()之后只剩下一个缓冲区，再释放这个缓冲区以及map
+    ~deque() {
+        clear();
+        buffer_allocator::deallocate(this->get_alloc(), start.first, buffer_size());
+        map_allocator::deallocate(this->get_alloc(), map, map_size);
+    }
+
+    // 拷贝赋值
+    // 如果分配器需要传播，而两个分配器又不相等，原来的缓冲区和map必须先用旧的分配器回收，再换成x的分配器
+    deque& operator=(const deque& x) {
+        if (&x != this) {
+            if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment
+                && !__alloc_equal(this->get_alloc(), x.get_alloc())) {
+                clear();
+                buffer_allocator::deallocate(this->get_alloc(), start.first, buffer_size());
+                map_allocator::deallocate(this->get_alloc(), map, map_size);
+                __propagate_on_copy_assign(this->get_alloc(), x.get_alloc());
+                create_map_and_buffer(0);
+            }
+            assign_from(x);
+        }
+        return *this;
+    }
+
+    // 移动赋值
+    // 分配器会传播或者两个分配器相等时，直接与x交换数据，再清空x，否则只能逐个拷贝元素
+    // 交换数据之后x持有原来的map和缓冲区，它们是原来的分配器申请的，所以分配器传播时要与数据一起交换（与list相同）
+    deque& operator=(deque&& x) noexcept(__move_assign_steals<Alloc>::value) {
+        if (&x == this)
+            return *this;
+        if (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+            || __alloc_equal(this->get_alloc(), x.get_alloc())) {
+            clear();
+            if (__allocator_traits<Alloc>::propagate_on_container_move_assignment)
+                std::swap(this->get_alloc(), x.get_alloc());
+            swap_data(x);
+        }
+        else {
+            assign_from(x);
+        }
+        x.clear();
+        return *this;
+    }
+
+    // 交换两个deque，只需要交换迭代器和map
+    // 分配器不传播时，要求两个deque的分配器相等（与标准库相同）
+    void swap(deque& x) {
+        __propagate_on_swap(this->get_alloc(), x.get_alloc());
+        swap_data(x);
+    }
+
+    // 返回缓冲区中的元素个数，与迭代器的buffer_size()相同
+    // Buf_size为0时使用默认大小（见__deque_buf_size）
+    static size_type buffer_size() {
+        return iterator::buffer_size();
     }
 
     void push_back(const value_type& t) {
@@ -298,18 +386,40 @@ public:
         }
     }
 
+    // 右值版本，移动构造新元素
+    void push_back(value_type&& t) { emplace_back(std::move(t)); }
+
+    // 直接在尾端用args构造新元素，不产生临时对象
+    template <class... Args>
+    void emplace_back(Args&&... args) {
+        if (finish.cur != finish.last - 1) {
+            construct(finish.cur, std::forward<Args>(args)...);
+            ++finish.cur;
+        }
+        else {
+            push_back_aux(std::forward<Args>(args)...);
+        }
+    }
+
     // 申请额外的缓冲区
     // 如果map节点不够了，则需要先申请map结构，接着拷贝，然后再申请map节点对应缓冲区
-    void push_back_aux(const value_type& t) {
-        value_type t_copy = t;
+    // 调整map结构只会搬动map中的指针，已有的元素不会移动，所以args即使引用deque中的元素也仍然有效，不需要先拷贝一份
+    template <class... Args>
+    void push_back_aux(Args&&... args) {
         // 调整map结构，从而满足添加新元素进去的空间要求
         // 判断是否需要重新申请一个map结构（如果map结构中节点不够了）
         reserve_map_at_back();
         // 假设不需要，或者申请完毕后
         // 申请新的缓冲区，并将地址保存到map_节点中
-        *(finish.map_node + 1) = buffer_allocator::allocate(Buf_size);
-        // 先构造对象
-        construct(finish.cur, t_copy);
+        *(finish.map_node + 1) = buffer_allocator::allocate(this->get_alloc(), buffer_size());
+        // 先构造对象，构造失败时回收新的缓冲区
+        try {
+            construct(finish.cur, std::forward<Args>(args)...);
+        }
+        catch (...) {
+            buffer_allocator::deallocate(this->get_alloc(), *(finish.map_node + 1), buffer_size());
+            throw;
+        }
         // 然后更新finish迭代器
         // 因为finish迭代器是指向最后一个元素的下一个位置
         finish.set_node(finish.map_node + 1);
@@ -330,18 +440,40 @@ public:
         }
     }
 
+    // 右值版本，移动构造新元素
+    void push_front(value_type&& t) { emplace_front(std::move(t)); }
+
+    // 直接在头部用args构造新元素
+    template <class... Args>
+    void emplace_front(Args&&... args) {
+        if (start.first != start.cur) {
+            construct(start.cur - 1, std::forward<Args>(args)...);
+            --start.cur;
+        }
+        else {
+            push_front_aux(std::forward<Args>(args)...);
+        }
+    }
+
     // 申请额外的缓冲区
     // 如果map节点不够了，则需要先申请map结构，接着拷贝，然后再申请map节点对应缓冲区
-    void push_front_aux(const value_type& t) {
-        value_type t_copy = t;
+    template <class... Args>
+    void push_front_aux(Args&&... args) {
         // 调整map结构，从而满足添加新元素进去的空间要求
         // 判断是否需要重新申请一个map结构（如果map结构中节点不够了）
         reserve_map_at_front();
-        // 申请完毕，为map节点申请缓冲区内存，然后构造对象，更新迭代器
-        *(start.map_node - 1) = buffer_allocator::allocate(Buf_size);
+        // 申请完毕，为map节点申请缓冲区内存，然后在缓冲区的最后一个位置构造对象，成功之后再更新迭代器
+        pointer buffer = buffer_allocator::allocate(this->get_alloc(), buffer_size());
+        try {
+            construct(buffer + buffer_size() - 1, std::forward<Args>(args)...);
+        }
+        catch (...) {
+            buffer_allocator::deallocate(this->get_alloc(), buffer, buffer_size());
+            throw;
+        }
+        *(start.map_node - 1) = buffer;
         start.set_node(start.map_node - 1);
         start.cur = start.last-1;
-        construct(start.cur, t_copy);
     }
 
     // 调整map结构，从而满足添加新元素进去的空间要求
@@ -399,14 +531,14 @@ public:
         else {
             // 如果所需扩充的节点数比原map的节点个数还要大，那就按前者来扩充，否则就两倍map节点个数
             size_type new_map_size = map_size + max(map_size, map_nodes_to_add) + 2;
-            map_pointer new_map = map_allocator::allocate(new_map_size);
+            map_pointer new_map = map_allocator::allocate(this->get_alloc(), new_map_size);
             new_start = new_map + (new_map_size - new_map_nodes_num) / 2;
             if (add_at_front)
                 new_start += map_nodes_to_add;
             // 将旧的map结构的数据拷贝到新的map结构
             copy(start.map_node, finish.map_node + 1, new_start);
             // 然后回收旧的map结构的内存空间
-            map_allocator::deallocate(map, map_size);
+            map_allocator::deallocate(this->get_alloc(), map, map_size);
             map = new_map;
             map_size = new_map_size;
         }
@@ -433,7 +565,7 @@ public:
     // 主要对应删除的点为所在缓冲区的第一个节点，需要释放缓冲区
     void pop_back_aux() {
         // 释放缓冲区，并移动finish迭代器
-        buffer_allocator::deallocate(finish.first, buffer_size());
+        buffer_allocator::deallocate(this->get_alloc(), finish.first, buffer_size());
         finish.set_node(finish.map_node-1);
         finish.cur = finish.last - 1;
         destroy(finish.cur);
@@ -454,7 +586,7 @@ public:
     void pop_front_aux() {
         // 释放缓冲区，并移动start迭代器
         destroy(start.cur);
-        buffer_allocator::deallocate(start.first, buffer_size());
+        buffer_allocator::deallocate(this->get_alloc(), start.first, buffer_size());
         start.set_node(start.map_node+1);
         start.cur = start.first;
     }
@@ -465,9 +597,9 @@ public:
         // 头缓冲区和尾缓冲区不是完全使用的，所以需要挑出来特殊处理
         for (cur = start.map_node + 1; cur < finish.map_node; cur++) {
             // 析构
-            destroy(*cur, *cur + Buf_size);
+            destroy(*cur, *cur + buffer_size());
             // 释放空间
-            buffer_allocator::deallocate(*cur, buffer_size());
+            buffer_allocator::deallocate(this->get_alloc(), *cur, buffer_size());
         }
         // 如果头缓冲区和尾缓冲区不是同一个
         // 只保留头缓冲区
@@ -476,7 +608,7 @@ public:
             destroy(start.cur, start.last);
             destroy(finish.first, finish.cur);
             // 释放尾缓冲区的内存空间
-            buffer_allocator::deallocate(finish.first, buffer_size());
+            buffer_allocator::deallocate(this->get_alloc(), finish.first, buffer_size());
         }
         // 如果是同一个，那么直接析构就可以了
         else {
@@ -540,7 +672,7 @@ public:
                 // 释放前面的内存空间
                 map_pointer cur = start.map_node;
                 for (; cur < new_start.map_node; cur++) {
-                    buffer_allocator::deallocate(*cur, buffer_size());
+                    buffer_allocator::deallocate(this->get_alloc(), *cur, buffer_size());
                 }
                 // 更新迭代器
                 start = new_start;
@@ -554,7 +686,7 @@ public:
                 // 释放后面的内存空间
                 map_pointer cur = new_finish.map_node + 1;
                 for(; cur <= finish.map_node; cur++) {
-                    buffer_allocator::deallocate(*cur, buffer_size());
+                    buffer_allocator::deallocate(this->get_alloc(), *cur, buffer_size());
                 }
                 // 更新迭代器
                 finish = new_finish;
@@ -566,33 +698,40 @@ public:
 
     // 在position指向的元素之前插入一个x
     // 返回插入之后位置的迭代器
-    iterator insert(iterator position, const value_type& x) {
-        // 如果插入位置是start，直接调用push_front()
+    iterator insert(iterator position, const value_type& x) { return emplace(position, x); }
+    iterator insert(iterator position, value_type&& x) { return emplace(position, std::move(x)); }
+
+    // 在position之前用args构造新元素，返回指向新元素的迭代器
+    template <class... Args>
+    iterator emplace(iterator position, Args&&... args) {
+        // 如果插入位置是start，直接调用emplace_front()
         if (position == start) {
-            push_front(x);
+            emplace_front(std::forward<Args>(args)...);
             return start;
         }
-        // 如果插入位置是finish，直接调用push_back()
+        // 如果插入位置是finish，直接调用emplace_back()
         else if (position == finish) {
-            push_back(x);
+            emplace_back(std::forward<Args>(args)...);
             return (finish - 1);
         }
         // 否则如果插入位置是中间的话，调用辅助函数
         else {
-            return insert_aux(position, x);
+            return insert_aux(position, std::forward<Args>(args)...);
         }
 
     }
 
     // insert的辅助函数
     // 判断插入的点是靠前的点还是靠后的点，靠前的点则将前面部分往前移动，靠后的点则将后面部分wanghouyidong
-    iterator insert_aux(iterator pos, const value_type& x) {
+    // 元素都是移动而不是拷贝
+    template <class... Args>
+    iterator insert_aux(iterator pos, Args&&... args) {
         difference_type index = pos - start;
-        value_type x_copy = x;
+        value_type x_copy(std::forward<Args>(args)...);     // args可能引用deque中的元素，先构造出来
         // 靠前的位置
         if (index < size() / 2) {
             // 先在前面插入一个节点，然后往前覆盖
-            push_front(front());
+            push_front(std::move(front()));
             // 其实下面这一部分代码可以使用start+1， pos+1等实现
             // 使用前缀++的好处是可以减少一次拷贝，提高效率
             // 使用+，然后再拷贝，相当于执行了两次拷贝，中间多了一个临时变量temp
@@ -606,12 +745,12 @@ public:
             // 旧拷贝区间的终点
             iterator pos1 = pos;
             ++pos1;
-            copy(front2, pos1, front1);
+            std::move(front2, pos1, front1);
         }
         // 靠后的位置
         else {
             // 先在后面插入一个节点，然后往后覆盖
-            push_back(back());
+            push_back(std::move(back()));
             iterator back1 = finish;
             // 新拷贝区间的终点
             --back1;
@@ -620,10 +759,10 @@ public:
             --back2;
             // 旧拷贝区间的起点
             pos = start + index;
-            copy_backward(pos, back2, back1);
+            std::move_backward(pos, back2, back1);
 
         }
-        *pos = x_copy;
+        *pos = std::move(x_copy);
         return pos;
     }
 
@@ -643,6 +782,30 @@ protected:
     // 内存分配器，主要负责对map进行分配，一次分配一个map_node
     typedef simple_alloc<pointer, Alloc> map_allocator;
 
+    // 交换两个deque的迭代器和map，不涉及分配器
+    void swap_data(deque& x) {
+        iterator tmp_start = start, tmp_finish = finish;
+        map_pointer tmp_map = map;
+        size_type tmp_map_size = map_size;
+        start = x.start; finish = x.finish; map = x.map; map_size = x.map_size;
+        x.start = tmp_start; x.finish = tmp_finish; x.map = tmp_map; x.map_size = tmp_map_size;
+    }
+
+    // 用x中的元素替换*this中的元素，已有的元素直接赋值，多余的删除，不够的再添加到尾部
+    void assign_from(const deque& x) {
+        iterator src = x.start, src_end = x.finish;
+        iterator dst = start;
+        for (; src != src_end && dst != finish; ++src, ++dst)
+            *dst = *src;
+        if (src == src_end) {
+            while (finish != dst)
+                pop_back();
+        }
+        else {
+            for (; src != src_end; ++src)
+                push_back(*src);
+        }
+    }
 
 
 
@@ -652,12 +815,12 @@ protected:
 // 负责申请内存空间
 template <class T, class Alloc, size_t Buf_size>
 void deque<T, Alloc, Buf_size>::create_map_and_buffer(size_type n) {
-    size_type buffer_num = n / Buf_size + 1;
+    size_type buffer_num = n / buffer_size() + 1;
     // 如果buffer_num+2 小于 8，则默认的缓冲区个数为8
     // 如果不小于，则缓冲区的个数为buffer_num+2
     map_size = max(buffer_num + 2, size_type (8));
     // 根据buffer_num申请map的内存空间
-    map = map_allocator::allocate(map_size);
+    map = map_allocator::allocate(this->get_alloc(), map_size);
     // 接着为每个缓冲区申请内存空间
     // 要让含有缓冲区的map_node在map中间，这样才适合前插和后插
     map_pointer cur = map + (map_size - buffer_num) / 2;
@@ -665,14 +828,14 @@ void deque<T, Alloc, Buf_size>::create_map_and_buffer(size_type n) {
     map_pointer map_finish = cur + buffer_num - 1;
     for (; cur <= map_finish; cur++) {
         // 使用缓冲区对应的内存分配器来分配缓冲区的内存
-        *cur = buffer_allocator::allocate(Buf_size);
+        *cur = buffer_allocator::allocate(this->get_alloc(), buffer_size());
     }
     map_pointer map_start = map_finish + 1 - buffer_num;
     // 接着设置deque的起始和结尾迭代器，为它们设置相关的初始信息，缓冲区的头和尾、指向当前缓冲区的哪个元素
     start.set_node(map_start);
     start.cur = start.first;
     finish.set_node(map_finish);
-    finish.cur = finish.first + (n % Buf_size);
+    finish.cur = finish.first + (n % buffer_size());
 
 }
 
@@ -684,7 +847,7 @@ void deque<T, Alloc, Buf_size>::fill_initialize(size_type n, const value_type &v
     // 接着就是使用未初始化函数填充map和buffer
     map_pointer cur;
     for (cur = start.map_node; cur != finish.map_node; cur++) {
-        uninitialized_fill(*cur, *cur + Buf_size, value);
+        uninitialized_fill(*cur, *cur + buffer_size(), value);
     }
     // 最后一个map_node指向的缓冲区中，元素可能未填满，所以需要挑出来特殊处理
     // finish.first为finish迭代器指向的元素所在的缓冲区的首地址，而cur为finish迭代器指向的元素的地址
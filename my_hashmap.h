@@ -8,7 +8,7 @@
 #include "my_hashtable.h"
 
 
-template <class Key, class T, class HashFcn = hash<Key>, class EqualKey = equal_to<Key>, class Alloc = alloc>
+template <class Key, class T, class HashFcn = hash<Key>, class EqualKey = equal_to<Key>, class Alloc = node_alloc>
 class hash_map {
 
 private:
@@ -168,7 +168,7 @@ public:
 
 };
 
-template <class Key, class T, class HashFcn = hash<Key>, class EqualKey = equal_to<Key>, class Alloc = alloc>
+template <class Key, class T, class HashFcn = hash<Key>, class EqualKey = equal_to<Key>, class Alloc = node_alloc>
 inline bool operator==(const hash_map<Key, T, HashFcn, EqualKey, Alloc>& hm1,
                         const hash_map<Key, T, HashFcn, EqualKey, Alloc>& hm2) {
     return hm1.rep == hm2.rep;
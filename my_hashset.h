@@ -7,7 +7,7 @@
 
 #include "my_hashtable.h"
 
-template <class Value, class HashFcn = hash<Value>, class EqualKey = equal_to<Value>, class Alloc = alloc>
+template <class Value, class HashFcn = hash<Value>, class EqualKey = equal_to<Value>, class Alloc = node_alloc>
 class hash_set {
 private:
     typedef hashtable<Value, Value, HashFcn, Value, EqualKey, Alloc> hash_table;
@@ -5,6 +5,8 @@
 #ifndef STL_MY_ALLOCATOR_MY_HASHTABLE_H
 #define STL_MY_ALLOCATOR_MY_HASHTABLE_H
 
+#include "node_pool.h"
+
 // 定义hash表中的节点结构
 template <class Value>
 struct _hashtable_node {
@@ -15,18 +17,25 @@ struct _hashtable_node {
 template <class Value, class Key, class HashFcn, class ExtractKey, class EqualKey, class Alloc>
 class hashtable;
 
-template <class Value, class Key, class HashFcn, class ExtractKey, class EqualKey, class Alloc = alloc>
-class hashtable {
+// hashtable内部保存一个分配器实例（见my_allocator.h中的__alloc_holder），无状态的分配器不占用空间
+// 桶的vector也使用同一个分配器
+template <class Value, class Key, class HashFcn, class ExtractKey, class EqualKey, class Alloc = node_alloc>
+class hashtable : protected __alloc_holder<Alloc> {
 public:
     typedef HashFcn hasher;
     typedef size_t size_type;
     typedef Value value_type;
     typedef Key key_type;
     typedef EqualKey key_equal;
+    typedef Alloc allocator_type;
+
+    using __alloc_holder<Alloc>::get_allocator;
 
     typedef _hashtable_iterator<Value, Key, HashFcn, ExtractKey, EqualKey, Alloc> iterator;
 
 private:
+    typedef __alloc_holder<Alloc> alloc_base;
+
     // hash函数对象
     // 只能通过key来获取对象的hash值
     hasher hash;
@@ -42,8 +51,8 @@ private:
     // vector保存所有的桶
     vector<Node*, Alloc> buckets;
 
-    // 节点专属的内存配置器
-    typedef simple_alloc<Node, Alloc> node_allocator;
+    // 节点专属的内存配置器，无状态的分配器通过__node_pool回收节点
+    typedef __node_allocator<Node, Alloc> node_allocator;
 
     size_type elem_nums;
 
@@ -77,25 +86,97 @@ public:
     // 创建一个新节点
     Node* new_node (const value_type& data) {
         // 申请内存
-        Node* node = node_allocator::allocate();
-        construct(node->data, data);
+        Node* node = node_allocator::allocate(this->get_alloc());
+        construct(&node->data, data);
         node->next = nullptr;
         return node;
     }
 
     void delete_node (Node* node) {
-        destroy(node->data);
-        node_allocator::deallocate(node);
+        destroy(&node->data);
+        node_allocator::deallocate(this->get_alloc(), node);
     }
 
 
     // 构造函数，不提供默认构造函数
-    // n 为桶的个数
-    hashtable(size_type n, const HashFcn& hashFcn, const EqualKey& equalKey)
-        : hash(hashFcn), equals(equalKey), get_key(ExtractKey()), elem_nums(0){
+    // n 为桶的个数，a为分配器实例
+    hashtable(size_type n, const HashFcn& hashFcn, const EqualKey& equalKey, const Alloc& a = Alloc())
+        : alloc_base(a), hash(hashFcn), get_key(ExtractKey()), equals(equalKey), buckets(a), elem_nums(0) {
         initialize_buckets(n);
     }
 
+    // 拷贝构造函数，新hashtable的分配器由select_on_container_copy_construction()决定
+    hashtable(const hashtable& ht)
+        : alloc_base(__allocator_traits<Alloc>::select_on_container_copy_construction(ht.get_alloc())),
+          hash(ht.hash), get_key(ht.get_key), equals(ht.equals), buckets(this->get_alloc()), elem_nums(0) {
+        copy_from(ht);
+    }
+
+    // 移动构造函数，直接接管ht的桶和节点，ht换上一组新的空桶，保证之后还可以继续使用
+    hashtable(hashtable&& ht)
+        : alloc_base(ht.get_alloc()), hash(ht.hash), get_key(ht.get_key), equals(ht.equals),
+          buckets(std::move(ht.buckets)), elem_nums(ht.elem_nums) {
+        ht.elem_nums = 0;
+        ht.buckets.resize(next_prime(0), nullptr);
+    }
+
+    ~hashtable() { clear(); }
+
+    // 拷贝赋值
+    // 如果分配器需要传播，而两个分配器又不相等，原来的节点先用旧的分配器回收，再换成ht的分配器
+    hashtable& operator=(const hashtable& ht) {
+        if (&ht != this) {
+            clear();
+            if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment
+                && !__alloc_equal(this->get_alloc(), ht.get_alloc())) {
+                __propagate_on_copy_assign(this->get_alloc(), ht.get_alloc());
+                // 桶的vector也换成ht的分配器，里面拷贝过来的指针马上清掉
+                buckets = ht.buckets;
+                buckets.clear();
+            }
+            hash = ht.hash;
+            get_key = ht.get_key;
+            equals = ht.equals;
+            copy_from(ht);
+        }
+        return *this;
+    }
+
+    // 移动赋值
+    // 分配器会传播或者两个分配器相等时，直接接管ht的桶和节点，否则只能逐个拷贝节点
+    hashtable& operator=(hashtable&& ht) {
+        if (&ht == this)
+            return *this;
+        clear();
+        hash = ht.hash;
+        get_key = ht.get_key;
+        equals = ht.equals;
+        if (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+            || __alloc_equal(this->get_alloc(), ht.get_alloc())) {
+            __propagate_on_move_assign(this->get_alloc(), ht.get_alloc());
+            buckets = std::move(ht.buckets);
+            elem_nums = ht.elem_nums;
+            ht.elem_nums = 0;
+            ht.buckets.resize(next_prime(0), nullptr);
+        }
+        else {
+            copy_from(ht);
+            ht.clear();
+        }
+        return *this;
+    }
+
+    // 交换两个hashtable，只交换桶的vector
+    // 分配器不传播时，要求两个hashtable的分配器相等（与标准库相同）
+    void swap(hashtable& ht) {
+        __propagate_on_swap(this->get_alloc(), ht.get_alloc());
+        buckets.swap(ht.buckets);
+        std::swap(elem_nums, ht.elem_nums);
+        std::swap(hash, ht.hash);
+        std::swap(get_key, ht.get_key);
+        std::swap(equals, ht.equals);
+    }
+
     void initialize_buckets(size_type n) {
         size_type n_buckets = next_prime(n);
         buckets.reserve(n_buckets);
@@ -221,7 +302,7 @@ void hashtable<Value, Key, HashFcn, ExtractKey, EqualKey, Alloc>::resize(const s
     if (n > old_n) {
         size_type new_size = next_prime(n);
         if (new_size > old_n) {
-            vector<Node*, Alloc> new_buckets(new_size, nullptr);
+            vector<Node*, Alloc> new_buckets(new_size, nullptr, this->get_alloc());
             // 原来桶中的值需要重新映射，而不是直接拷贝
             for (size_type i = 0; i < old_n; i++) {
                 Node* temp_node = buckets[i];
@@ -285,7 +366,7 @@ template <class Value, class Key, class HashFcn, class ExtractKey, class EqualKe
 void hashtable<Value, Key, HashFcn, ExtractKey, EqualKey, Alloc>::clear() {
     // 清空所有桶内的节点
     Node* cur;
-    for (int i = 0; i < bucket_size(); i++) {
+    for (size_type i = 0; i < buckets.size(); i++) {
         cur = buckets[i];
         while (cur != nullptr) {
             buckets[i] = cur->next;
@@ -6,6 +6,7 @@
 #define STL_MY_ALLOCATOR_MY_LIST_H
 
 #include "my_allocator.h"
+#include "node_pool.h"
 
 /*
  * list的源代码
@@ -85,17 +86,22 @@ struct __list_iterator {
 
 
 // 最后实现list结构。T为元素类型，Alloc为内存分配器类型
-template <class T, class Alloc = alloc>
-class list {
+// list内部保存一个分配器实例（见my_allocator.h中的__alloc_holder），无状态的分配器不占用空间
+template <class T, class Alloc = node_alloc>
+class list : protected __alloc_holder<Alloc> {
 protected:
     typedef __list_node<T> list_node;
-    typedef simple_alloc<list_node, Alloc> list_node_allocator;     // 专属内存分配器，以节点作为分配单位，每次分配一个节点大小的内存空间
+    typedef __alloc_holder<Alloc> alloc_base;
+    typedef __node_allocator<list_node, Alloc> list_node_allocator;     // 专属内存分配器，以节点作为分配单位，无状态的分配器通过__node_pool回收节点
 public:
     typedef list_node* link_type;
     // list的迭代器类型
     typedef __list_iterator<T, T&, T*> iterator;
     typedef size_t size_type;
     typedef T& reference;              // 元素的引用类型
+    typedef Alloc allocator_type;
+
+    using alloc_base::get_allocator;
 
 protected:
     // 指向起始节点的指针，哨兵节点
@@ -103,16 +109,23 @@ protected:
     link_type node;
 
     // 分配一个节点并返回
-    link_type get_node() { return list_node_allocator::allocate(); }
+    link_type get_node() { return list_node_allocator::allocate(this->get_alloc()); }
     // 释放一个节点的内存空间
-    void put_node(link_type p) { list_node_allocator::deallocate(p); }
+    void put_node(link_type p) { list_node_allocator::deallocate(this->get_alloc(), p); }
 
-    // 申请一个节点的内存空间，并进行构造，带有元素值，返回指向这个节点的指针
-    link_type create_node(const T& x) {
+    // 申请一个节点的内存空间，并用args构造元素（拷贝、移动或者emplace），返回指向这个节点的指针
+    template <class... Args>
+    link_type create_node(Args&&... args) {
         // 申请内存空间
         link_type p = get_node();
-        // 构造对象
-        construct(&p->data, x);
+        // 构造对象，构造失败时释放节点
+        try {
+            construct(&p->data, std::forward<Args>(args)...);
+        }
+        catch (...) {
+            put_node(p);
+            throw;
+        }
         return p;
     }
 
@@ -150,9 +163,102 @@ protected:
     }
 
 
+    // 用x中的元素替换*this中的元素，已有的节点直接赋值复用，多余的删除，不够的再插入
+    void assign_from(const list& x) {
+        iterator first1 = begin();
+        link_type first2 = (link_type)x.node->next;
+        for (; first1 != end() && first2 != x.node; ++first1, first2 = (link_type)first2->next)
+            *first1 = first2->data;
+        if (first2 == x.node) {
+            while (first1 != end())
+                first1 = erase(first1);
+        }
+        else {
+            for (; first2 != x.node; first2 = (link_type)first2->next)
+                push_back(first2->data);
+        }
+    }
+
+
 public:
-    // 默认构造函数，产生一个空链表
-    list() { empty_initialize(); }
+    // 默认构造函数，产生一个空链表，可以指定分配器实例
+    explicit list(const Alloc& a = Alloc()) : alloc_base(a) { empty_initialize(); }
+
+    // 拷贝构造函数，新list的分配器由select_on_container_copy_construction()决定
+    list(const list& x)
+        : alloc_base(__allocator_traits<Alloc>::select_on_container_copy_construction(x.get_alloc())) {
+        empty_initialize();
+        try {
+            for (link_type cur = (link_type)x.node->next; cur != x.node; cur = (link_type)cur->next)
+                push_back(cur->data);
+        }
+        catch (...) {
+            clear();
+            put_node(node);
+            throw;
+        }
+    }
+
+    // 移动构造函数，直接接管x的所有节点，x换上一个新的空节点
+    // 声明为noexcept，这样vector<list<T>>扩容时会移动而不是拷贝里面的list；给x申请空节点失败时程序终止
+    list(list&& x) noexcept : alloc_base(x.get_alloc()) {
+        node = x.node;
+        x.empty_initialize();
+    }
+
+    // 析构函数，销毁所有节点，最后释放空节点
+    ~list() {
+        clear();
+        put_node(node);
+    }
+
+    // 拷贝赋值
+    // 如果分配器需要传播，而两个分配器又不相等，原来的节点必须先用旧的分配器回收，再换成x的分配器
+    list& operator=(const list& x) {
+        if (&x != this) {
+            if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment
+                && !__alloc_equal(this->get_alloc(), x.get_alloc())) {
+                clear();
+                put_node(node);
+                __propagate_on_copy_assign(this->get_alloc(), x.get_alloc());
+                empty_initialize();
+            }
+            assign_from(x);
+        }
+        return *this;
+    }
+
+    // 移动赋值
+    // 分配器会传播或者两个分配器相等时，直接接管x的所有节点，x换上自己原来的空节点，不需要申请内存
+    // 分配器传播时，原来的空节点要由原来的分配器回收，所以把原来的分配器也交给x
+    // 否则只能逐个拷贝元素
+    list& operator=(list&& x) noexcept(__move_assign_steals<Alloc>::value) {
+        if (&x == this)
+            return *this;
+        if (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+            || __alloc_equal(this->get_alloc(), x.get_alloc())) {
+            clear();
+            if (__allocator_traits<Alloc>::propagate_on_container_move_assignment)
+                std::swap(this->get_alloc(), x.get_alloc());
+            link_type tmp = node;
+            node = x.node;
+            x.node = tmp;
+        }
+        else {
+            assign_from(x);
+            x.clear();
+        }
+        return *this;
+    }
+
+    // 交换两个list，只需要交换空节点
+    // 分配器不传播时，要求两个list的分配器相等（与标准库相同）
+    void swap(list& x) {
+        __propagate_on_swap(this->get_alloc(), x.get_alloc());
+        link_type tmp = node;
+        node = x.node;
+        x.node = tmp;
+    }
 
     // begin()，返回node指向的空节点的下一个节点
     // 空节点是尾节点与头节点的连接节点
@@ -176,9 +282,14 @@ public:
     reference back() { return *(--end()); }
 
     // 指定位置插入节点（位置之前插入）
-    iterator insert(iterator position, const T& x) {
+    iterator insert(iterator position, const T& x) { return emplace(position, x); }
+    iterator insert(iterator position, T&& x) { return emplace(position, std::move(x)); }
+
+    // 在position之前插入一个由args直接构造的节点
+    template <class... Args>
+    iterator emplace(iterator position, Args&&... args) {
         // 申请节点的内存空间，并初始化节点内部的data
-        link_type p = create_node(x);
+        link_type p = create_node(std::forward<Args>(args)...);
         // 将节点p插入list中position节点之前
         p->next = position.node;
         p->prev = position.node->prev;
@@ -190,9 +301,17 @@ public:
 
     // 插入一个节点作为头节点
     void push_front(const T& x) { insert(begin(), x); }
+    void push_front(T&& x) { insert(begin(), std::move(x)); }
+
+    template <class... Args>
+    void emplace_front(Args&&... args) { emplace(begin(), std::forward<Args>(args)...); }
 
     // 最后位置插入节点
     void push_back(const T& x) { insert(end(), x); }
+    void push_back(T&& x) { insert(end(), std::move(x)); }
+
+    template <class... Args>
+    void emplace_back(Args&&... args) { emplace(end(), std::forward<Args>(args)...); }
 
     // 移除迭代器position所指向的节点，返回指向下一个节点的迭代器
     iterator erase(iterator position) {
@@ -13,7 +13,7 @@
 // 大大降低了set的复杂性
 // set中每一个元素的key和value是相同的
 // Key为键值类型，Compare为比较对象，Alloc为内存分配对象
-template <class Key, class Compare = less<Key>, class Alloc = alloc>
+template <class Key, class Compare = less<Key>, class Alloc = node_alloc>
 class set {
 public:
     // typedefs
@@ -113,9 +113,16 @@ ForwardIterator __uninitialized_copy_aux(InputIterator first, InputIterator last
 template <class InputIterator, class ForwardIterator, class T>
 ForwardIterator __uninitialized_copy_aux(InputIterator first, InputIterator last, ForwardIterator result, __false_type) {
     // 借用construct()实现
+    // commit or rollback：某个元素拷贝时抛出异常，先析构已经构造的元素再重新抛出
     ForwardIterator cur = result;
-    for(; first != last; first++, cur++) {
-        construct(&*cur, *first);        // 一个一个地调用construct()，result指向已申请但未构造的内存空间，first为需要拷贝的值
+    try {
+        for(; first != last; first++, cur++) {
+            construct(&*cur, *first);        // 一个一个地调用construct()，result指向已申请但未构造的内存空间，first为需要拷贝的值
+        }
+    }
+    catch (...) {
+        destroy(result, cur);
+        throw;
     }
     return cur;
 }
@@ -4,6 +4,7 @@
 #include "first_level_alloc.h"
 #include "second_level_alloc.h"
 #include "my_uninitialized.h"
+#include <string.h>
 
 
 #ifndef STL_MY_ALLOCATOR_MY_VECTOR_H
@@ -13,35 +14,142 @@
 typedef __malloc_alloc_template<0> malloc_alloc;
 typedef malloc_alloc alloc;     // 令alloc为第一级分配器
 
+// 节点容器（list、rb_tree、hashtable以及set、hash_set、hash_map）默认使用的分配器
+// 节点小而且插入、删除频繁，默认交给第二级分配器（内存池）；vector、deque的缓冲区往往很大，仍然使用第一级分配器
+// 使用第二级分配器的节点容器通过__node_pool回收节点（见node_pool.h中的__recycle_nodes），其他分配器逐个分配节点
+// 编译时定义__USE_MALLOC则节点容器也使用第一级分配器（与SGI STL相同）
+// __NODE_ALLOCATOR_THREADS定义为false时使用单线程版本的内存池，省去thread cache的开销，只能在单线程程序中使用
+#ifndef __NODE_ALLOCATOR_THREADS
+#define __NODE_ALLOCATOR_THREADS true
+#endif
+
+#ifdef __USE_MALLOC
+typedef malloc_alloc node_alloc;
+#else
+typedef __default_alloc_template<__NODE_ALLOCATOR_THREADS, 0> node_alloc;
+#endif
+
+
+// vector的增长策略，作为vector的第三个模板参数
+// next_capacity()返回扩容之后的容量，size为当前元素个数，required为插入之后至少需要的元素个数，elem_size为sizeof(T)
+// 2倍增长：扩容次数最少，但是旧缓冲区和新缓冲区同时存在时峰值内存是元素所需的3倍，而且释放的旧缓冲区永远不够下一次复用
+struct __vector_growth_2x {
+    static size_t next_capacity(size_t size, size_t required, size_t /*elem_size*/) {
+        size_t n = size == 0 ? 1 : 2 * size;
+        return n < required ? required : n;
+    }
+};
+
+// 1.5倍增长：扩容次数多一些，峰值内存更低，之前释放的几块旧缓冲区加起来有机会被分配器复用
+struct __vector_growth_1_5x {
+    static size_t next_capacity(size_t size, size_t required, size_t /*elem_size*/) {
+        size_t n = size + size / 2;
+        return n < required ? required : n;
+    }
+};
 
-template <class T, class Alloc = alloc>
-class vector {
+const static size_t __VECTOR_PAGE_BYTES = 4096;                 // 页的大小
+const static size_t __VECTOR_PAGED_THRESHOLD = 64 * 1024;      // 缓冲区达到这个大小之后按页增长
+
+// 按页增长：小缓冲区与2倍增长相同，达到__VECTOR_PAGED_THRESHOLD之后改为1.5倍，并把字节数向上取整到整页
+// 大缓冲区由第一级分配器交给mmap/mremap（见first_level_alloc.h），本来就是按页分配的，取整之后最后一页也能放满元素
+struct __vector_growth_paged {
+    static size_t next_capacity(size_t size, size_t required, size_t elem_size) {
+        size_t n = __vector_growth_2x::next_capacity(size, required, elem_size);
+        if (n * elem_size < __VECTOR_PAGED_THRESHOLD)
+            return n;
+        n = __vector_growth_1_5x::next_capacity(size, required, elem_size);
+        size_t bytes = (n * elem_size + __VECTOR_PAGE_BYTES - 1) & ~(__VECTOR_PAGE_BYTES - 1);
+        return bytes / elem_size;
+    }
+};
+
+// vector内部保存一个分配器实例（见my_allocator.h中的__alloc_holder），无状态的分配器不占用空间
+// Growth为增长策略，决定插入时容量不够用时扩容到多大，默认2倍
+template <class T, class Alloc = alloc, class Growth = __vector_growth_2x>
+class vector : protected __alloc_holder<Alloc> {
 public:
     // vector的嵌套类型定义
     typedef T           value_type;         // 元素类型
     typedef value_type* pointer;            // 元素指针类型
     typedef value_type* iterator;           // 迭代器类型
+    typedef const value_type* const_iterator;     // 只读迭代器类型
     typedef value_type& reference;          // 元素引用类型
     typedef size_t      size_type;          // 元素数量的类型
     typedef ptrdiff_t   difference_type;    // 元素指针差值的类型
+    typedef Alloc       allocator_type;     // 分配器类型
+
+    using __alloc_holder<Alloc>::get_allocator;
 
 protected:
+    typedef __alloc_holder<Alloc> alloc_base;
     typedef simple_alloc<value_type, Alloc> data_allocator;     // 内存分配器，底层是由第一级分配器和第二级分配器构成
 
     iterator start;             // 迭代器，表示目前使用空间的头部。实际上这三个迭代器都是指向元素的指针
     iterator finish;            // 迭代器，表示目前使用空间的尾部
     iterator end_of_storage;    // 迭代器，表示目前可用空间的尾部
 
+    // 元素可以按字节搬动时（见my_allocator.h中的__is_trivially_relocatable），扩容通过data_allocator::reallocate()进行，
+    // 不需要逐个拷贝、析构元素：第一级分配器可以用realloc原地扩大，很大的缓冲区通过mremap重新映射页表
+    static const bool relocatable = __is_trivially_relocatable<T>::value;
+
+    // 把容量调整为new_size（不小于size()），已有的元素搬到新的地址
+    // 元素可以按字节搬动时通过reallocate()进行，否则申请新的内存空间，把元素移动（或者拷贝）过去
+    void reallocate_storage(size_type new_size) {
+        const size_type n = size();
+        if (relocatable) {
+            start = data_allocator::reallocate(this->get_alloc(), start, capacity(), new_size);
+        }
+        else {
+            iterator new_start = data_allocator::allocate(this->get_alloc(), new_size);
+            try {
+                __uninitialized_move_if_noexcept(start, finish, new_start);
+            }
+            catch (...) {
+                data_allocator::deallocate(this->get_alloc(), new_start, new_size);
+                throw;
+            }
+            destroy(start, finish);
+            deallocate();
+            start = new_start;
+        }
+        finish = start + n;
+        end_of_storage = start + new_size;
+    }
+
     // 插入时内存空间不够用，需要调整内存空间的辅助函数
-    void insert_aux(iterator position, const T& x);
+    // 新元素由args构造（拷贝、移动或者emplace），原来的元素在移动构造函数不会抛出异常时移动过去，否则拷贝
+    template <class... Args>
+    void insert_aux(iterator position, Args&&... args);
+
+    // 插入[first, last)，整数类型的参数实际上是insert(position, n, x)
+    template <class Integer>
+    void insert_dispatch(iterator position, Integer n, Integer x, std::true_type) {
+        insert(position, (size_type) n, (T) x);
+    }
 
-    // 在position开始的位置连续插入n个X的拷贝
-    void insert(iterator position, size_type n, const T& x);
+    template <class InputIterator>
+    void insert_dispatch(iterator position, InputIterator first, InputIterator last, std::false_type) {
+        range_insert(position, first, last, typename iterator_traits<InputIterator>::iterator_category());
+    }
+
+    // 输入迭代器只能遍历一次，事先不知道元素个数，只能逐个插入
+    template <class InputIterator>
+    void range_insert(iterator position, InputIterator first, InputIterator last, input_iterator_tag) {
+        for (; first != last; ++first) {
+            position = insert(position, *first);
+            ++position;
+        }
+    }
+
+    // 前向迭代器可以先用distance()算出元素个数，容量不够时只扩容一次
+    template <class ForwardIterator>
+    void range_insert(iterator position, ForwardIterator first, ForwardIterator last, forward_iterator_tag);
 
     // 回收vector使用的内存空间，主要是借用内存分配器提供的回收接口实现
     void deallocate() {
         if (start != NULL)
-            data_allocator::deallocate(start, (size_type)(end_of_storage - start));
+            data_allocator::deallocate(this->get_alloc(), start, (size_type)(end_of_storage - start));
     }
 
     // 在vector中初始化n个元素
@@ -58,31 +166,95 @@ public:
     iterator end() { return finish; }
     size_type size() { return (size_type)(end() - begin()); }
     // 返回vector所申请的内存空间大小（以元素的大小为单位）
-    size_type capacity() const { return (size_type)(end_of_storage - begin()); }
+    size_type capacity() const { return (size_type)(end_of_storage - start); }
     bool empty() const { return begin() == end(); }
     reference operator[](size_type n) { return *(begin() + n); }
 
     // 构造函数
+    // 每个构造函数都可以指定分配器实例，默认构造一个
     // 默认构造函数
-    vector() : start(0), finish(0), end_of_storage(0) {}
+    explicit vector(const Alloc& a = Alloc()) : alloc_base(a), start(0), finish(0), end_of_storage(0) {}
     // 构造n个value(size_type)
-    vector(size_type n, const T& value) {
+    vector(size_type n, const T& value, const Alloc& a = Alloc()) : alloc_base(a) {
         fill_initialize(n, value);
     }
     // int
-    vector(int n, const T& value) {
+    vector(int n, const T& value, const Alloc& a = Alloc()) : alloc_base(a) {
         fill_initialize(n, value);
     }
     // long
-    vector(long n, const T& value) {
+    vector(long n, const T& value, const Alloc& a = Alloc()) : alloc_base(a) {
         fill_initialize(n, value);
     }
     // 构造n个默认初始化的元素，调用T的默认构造函数
     // 只有一个参数的构造函数需要加explicit，避免隐式类型转换
-    explicit vector(size_type n) {
+    explicit vector(size_type n, const Alloc& a = Alloc()) : alloc_base(a) {
         fill_initialize(n, T());
     }
 
+    // 拷贝构造函数，新vector的分配器由select_on_container_copy_construction()决定
+    vector(const vector& x)
+        : alloc_base(__allocator_traits<Alloc>::select_on_container_copy_construction(x.get_alloc())) {
+        size_type n = (size_type)(x.finish - x.start);
+        start = allocate_and_copy(n, x.start, x.finish);
+        finish = start + n;
+        end_of_storage = finish;
+    }
+
+    // 移动构造函数，直接接管x的内存空间，分配器也一起拿过来
+    // 声明为noexcept，vector<vector<T>>扩容时__uninitialized_move_if_noexcept才会移动而不是拷贝里面的vector
+    vector(vector&& x) noexcept : alloc_base(x.get_alloc()), start(x.start), finish(x.finish), end_of_storage(x.end_of_storage) {
+        x.start = x.finish = x.end_of_storage = 0;
+    }
+
+    // 拷贝赋值
+    // 如果分配器需要传播，而两个分配器又不相等，原来的内存必须先用旧的分配器回收，再换成x的分配器
+    vector& operator=(const vector& x) {
+        if (&x != this) {
+            if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment
+                && !__alloc_equal(this->get_alloc(), x.get_alloc())) {
+                destroy(start, finish);
+                deallocate();
+                start = finish = end_of_storage = 0;
+            }
+            __propagate_on_copy_assign(this->get_alloc(), x.get_alloc());
+            assign_aux(x.start, x.finish, random_access_iterator_tag());
+        }
+        return *this;
+    }
+
+    // 移动赋值
+    // 分配器会传播或者两个分配器相等时，直接接管x的内存空间
+    // 否则x的内存不能由自己的分配器回收，只能逐个拷贝元素
+    vector& operator=(vector&& x) noexcept(__move_assign_steals<Alloc>::value) {
+        if (&x == this)
+            return *this;
+        if (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+            || __alloc_equal(this->get_alloc(), x.get_alloc())) {
+            destroy(start, finish);
+            deallocate();
+            __propagate_on_move_assign(this->get_alloc(), x.get_alloc());
+            start = x.start;
+            finish = x.finish;
+            end_of_storage = x.end_of_storage;
+            x.start = x.finish = x.end_of_storage = 0;
+        }
+        else {
+            assign_aux(x.start, x.finish, random_access_iterator_tag());
+            x.clear();
+        }
+        return *this;
+    }
+
+    // 交换两个vector，只交换指针
+    // 分配器不传播时，要求两个vector的分配器相等（与标准库相同）
+    void swap(vector& x) {
+        __propagate_on_swap(this->get_alloc(), x.get_alloc());
+        std::swap(start, x.start);
+        std::swap(finish, x.finish);
+        std::swap(end_of_storage, x.end_of_storage);
+    }
+
 
     // 析构函数
     // 借助allocator头文件中的destroy()对所有元素进行析构
@@ -112,6 +284,107 @@ public:
             insert_aux(end(), X);
     }
 
+    // 右值版本，移动构造新元素
+    void push_back(T&& X) {
+        if (finish != end_of_storage) {
+            construct(finish, std::move(X));
+            finish++;
+        }
+        else
+            insert_aux(end(), std::move(X));
+    }
+
+    // 直接在尾端用args构造新元素，不产生临时对象
+    template <class... Args>
+    void emplace_back(Args&&... args) {
+        if (finish != end_of_storage) {
+            construct(finish, std::forward<Args>(args)...);
+            finish++;
+        }
+        else
+            insert_aux(end(), std::forward<Args>(args)...);
+    }
+
+    // 在position之前用args构造新元素，返回指向新元素的迭代器
+    // 还有剩余空间时，先把最后一个元素移动构造到finish，其余的元素依次往后移动一位，再把新元素移动赋值到position
+    template <class... Args>
+    iterator emplace(iterator position, Args&&... args) {
+        const size_type elems_before = (size_type)(position - start);
+        if (finish == end_of_storage) {
+            insert_aux(position, std::forward<Args>(args)...);
+        }
+        else if (position == finish) {
+            construct(finish, std::forward<Args>(args)...);
+            ++finish;
+        }
+        else {
+            T x_copy(std::forward<Args>(args)...);      // args可能引用vector中的元素，先构造出来再移动
+            construct(finish, std::move(*(finish - 1)));
+            ++finish;
+            std::move_backward(position, finish - 2, finish - 1);
+            *position = std::move(x_copy);
+        }
+        return start + elems_before;
+    }
+
+    // 在position之前插入x，返回指向新元素的迭代器
+    iterator insert(iterator position, const T& x) { return emplace(position, x); }
+    iterator insert(iterator position, T&& x) { return emplace(position, std::move(x)); }
+
+    // 在position开始的位置连续插入n个x的拷贝
+    void insert(iterator position, size_type n, const T& x);
+
+    // 在position之前插入[first, last)的元素
+    // 前向迭代器的区间先算出元素个数，容量不够时按增长策略只扩容一次，而不是随着逐个插入多次扩容
+    template <class InputIterator>
+    void insert(iterator position, InputIterator first, InputIterator last) {
+        insert_dispatch(position, first, last, std::is_integral<InputIterator>());
+    }
+
+    // 用n个x替换vector中的元素，n大于容量时直接申请刚好n个元素的内存空间
+    void assign(size_type n, const T& x) {
+        if (n > capacity()) {
+            iterator new_start = allocate_and_fill(n, x);
+            destroy(start, finish);
+            deallocate();
+            start = new_start;
+            finish = end_of_storage = start + n;
+        }
+        else if (n > size()) {
+            fill(start, finish, x);
+            finish = uninitialized_fill_n(finish, n - size(), x);
+        }
+        else {
+            fill_n(start, n, x);
+            erase(start + n, finish);
+        }
+    }
+
+    // 用[first, last)替换vector中的元素，前向迭代器的区间元素个数大于容量时只申请一次刚好放得下的内存空间
+    template <class InputIterator>
+    void assign(InputIterator first, InputIterator last) {
+        assign_dispatch(first, last, std::is_integral<InputIterator>());
+    }
+
+    // 把容量扩大到至少n个元素，只申请一次刚好n个元素的内存空间，n不大于容量时什么都不做
+    // 事先知道元素个数时先reserve()，之后的push_back()都不会再扩容
+    void reserve(size_type n) {
+        if (n > capacity())
+            reallocate_storage(n);
+    }
+
+    // 把容量缩小到size()，回收多余的内存空间
+    // 元素可以按字节搬动时通过reallocate()原地缩小，否则元素会搬到新的内存空间上，原来的迭代器都会失效
+    void shrink_to_fit() {
+        if (start == finish) {
+            deallocate();
+            start = finish = end_of_storage = 0;
+        }
+        else if (finish != end_of_storage) {
+            reallocate_storage(size());
+        }
+    }
+
     // 弹出尾部元素。实际上就是对尾部元素进行析构，但是不回收内存空间，并对finish的值进行更新
     void pop_back() {
         if (start != finish) {
@@ -125,9 +398,8 @@ public:
     // 先将后面的一部分元素往前覆盖，然后删除最后的那几个元素
     // 函数返回指向删除起始位置的迭代器
     iterator erase(iterator first, iterator last) {
-        // copy()为全局函数，具体实现在第6章
-        // 将last到finish的元素依次拷贝到first开始的内存空间
-        iterator i = copy(last, finish, first);
+        // 将last到finish的元素依次移动到first开始的内存空间
+        iterator i = std::move(last, finish, first);
         // 然后析构i到finish的元素对象
         destroy(i, finish);
         // 更新finish迭代器
@@ -143,9 +415,8 @@ public:
         // 如果当前元素不是最后一个元素，往前覆盖
         // 最终都是直接删除最后一个位置的元素
         if (position+1 != finish) {
-            // 使用copy()将后面的元素往前移动
-            // 将position+1到finish的元素一次拷贝到position开始的内存空间
-            copy(position+1, finish, position);
+            // 将position+1到finish的元素依次移动到position开始的内存空间
+            std::move(position+1, finish, position);
         }
         --finish;
         // 析构最后一个元素对象
@@ -175,44 +446,163 @@ public:
     // 清除所有元素，直接使用erase()迭代器区间
     void clear() { erase(begin(), end()); }
 
+    // 把元素个数调整为new_size，新增的元素默认初始化，而不是像resize()那样复制T()
+    // T可以平凡默认构造时新增的元素不会被写入，值是不确定的，调用者需要在读取之前自己写入（例如read()或者计算kernel的输出）
+    // 这样很大的缓冲区只在调用者写入时被访问一次，而不是先清零再写一遍；新申请的页在写入之前也不会占用物理内存
+    void resize_default_init(size_type new_size) {
+        if (new_size < size()) {
+            erase(begin() + new_size, end());
+            return;
+        }
+        if (new_size > capacity())
+            reallocate_storage(Growth::next_capacity(size(), new_size, sizeof(T)));
+        finish = __uninitialized_default_n(finish, new_size - size());
+    }
+
+    // 在尾端追加最多n个元素，由writer直接写入vector的内存，返回实际追加的元素个数
+    // writer(p, n)向p开始的n个位置写入元素，返回写入的个数（不超过n），例如
+    //   v.reserve_and_write(n, [&](float* p, size_t n) { return fread(p, sizeof(float), n, file); });
+    // 这n个位置与resize_default_init()相同只做默认初始化，writer没有写入的部分不会成为vector的元素
+    // writer抛出异常时vector的元素不变，已经扩大的容量保留
+    template <class Writer>
+    size_type reserve_and_write(size_type n, Writer writer) {
+        if (size() + n > capacity())
+            reallocate_storage(Growth::next_capacity(size(), size() + n, sizeof(T)));
+        iterator slots_end = __uninitialized_default_n(finish, n);
+        size_type written;
+        try {
+            written = writer(finish, n);
+        }
+        catch (...) {
+            destroy(finish, slots_end);
+            throw;
+        }
+        destroy(finish + written, slots_end);
+        finish += written;
+        return written;
+    }
+
 protected:
     // 分配内存空间，并构造n个value对象，并返回指向内存空间首地址的迭代器（指向首元素的指针）
     // 这个需要使用分配器的allocate()进行内存空间的分配，以及uninitialized_fill_n()实现n个元素的拷贝初始化
     iterator allocate_and_fill(size_type n, const T& value) {
-        iterator result = data_allocator::allocate(n);
+        iterator result = data_allocator::allocate(this->get_alloc(), n);
         ::uninitialized_fill_n(result, n, value);
         return result;
     }
+
+    // 分配n个元素的内存空间，并将[first, last)拷贝过去，拷贝失败时回收内存空间
+    template <class ForwardIterator>
+    iterator allocate_and_copy(size_type n, ForwardIterator first, ForwardIterator last) {
+        iterator result = data_allocator::allocate(this->get_alloc(), n);
+        try {
+            uninitialized_copy(first, last, result);
+        }
+        catch (...) {
+            data_allocator::deallocate(this->get_alloc(), result, n);
+            throw;
+        }
+        return result;
+    }
+
+    template <class Integer>
+    void assign_dispatch(Integer n, Integer x, std::true_type) { assign((size_type) n, (T) x); }
+
+    template <class InputIterator>
+    void assign_dispatch(InputIterator first, InputIterator last, std::false_type) {
+        assign_aux(first, last, typename iterator_traits<InputIterator>::iterator_category());
+    }
+
+    // 输入迭代器：先赋值给已有的元素，多出来的元素再逐个添加到尾端
+    template <class InputIterator>
+    void assign_aux(InputIterator first, InputIterator last, input_iterator_tag) {
+        iterator cur = start;
+        for (; first != last && cur != finish; ++first, ++cur)
+            *cur = *first;
+        if (first == last)
+            erase(cur, finish);
+        else
+            range_insert(finish, first, last, input_iterator_tag());
+    }
+
+    // 用[first, last)替换vector中的元素，容量足够时复用原来的内存空间
+    template <class ForwardIterator>
+    void assign_aux(ForwardIterator first, ForwardIterator last, forward_iterator_tag) {
+        const size_type n = (size_type) distance(first, last);
+        if (n > capacity()) {
+            iterator new_start = allocate_and_copy(n, first, last);
+            destroy(start, finish);
+            deallocate();
+            start = new_start;
+            end_of_storage = start + n;
+        }
+        else if (size() >= n) {
+            iterator i = copy(first, last, start);
+            destroy(i, finish);
+        }
+        else {
+            ForwardIterator mid = first;
+            advance(mid, size());
+            copy(first, mid, start);
+            uninitialized_copy(mid, last, finish);
+        }
+        finish = start + n;
+    }
 };
 
 // 其实并不是在原有的空间上接续新空间，因为无法保证原有空间之后是否还有可供分配的内存空间
 // 所以是以原空间大小的2倍重新申请内存空间，并将原有的元素拷贝至新的内存空间，最后释放原来的内存空间
 // 所以原有的迭代器都会失效，都必须更新
 //
-template <class T, class Alloc>
-void vector<T, Alloc>::insert_aux(vector<T, Alloc>::iterator position, const T &x) {
+template <class T, class Alloc, class Growth>
+template <class... Args>
+void vector<T, Alloc, Growth>::insert_aux(vector<T, Alloc, Growth>::iterator position, Args&&... args) {
     const size_type old_size = size();
-    // 如果old_size为0，则new_size为1；否则如果old_size不为0，则new_size为2*old_size
-    const size_type new_size = (old_size == 0 ? 1 : 2 * old_size);
+    // 新的容量由增长策略决定，默认的__vector_growth_2x：old_size为0时new_size为1，否则为2*old_size
+    const size_type new_size = Growth::next_capacity(old_size, old_size + 1, sizeof(T));
+
+    // 元素可以按字节搬动，交给reallocate()，然后把插入点之后的元素后移一位
+    if (relocatable) {
+        T x_copy(std::forward<Args>(args)...);      // args可能引用vector中的元素，reallocate()之后原来的地址就失效了
+        const size_type elems_before = (size_type)(position - start);
+        reallocate_storage(new_size);
+        position = start + elems_before;
+        memmove((void*)(position + 1), (void*)position, (size_type)(finish - position) * sizeof(T));
+        try {
+            construct(position, std::move(x_copy));
+        }
+        // 构造失败时把元素移回原来的位置，容量的增加保留
+        catch (...) {
+            memmove((void*)position, (void*)(position + 1), (size_type)(finish - position) * sizeof(T));
+            throw;
+        }
+        ++finish;
+        return;
+    }
 
     // 使用分配器的allocate()申请新的内存空间
-    iterator new_start = data_allocator::allocate(new_size);
+    iterator new_start = data_allocator::allocate(this->get_alloc(), new_size);
     iterator new_finish = new_start;
-
+    const size_type elems_before = (size_type)(position - start);
 
     try {
-        // 接着将原vector的元素拷贝至新的内存空间中
-        new_finish = uninitialized_copy(start, position, new_start);
-        // 然后将需要添加的x拷贝到新的结尾中
-        construct(new_finish, x);
-        // 调整new_finish
+        // 先在新的内存空间上构造新元素，args可能引用vector中的元素，这时原来的元素还没有被移走
+        construct(new_start + elems_before, std::forward<Args>(args)...);
+        // new_finish为0表示新元素已经构造，但是原来的元素还没有搬过去
+        new_finish = 0;
+        // 接着将原vector的元素移动（或者拷贝）至新的内存空间中，插入点之前的放在新元素前面，之后的放在新元素后面
+        new_finish = __uninitialized_move_if_noexcept(start, position, new_start);
         ++new_finish;
+        new_finish = __uninitialized_move_if_noexcept(position, finish, new_finish);
     }
-    // 如果拷贝的过程中发生了异常，需要析构对象，然后回收新申请的内存空间
+    // 如果构造的过程中发生了异常，需要析构对象，然后回收新申请的内存空间
     // 接着抛出异常
     catch (...) {
-        destroy(new_start, new_finish);
-        data_allocator::deallocate(new_start, new_size);
+        if (new_finish == 0)
+            destroy(new_start + elems_before);
+        else
+            destroy(new_start, new_finish);
+        data_allocator::deallocate(this->get_alloc(), new_start, new_size);
         throw;
     }
 
@@ -227,8 +617,8 @@ void vector<T, Alloc>::insert_aux(vector<T, Alloc>::iterator position, const T &
 }
 
 // 从position开始的位置，连续插入n个x的拷贝
-template <class T, class Alloc>
-void vector<T, Alloc>::insert(vector::iterator position, vector::size_type n, const T &x) {
+template <class T, class Alloc, class Growth>
+void vector<T, Alloc, Growth>::insert(vector::iterator position, vector::size_type n, const T &x) {
     if (n != 0) {
         // 如果备用空间的大小满足插入n个x的拷贝，则直接插入
         if (size_type(end_of_storage - finish) >= n) {
@@ -263,29 +653,49 @@ void vector<T, Alloc>::insert(vector::iterator position, vector::size_type n, co
             }
         }
         // 如果备用空间的大小不满足插入n个x的拷贝，则需要分配新的内存空间，并将原来的元素拷贝到新的内存空间中
-        // 新的内存空间大小可以是旧长度的两倍，或是旧长度+新增元素个数，取决于哪一个更大
+        // 新的内存空间大小由增长策略决定，默认是旧长度的两倍，或是旧长度+新增元素个数，取决于哪一个更大
         else {
             const size_type old_size = size();
-            const size_type new_size = old_size + max(old_size, n);
+            const size_type new_size = Growth::next_capacity(old_size, old_size + n, sizeof(T));
+
+            // 元素可以按字节搬动，交给reallocate()，然后把插入点之后的元素后移n位，在空出来的位置上填充
+            if (relocatable) {
+                T x_copy = x;
+                const size_type elems_before = (size_type)(position - start);
+                reallocate_storage(new_size);
+                position = start + elems_before;
+                memmove((void*)(position + n), (void*)position, (size_type)(finish - position) * sizeof(T));
+                try {
+                    uninitialized_fill_n(position, n, x_copy);
+                }
+                catch (...) {
+                    memmove((void*)position, (void*)(position + n), (size_type)(finish - position) * sizeof(T));
+                    throw;
+                }
+                finish += n;
+                return;
+            }
 
             // 分配新的内存空间，借助内存分配器
-            iterator new_start = data_allocator::allocate(new_size);
+            iterator new_start = data_allocator::allocate(this->get_alloc(), new_size);
             iterator new_finish = new_start;
 
+            T x_copy = x;       // x可能就是vector中的元素，移动之后就不能再用了
+
             try {
                 // 因为新的内存空间上都是没有初始化的，所以调用的都是未初始化版本的函数
-                // 先将旧vector的插入点之前的元素复制到新的空间上
-                new_finish = uninitialized_copy(start, position, new_finish);
+                // 先将旧vector的插入点之前的元素移动（移动构造函数可能抛出异常时复制）到新的空间上
+                new_finish = __uninitialized_move_if_noexcept(start, position, new_finish);
                 // 再将需要添加的元素填到后面
-                new_finish = uninitialized_fill_n(new_finish, n, x);
-                // 最后将旧vector上position至finish上的元素复制到新空间上
-                new_finish = uninitialized_copy(position, finish, new_finish);
+                new_finish = uninitialized_fill_n(new_finish, n, x_copy);
+                // 最后将旧vector上position至finish上的元素移动到新空间上
+                new_finish = __uninitialized_move_if_noexcept(position, finish, new_finish);
             }
             catch (...) {
                 // 如果发生了异常，实现“commit or rollback”
                 // 这里是直接rollback，析构对象，并回收新申请的内存空间
                 destroy(new_start, new_finish);
-                data_allocator::deallocate(new_start, new_size);
+                data_allocator::deallocate(this->get_alloc(), new_start, new_size);
                 throw;
             }
 
@@ -302,7 +712,74 @@ void vector<T, Alloc>::insert(vector::iterator position, vector::size_type n, co
     }
 }
 
+// 在position之前插入前向迭代器区间[first, last)
+// 与insert(position, n, x)相同，只是填充的元素来自区间；容量不够时按增长策略一次扩容到放得下所有新元素
+template <class T, class Alloc, class Growth>
+template <class ForwardIterator>
+void vector<T, Alloc, Growth>::range_insert(iterator position, ForwardIterator first, ForwardIterator last,
+                                            forward_iterator_tag) {
+    if (first == last)
+        return;
+    const size_type n = (size_type) distance(first, last);
+    // 备用空间足够，已经构造的位置赋值，没有构造的位置构造
+    if (size_type(end_of_storage - finish) >= n) {
+        iterator old_finish = finish;
+        const size_type elems_after = (size_type)(finish - position);
+        if (elems_after > n) {
+            finish = __uninitialized_move_if_noexcept(finish - n, finish, finish);
+            std::move_backward(position, old_finish - n, old_finish);
+            copy(first, last, position);
+        }
+        else {
+            ForwardIterator mid = first;
+            advance(mid, elems_after);
+            finish = uninitialized_copy(mid, last, finish);
+            finish = __uninitialized_move_if_noexcept(position, old_finish, finish);
+            copy(first, mid, position);
+        }
+        return;
+    }
 
+    const size_type old_size = size();
+    const size_type new_size = Growth::next_capacity(old_size, old_size + n, sizeof(T));
+
+    // 元素可以按字节搬动，交给reallocate()，然后把插入点之后的元素后移n位，在空出来的位置上拷贝区间
+    if (relocatable) {
+        const size_type elems_before = (size_type)(position - start);
+        reallocate_storage(new_size);
+        position = start + elems_before;
+        memmove((void*)(position + n), (void*)position, (size_type)(finish - position) * sizeof(T));
+        try {
+            uninitialized_copy(first, last, position);
+        }
+        catch (...) {
+            memmove((void*)position, (void*)(position + n), (size_type)(finish - position) * sizeof(T));
+            throw;
+        }
+        finish += n;
+        return;
+    }
+
+    iterator new_start = data_allocator::allocate(this->get_alloc(), new_size);
+    iterator new_finish = new_start;
+    try {
+        new_finish = __uninitialized_move_if_noexcept(start, position, new_finish);
+        new_finish = uninitialized_copy(first, last, new_finish);
+        new_finish = __uninitialized_move_if_noexcept(position, finish, new_finish);
+    }
+    catch (...) {
+        destroy(new_start, new_finish);
+        data_allocator::deallocate(this->get_alloc(), new_start, new_size);
+        throw;
+    }
+    destroy(start, finish);
+    deallocate();
+    start = new_start;
+    finish = new_finish;
+    end_of_storage = new_start + new_size;
+}
 
+// vector<bool>的特化版本，每个元素只占1位
+#include "my_bvector.h"
 
 #endif //STL_MY_ALLOCATOR_MY_VECTOR_H
@@ -0,0 +1,308 @@
+//
+// 按节点类型回收节点的内存池，供list、rb_tree、hashtable使用
+//
+
+#ifndef STL_MY_ALLOCATOR_NODE_POOL_H
+#define STL_MY_ALLOCATOR_NODE_POOL_H
+
+#include <mutex>
+#include <stdlib.h>
+#include <type_traits>
+#include "my_allocator.h"
+
+namespace my_std {
+    /*
+ * list::get_node、rb_tree::get_node、hashtable::new_node每次都调用一次simple_alloc<Node, Alloc>::allocate()，
+ * Alloc为malloc_alloc时就是一次malloc，频繁的插入、删除全部变成malloc/free
+ * __node_pool为每一种节点类型（Node, Alloc）维护一个内存池：一次向Alloc申请一整块连续的节点（块的大小翻倍增长），
+ * 销毁的节点挂到这种节点专属的free-list上，下次直接复用，插入、删除的来回不再需要调用分配器，
+ * 一起插入的节点在内存中也是相邻的
+ *
+ * 内存池按节点类型而不是按容器实例划分，所以list::splice()等在同类型容器之间移动节点不受影响
+ * 每个线程有自己的free-list，不需要加锁；线程退出时剩下的节点交给全局的free-list（shared_pool），由其他线程接手
+ * 与第二级分配器的thread cache相同，本线程free-list上的节点超过两批（一批就是最大块的节点个数）时，一次性把一批交给shared_pool，
+ * 本线程的free-list为空时先从shared_pool取回一批，所以生产者分配、消费者释放时节点会经过shared_pool回到生产者，
+ * 消费者的free-list不会无限增长，生产者也不需要一直申请新的块
+ *
+ * 申请的块记录在shared_pool中，trim()时本线程的free-list先交给shared_pool，然后统计shared_pool上每一块有多少个空闲节点，
+ * 全部空闲的块从free-list上摘下来还给Alloc；Alloc是第二级分配器时，再调用它的trim()就能把内存还给操作系统
+ * 与第二级分配器的trim()相同，统计工作全部放在trim()中，allocate()/deallocate()不需要维护每一块的计数
+ *
+ * 是否使用内存池由__recycle_nodes<Alloc>决定，默认只有第二级分配器（也就是my_vector.h中默认的node_alloc）使用，
+ * 其余的分配器都是容器的使用者特意选择的，节点仍然逐个交给它们：slab分配器要自己把存活的节点集中在少数几个slab上，
+ * arena要通过reset()整体回收（reset()之后free-list上的节点全部失效），malloc_alloc（__USE_MALLOC）就是要每个节点一次malloc
+ * 其他无状态的分配器需要回收节点时，特化__recycle_nodes为true_type；有状态的分配器不能使用内存池（块通过默认构造的Alloc申请）
+ *
+ * 记录模式（__STL_ALLOC_TRACE，见alloc_trace.h）下，使用内存池的节点容器只有申请块时才经过simple_alloc，
+ * 所以轨迹中记录的是整块的分配，节点的分配和回收不会被记录；需要记录每一个节点时，让容器使用不回收节点的分配器
+ */
+
+    const static size_t __NODE_POOL_MIN_NODES = 16;          // 第一块的节点个数
+    const static size_t __NODE_POOL_MAX_BYTES = 64 * 1024;   // 块翻倍增长的上限
+
+// 节点容器是否通过__node_pool回收节点，默认只有第二级分配器回收
+// 其他无状态的分配器需要回收节点时特化为true_type
+    template <class Alloc>
+    struct __recycle_nodes : std::false_type {};
+
+    template <bool threads, int inst>
+    struct __recycle_nodes<__default_alloc_template<threads, inst> > : std::true_type {};
+
+    template <class Alloc, size_t Align>
+    struct __recycle_nodes<__aligned_alloc<Alloc, Align> > : __recycle_nodes<Alloc> {};
+
+    template <class Node, class Alloc>
+    class __node_pool {
+    private:
+        // 节点大小的槽，空闲时保存下一个空闲槽的地址
+        union slot {
+            slot* next;
+            typename std::aligned_storage<sizeof(Node), alignof(Node)>::type storage;
+        };
+
+        typedef simple_alloc<slot, Alloc> block_allocator;
+
+        const static size_t MAX_BLOCK_NODES = __NODE_POOL_MAX_BYTES / sizeof(slot) > __NODE_POOL_MIN_NODES ?
+                                              __NODE_POOL_MAX_BYTES / sizeof(slot) : __NODE_POOL_MIN_NODES;
+
+        // 每个线程的free-list，没有析构函数，线程退出之后（包括静态对象析构时）仍然可以使用
+        struct local_cache {
+            slot* free_slots;
+            size_t free_count;      // free_slots上的节点个数
+            size_t block_nodes;     // 下一块的节点个数，0表示还没有申请过
+        };
+
+        // 记录一块向Alloc申请的节点
+        struct block_record {
+            slot* addr;
+            size_t nodes;
+        };
+
+        // 所有线程共享的free-list，存放各线程多出来的节点和已退出线程剩下的节点，以及所有块的记录
+        struct shared_pool {
+            std::mutex lock;
+            slot* free_slots;
+            block_record* blocks;   // 按起始地址从小到大排序
+            size_t block_count;
+            size_t block_capacity;
+
+            shared_pool() : free_slots(NULL), blocks(NULL), block_count(0), block_capacity(0) {}
+        };
+
+        // 线程退出时把本线程的free-list交给shared_pool
+        struct exit_guard {
+            ~exit_guard() { flush(cache()); }
+        };
+
+        static local_cache& cache() {
+            static thread_local local_cache c = {NULL, 0, 0};
+            return c;
+        }
+
+        static shared_pool& shared() {
+            static shared_pool s;
+            return s;
+        }
+
+        // 本线程第一次持有节点时注册exit_guard，只分配或者只回收节点的线程都会注册
+        static void register_exit() {
+            static thread_local exit_guard guard;
+            (void) guard;
+        }
+
+        // 把first到last这一串节点挂到shared_pool上
+        static void give_back(slot* first, slot* last) {
+            shared_pool& s = shared();
+            std::lock_guard<std::mutex> lock(s.lock);
+            last->next = s.free_slots;
+            s.free_slots = first;
+        }
+
+        // 本线程的free-list全部交给shared_pool
+        static void flush(local_cache& c) {
+            if (c.free_slots == NULL)
+                return;
+            slot* last = c.free_slots;
+            while (last->next != NULL)
+                last = last->next;
+            give_back(c.free_slots, last);
+            c.free_slots = NULL;
+            c.free_count = 0;
+        }
+
+        // 记录新申请的块，保持blocks数组有序，调用时需要持有s.lock
+        // blocks数组本身直接使用第一级分配器管理，不占用节点的内存
+        static void register_block(shared_pool& s, slot* addr, size_t nodes) {
+            if (s.block_count == s.block_capacity) {
+                size_t new_capacity = s.block_capacity == 0 ? 16 : 2 * s.block_capacity;
+                s.blocks = (block_record*) __malloc_alloc_template<0>::reallocate(s.blocks,
+                        s.block_capacity * sizeof(block_record), new_capacity * sizeof(block_record));
+                s.block_capacity = new_capacity;
+            }
+            size_t pos = s.block_count;
+            while (pos > 0 && s.blocks[pos-1].addr > addr) {
+                s.blocks[pos] = s.blocks[pos-1];
+                --pos;
+            }
+            s.blocks[pos].addr = addr;
+            s.blocks[pos].nodes = nodes;
+            ++s.block_count;
+        }
+
+        // 二分查找，找到最后一个起始地址不大于p的块，p必然落在这个块中
+        static size_t find_block(const shared_pool& s, slot* p) {
+            size_t lo = 0, hi = s.block_count;
+            while (hi - lo > 1) {
+                size_t mid = (lo + hi) / 2;
+                if (s.blocks[mid].addr <= p)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+            return lo;
+        }
+
+        // 本线程的free-list为空，先从shared_pool取回一批节点，没有的话再向Alloc申请一块
+        static void refill(local_cache& c) {
+            register_exit();
+            shared_pool& s = shared();
+            {
+                std::lock_guard<std::mutex> lock(s.lock);
+                if (s.free_slots != NULL) {
+                    slot* last = s.free_slots;
+                    size_t n = 1;
+                    for (; n < MAX_BLOCK_NODES && last->next != NULL; ++n)
+                        last = last->next;
+                    c.free_slots = s.free_slots;
+                    c.free_count = n;
+                    s.free_slots = last->next;
+                    last->next = NULL;
+                    return;
+                }
+            }
+            size_t n = c.block_nodes == 0 ? __NODE_POOL_MIN_NODES : c.block_nodes;
+            Alloc a;
+            slot* block = block_allocator::allocate(a, n);
+            {
+                std::lock_guard<std::mutex> lock(s.lock);
+                register_block(s, block, n);
+            }
+            c.block_nodes = n * 2 > MAX_BLOCK_NODES ? MAX_BLOCK_NODES : n * 2;
+            // 从后往前串起来，分配时按地址从低到高
+            for (size_t i = n; i-- > 0; ) {
+                block[i].next = c.free_slots;
+                c.free_slots = block + i;
+            }
+            c.free_count = n;
+        }
+
+        // 本线程的free-list超过两批，把最前面的一批交给shared_pool
+        static void spill(local_cache& c) {
+            slot* first = c.free_slots;
+            slot* last = first;
+            for (size_t i = 1; i < MAX_BLOCK_NODES; ++i)
+                last = last->next;
+            c.free_slots = last->next;
+            c.free_count -= MAX_BLOCK_NODES;
+            give_back(first, last);
+        }
+
+    public:
+        static Node* allocate() {
+            local_cache& c = cache();
+            if (c.free_slots == NULL)
+                refill(c);
+            slot* result = c.free_slots;
+            c.free_slots = result->next;
+            --c.free_count;
+            return (Node*) result;
+        }
+
+        static void deallocate(Node* p) {
+            local_cache& c = cache();
+            if (c.free_slots == NULL)
+                register_exit();
+            slot* s = (slot*) p;
+            s->next = c.free_slots;
+            c.free_slots = s;
+            if (++c.free_count > 2 * MAX_BLOCK_NODES)
+                spill(c);
+        }
+
+        // 把节点全部空闲的块还给Alloc，返回还回去的字节数
+        // 1. 本线程的free-list交给shared_pool，统计shared_pool上每一块空闲的节点个数
+        // 2. 空闲节点个数等于块的节点个数的块，从free-list上摘下来，还给Alloc
+        // 其他线程free-list上的节点不会被统计，这些节点所在的块要等节点回到shared_pool之后才能释放
+        static size_t trim() {
+            flush(cache());
+            shared_pool& s = shared();
+            std::lock_guard<std::mutex> lock(s.lock);
+            if (s.block_count == 0)
+                return 0;
+            size_t* free_nodes = (size_t*) calloc(s.block_count, sizeof(size_t));
+            // 连统计用的内存都申请不到，放弃这一次trim
+            if (free_nodes == NULL)
+                return 0;
+            for (slot* p = s.free_slots; p != NULL; p = p->next)
+                ++free_nodes[find_block(s, p)];
+
+            // 完全空闲的块标记为1，否则标记为0
+            size_t releasable = 0;
+            for (size_t b = 0; b < s.block_count; b++) {
+                free_nodes[b] = (free_nodes[b] == s.blocks[b].nodes);
+                releasable += free_nodes[b];
+            }
+            if (releasable == 0) {
+                free(free_nodes);
+                return 0;
+            }
+
+            // 重建free-list，跳过属于待释放块的节点，保持原来的顺序
+            slot* kept = NULL;
+            slot* tail = NULL;
+            for (slot* p = s.free_slots; p != NULL; p = p->next) {
+                if (free_nodes[find_block(s, p)])
+                    continue;
+                if (tail == NULL)
+                    kept = p;
+                else
+                    tail->next = p;
+                tail = p;
+            }
+            if (tail != NULL)
+                tail->next = NULL;
+            s.free_slots = kept;
+
+            // 释放块，并压缩blocks数组
+            size_t released = 0;
+            size_t kept_blocks = 0;
+            Alloc a;
+            for (size_t b = 0; b < s.block_count; b++) {
+                if (free_nodes[b]) {
+                    released += s.blocks[b].nodes * sizeof(slot);
+                    block_allocator::deallocate(a, s.blocks[b].addr, s.blocks[b].nodes);
+                }
+                else {
+                    s.blocks[kept_blocks++] = s.blocks[b];
+                }
+            }
+            s.block_count = kept_blocks;
+            free(free_nodes);
+            return released;
+        }
+    };
+
+// 节点容器使用的分配器，__recycle_nodes<Alloc>为true时通过__node_pool分配和回收节点
+// 否则与simple_alloc<Node, Alloc>相同，通过容器的分配器实例分配
+    template <class Node, class Alloc, bool = __recycle_nodes<Alloc>::value>
+    class __node_allocator : public simple_alloc<Node, Alloc> {};
+
+    template <class Node, class Alloc>
+    class __node_allocator<Node, Alloc, true> {
+    public:
+        static Node* allocate(Alloc&) { return __node_pool<Node, Alloc>::allocate(); }
+        static void deallocate(Alloc&, Node* p) { __node_pool<Node, Alloc>::deallocate(p); }
+    };
+}
+
+#endif //STL_MY_ALLOCATOR_NODE_POOL_H
@@ -6,11 +6,23 @@
 #define STL_MY_ALLOCATOR_SECOND_LEVEL_ALLOC_H
 
 #include <new>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "first_level_alloc.h"
+#include "alloc_trace.h"
 
 namespace my_std {
     /*
- * 第二级分配器，主要是负责管理小于128Bytes的内存块
+ * 第二级分配器，主要是负责管理小于32KB的内存块
  * 主要是由一个链表和一个内存池构成
  * 链表上主要是各种规格的内存块（8B，16B……），而内存池就是一大块
  * 一般的分配和释放，都只是在链表上进行操作。分配则将内存块（本来就已经申请好的）从链表上脱离下来
@@ -21,16 +33,283 @@ namespace my_std {
  * 所以可以理解为：链表上的内存块与用户的申请和释放内存打交道，而内存池上的内存块则是实打实地与操作系统打交道
  * 另一种说法：自由链表负责和用户打交道（块大小的调整，块的分配和回收），内存池负责和操作系统打交道（包括在内存不足时调用上一级空间配置器和使用OOM机制），这样就实现了职责分离
  * 链表只是一种对内存池里的内存块的管理方式
+ *
+ * 分级的内存块大小（size class）：
+ * 128Bytes以内按8Bytes递增（8，16，……，128），共16种
+ * 128Bytes以上参考jemalloc，每翻一倍分成4级，例如160，192，224，256，320，384，448，512，……，32KB，共32种
+ * 这样相邻两级之间最多浪费25%的空间，而rb_tree、hashtable中保存字符串、pair的中等大小节点也能走内存池，不需要每次都malloc
+ * 每一种大小都有自己的free-list，每次refill的内存块个数也根据块的大小决定（见REFILL_OBJS）
+ *
+ * 自适应的refill批量（见refill_sizer）：
+ * 每条free-list第一次refill时只申请REFILL_OBJS的1/4，之后短时间内又需要refill，说明这种大小的内存块很热门，批量翻倍，
+ * 直到REFILL_MAX_OBJS；很久没有refill的，每闲置一个周期批量减半。这样热门的free-list refill的次数少，冷门的也不会囤积太多内存块
+ * 多线程版本中每个thread cache有自己的refill_sizer，批量归还的个数也随之变化
+ * 可以通过set_adaptive_refill(false)关闭，关闭后每次都按REFILL_OBJS申请
+ *
+ * 多线程版本（threads == true）：
+ * 每个线程拥有自己的thread cache，里面同样是__NFREELISTS条free-list，分配和回收都只在本线程的free-list上进行，不需要加锁
+ * 原来的free_list数组和内存池则作为所有线程共享的中心内存池（central pool），由一把互斥锁保护
+ * thread cache为空时，一次性从中心内存池批量取一批内存块；thread cache中的内存块过多时（超过两批），一次性批量归还一批
+ * 每批的个数与refill的个数相同，这样加锁的次数被摊薄到每一批分配/回收才有一次，小内存块的分配可以随着核数线性扩展
+ *
+ * 内存池的收缩（trim）：
+ * chunk_alloc()每次从系统申请的一大块内存（chunk）都会记录在chunks数组中（按地址排序）
+ * trim()时遍历所有free-list，统计每个chunk上有多少字节是空闲的，如果一个chunk上的内存块全部空闲，
+ * 就把这些内存块从free-list上摘下来，然后把整个chunk还给操作系统
+ * 统计工作全部放在trim()中进行，allocate()/deallocate()不需要维护额外的计数，所以不会拖慢分配和回收
+ * 除了显式调用trim()，还可以通过set_trim_policy()设置自动trim：每回收interval次检查一次，heap_size超过threshold时自动trim
+ *
+ * 跨线程回收（多线程版本）：
+ * 多线程版本的chunk固定为__SEGMENT_BYTES大小，并且按__SEGMENT_BYTES对齐，chunk开头保存申请这个chunk的线程（owner）
+ * 所以任意一个内存块只要把地址的低位清零，就能找到它所在chunk的owner
+ * 如果回收内存块的线程不是owner（例如生产者分配、消费者释放），就把内存块压入owner的无锁归还栈（remote_free）
+ * 归还栈的栈顶是带标签（tag）的指针，每次修改标签加1，避免ABA问题
+ * owner在refill()时先一次性取走自己的归还栈，整个过程不需要全局锁
+ * 线程退出后，它的owner记录不会被释放，而是标记为abandoned，留给之后新建的线程接手
+ *
+ * 统计（编译时定义__STL_ALLOC_STATS）：
+ * 按内存块大小统计allocate/deallocate/refill/chunk_alloc的次数、正在使用和挂在free-list上的内存块个数，
+ * 以及heap_size的最大值、内存池残余内存被切给更小free-list的次数，通过stats()取得快照，to_json()导出
+ * 多线程版本中allocate/deallocate/refill的计数器放在每个线程的owner记录里，只有owner线程自己写，不需要原子加法
+ * 没有定义__STL_ALLOC_STATS时，这些计数的代码全部被预处理掉
+ *
+ * chunk的来源（chunk source）：
+ * 内存池向操作系统申请chunk的方式由第三个模板参数决定，默认的__malloc_chunk_source使用malloc
+ * __mmap_chunk_source使用匿名mmap，chunk按2MB对齐、大小是2MB的倍数，并通过madvise(MADV_HUGEPAGE)让内核使用透明大页，
+ * 节点很多的rb_tree、hashtable放在大页上可以大大减少TLB miss；populate为true时申请后立刻预先触发缺页，避免之后的缺页中断
+ * 多线程版本的chunk大小取__SEGMENT_BYTES和chunk source粒度中较大的一个
+ *
+ * 预热（prewarm）：
+ * 新启动的进程所有free-list都是空的，刚开始的每一次分配都要refill、chunk_alloc，甚至向系统申请chunk并触发缺页
+ * prewarm(profile)按profile给出的每一级内存块个数，一次性向系统申请一整块内存（region），预先切好挂到free-list上，
+ * 同一级的内存块在region中是连续的；prefault为true时还会预先触发region所有页的缺页
+ * profile可以从上一次运行的统计快照得到（__pool_profile::from_snapshot/from_json），这样新进程一启动就是"热"的
+ * reserve(bytes, count)只为一级内存块预留count个
+ * 多线程版本中region由若干个segment组成，每个segment的owner都是调用prewarm的线程，内存块挂在中心内存池上，各线程refill时取走
  */
 
+    // 自动trim的策略
+    struct __pool_trim_policy {
+        size_t threshold;   // heap_size超过threshold时才会自动trim，0表示关闭自动trim（默认）
+        size_t interval;    // 每隔多少次回收检查一次（多线程版本中为每隔多少次批量归还）
+    };
+
 // 匿名枚举，等价于静态常量const static int __ALIGN = 8;
     const static int __ALIGN = 8;     // 小型内存块的上调边界，也就是每一个内存块必须是__ALIGN的倍数
-    const static int __MAX_BYTES = 128;       // 小型内存块的上限，也就是内存块的最大尺寸
-    const static int __NFREELISTS = __MAX_BYTES / __ALIGN;        // free-lists的个数，也就是总共有多少种不同大小的内存块，每一种内存块都有一个链表free-list负责管理
+    const static int __SMALL_BYTES = 128;     // 按__ALIGN递增的内存块的上限
+    const static int __SMALL_LISTS = __SMALL_BYTES / __ALIGN;     // 按__ALIGN递增的内存块有多少种
+    const static int __CLASSES_PER_DOUBLING = 4;      // 大于__SMALL_BYTES之后，每翻一倍分成多少级
+    const static int __MAX_BYTES = 32768;     // 内存块的上限，也就是内存块的最大尺寸，更大的内存交给第一级分配器
+    // free-lists的个数，也就是总共有多少种不同大小的内存块，每一种内存块都有一个链表free-list负责管理
+    // 128到32768之间翻了8倍，每倍4级，所以总共16 + 8*4 = 48种
+    const static int __NFREELISTS = __SMALL_LISTS + 8 * __CLASSES_PER_DOUBLING;
+    const static int __REFILL_OBJS = 20;      // 每次refill最多申请的内存块个数
+    const static int __REFILL_BYTES = 65536;  // 大内存块每次refill最多申请的字节数，保证一次refill至少也有2块
+    // 自适应refill时批量最多增长到REFILL_OBJS的多少倍，以及一次refill最多申请的字节数（不超过半个chunk）
+    const static int __REFILL_GROWTH = 8;
+    const static int __REFILL_MAX_BYTES = 128 * 1024;
+    // 距离上一次refill超过多少次（所有free-list的）refill，就算闲置了一个周期
+    const static size_t __REFILL_WINDOW = 64;
+    // 多线程版本中chunk的大小和对齐，以及chunk头部保留的字节数（头部保存owner指针）
+    // 一次refill最多64KB，所以一个chunk至少够两次refill
+    const static size_t __SEGMENT_BYTES = 256 * 1024;
+    const static size_t __SEGMENT_HEADER = 64;
+    // 带标签指针中标签所在的位置：64位系统中用户态地址只用到低48位，高16位存放标签；32位系统则把指针放在64位整数的低32位
+    const static int __TAG_SHIFT = sizeof(void*) == 8 ? 48 : 32;
+    // 预热时按多少字节的步长写入region来触发缺页，不大于页的大小即可
+    const static size_t __PREFAULT_STRIDE = 4096;
+
+    // 返回x的最高位是第几位（x不能为0）
+    inline int __highest_bit(size_t x) {
+#if defined(__GNUC__)
+        return (int)(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(x);
+#else
+        int bit = 0;
+        while (x >>= 1)
+            ++bit;
+        return bit;
+#endif
+    }
+
+    // 内存块的大小属于第几级（size class），第二级分配器和slab分配器（slab_alloc.h）共用同一套分级
+    inline size_t __size_class_index(size_t bytes) {
+        if (bytes <= (size_t)__SMALL_BYTES)
+            return (((bytes) + __ALIGN-1) / __ALIGN - 1);   // 这个处理也是很巧妙，加7除以8再减1，可以得到内存块对应的链表的标号
+        // 大于128Bytes时，先由最高位确定在哪一倍（128~256为第0倍，256~512为第1倍……）
+        // 再取最高位之后的两位，确定是这一倍中的第几级
+        size_t x = bytes - 1;
+        int bit = __highest_bit(x);
+        return __SMALL_LISTS + (bit - 7) * __CLASSES_PER_DOUBLING + ((x >> (bit - 2)) & (__CLASSES_PER_DOUBLING - 1));
+    }
+
+    // 第index级内存块的大小，与__size_class_index互逆
+    inline size_t __size_class_bytes(size_t index) {
+        if (index < (size_t)__SMALL_LISTS)
+            return (index + 1) * __ALIGN;
+        size_t doubling = (index - __SMALL_LISTS) / __CLASSES_PER_DOUBLING;
+        size_t step = (index - __SMALL_LISTS) % __CLASSES_PER_DOUBLING + 1;
+        size_t base = (size_t)__SMALL_BYTES << doubling;
+        return base + step * (base / __CLASSES_PER_DOUBLING);
+    }
+
+    // chunk source的接口：
+    // granularity：chunk的大小会被上调为它的倍数
+    // allocate(bytes, alignment)：申请按alignment对齐的bytes字节，失败返回NULL（不抛出异常，由内存池决定如何处理）
+    // deallocate(p, bytes)：释放allocate()得到的内存
+
+    // 默认的chunk source，直接使用malloc
+    struct __malloc_chunk_source {
+        const static size_t granularity = __ALIGN;
+
+        static void* allocate(size_t bytes, size_t alignment) {
+            if (alignment <= (size_t)__ALIGN)
+                return malloc(bytes);
+            void* result;
+            return posix_memalign(&result, alignment, bytes) == 0 ? result : NULL;
+        }
+
+        static void deallocate(void* p, size_t) {
+            free(p);
+        }
+    };
+
+#if defined(__unix__) || defined(__APPLE__)
+    // 使用匿名mmap的chunk source，chunk按2MB对齐，这样内核才能用透明大页来映射它
+    // huge_pages为true时对chunk调用madvise(MADV_HUGEPAGE)；populate为true时预先触发缺页（相当于MAP_POPULATE）
+    template <bool huge_pages = true, bool populate = false>
+    struct __mmap_chunk_source {
+        const static size_t granularity = 2 * 1024 * 1024;
+
+        static void* allocate(size_t bytes, size_t alignment) {
+            if (alignment < granularity)
+                alignment = granularity;
+            bytes = (bytes + granularity - 1) & ~(granularity - 1);
+            // mmap只保证按页对齐，所以多映射alignment字节，再把头尾多出来的部分还回去
+            size_t mapped = bytes + alignment;
+            char* p = (char*) mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+            if (p == (char*) MAP_FAILED)
+                return NULL;
+            char* result = (char*)(((uintptr_t)p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+            if (result != p)
+                munmap(p, result - p);
+            if (result + bytes != p + mapped)
+                munmap(result + bytes, p + mapped - (result + bytes));
+#ifdef MADV_HUGEPAGE
+            if (huge_pages)
+                madvise(result, bytes, MADV_HUGEPAGE);
+#endif
+            // 不直接使用MAP_POPULATE：它在mmap时就触发缺页，那时还没有madvise(MADV_HUGEPAGE)，而且会把头尾多映射的部分也预先分配
+            if (populate) {
+#ifdef MADV_POPULATE_WRITE
+                if (madvise(result, bytes, MADV_POPULATE_WRITE) == 0)
+                    return result;
+#endif
+                size_t page = (size_t) sysconf(_SC_PAGESIZE);
+                for (size_t offset = 0; offset < bytes; offset += page)
+                    ((volatile char*)result)[offset] = 0;
+            }
+            return result;
+        }
+
+        static void deallocate(void* p, size_t bytes) {
+            munmap(p, (bytes + granularity - 1) & ~(granularity - 1));
+        }
+    };
+#endif
+
+    // 某一种大小的内存块的统计数据
+    struct __alloc_class_stats {
+        size_t block_size;
+        size_t allocate_calls;
+        size_t deallocate_calls;
+        size_t refill_calls;
+        size_t chunk_alloc_calls;   // 向内存池切取这种内存块的次数
+        size_t in_use;              // 已经分配给用户的内存块个数
+        size_t free_blocks;         // 挂在free-list上的内存块个数（包括thread cache和归还栈上的）
+    };
+
+    // 第二级分配器（以及它背后的第一级分配器）的统计快照
+    struct __alloc_stats_snapshot {
+        bool enabled;               // 编译时是否定义了__STL_ALLOC_STATS，为false时只有heap_size和chunk_count有效
+        size_t heap_size;
+        size_t heap_high_water;     // heap_size的最大值
+        size_t chunk_count;
+        size_t fragment_pushes;     // 内存池残余内存被切给更小free-list的次数
+        size_t fragment_bytes;      // 以这种方式挂到free-list上的字节数
+        size_t trimmed_bytes;       // trim()累计还给操作系统的字节数
+        __alloc_class_stats classes[__NFREELISTS];
+        __malloc_alloc_stats large; // 大于__MAX_BYTES、交给第一级分配器的部分
+
+        // 导出为JSON字符串
+        std::string to_json() const {
+            std::string json;
+            char buf[256];
+            snprintf(buf, sizeof(buf),
+                     "{\"enabled\":%s,\"heap_size\":%zu,\"heap_high_water\":%zu,\"chunk_count\":%zu,"
+                     "\"fragment_pushes\":%zu,\"fragment_bytes\":%zu,\"trimmed_bytes\":%zu,",
+                     enabled ? "true" : "false", heap_size, heap_high_water, chunk_count,
+                     fragment_pushes, fragment_bytes, trimmed_bytes);
+            json += buf;
+            snprintf(buf, sizeof(buf),
+                     "\"large\":{\"allocate\":%zu,\"deallocate\":%zu,\"reallocate\":%zu,\"oom\":%zu,"
+                     "\"bytes_in_use\":%zu,\"bytes_high_water\":%zu},\"classes\":[",
+                     large.allocate_calls, large.deallocate_calls, large.reallocate_calls, large.oom_calls,
+                     large.bytes_in_use, large.bytes_high_water);
+            json += buf;
+            for (int i = 0; i < __NFREELISTS; i++) {
+                const __alloc_class_stats& c = classes[i];
+                snprintf(buf, sizeof(buf),
+                         "%s{\"size\":%zu,\"allocate\":%zu,\"deallocate\":%zu,\"refill\":%zu,"
+                         "\"chunk_alloc\":%zu,\"in_use\":%zu,\"free\":%zu}",
+                         i == 0 ? "" : ",", c.block_size, c.allocate_calls, c.deallocate_calls, c.refill_calls,
+                         c.chunk_alloc_calls, c.in_use, c.free_blocks);
+                json += buf;
+            }
+            json += "]}";
+            return json;
+        }
+    };
+
+    // 预热用的profile：每一级内存块预先切出多少个，见__default_alloc_template::prewarm()
+    struct __pool_profile {
+        size_t counts[__NFREELISTS];
+
+        // 从统计快照得到：每一级取快照时从内存池切出的内存块个数（正在使用的 + 挂在free-list上的）
+        // 快照的enabled为false时没有这些数据，得到的profile全部为0
+        static __pool_profile from_snapshot(const __alloc_stats_snapshot& s) {
+            __pool_profile result = __pool_profile();
+            for (int i = 0; i < __NFREELISTS; i++)
+                result.counts[i] = s.classes[i].in_use + s.classes[i].free_blocks;
+            return result;
+        }
 
-// 第二级分配器，模板没有类型参数
-// 两个都是变量参数。第一参数用于多线程环境，第二参数没有派上用场
-    template <bool threads, int inst>
+        // 从__alloc_stats_snapshot::to_json()导出的字符串中读取，只用到classes中每一项的size、in_use和free
+        // 大小不是某一级内存块的项会被忽略，找不到classes时得到的profile全部为0
+        static __pool_profile from_json(const char* json) {
+            __pool_profile result = __pool_profile();
+            const char* p = strstr(json, "\"classes\":[");
+            if (p == NULL)
+                return result;
+            while ((p = strstr(p, "{\"size\":")) != NULL) {
+                char* end;
+                size_t size = (size_t) strtoull(p + 8, &end, 10);
+                const char* in_use = strstr(end, "\"in_use\":");
+                const char* free_blocks = in_use == NULL ? NULL : strstr(in_use, "\"free\":");
+                if (free_blocks == NULL)
+                    break;
+                if (size > 0 && size <= (size_t)__MAX_BYTES && __size_class_bytes(__size_class_index(size)) == size)
+                    result.counts[__size_class_index(size)] = (size_t) strtoull(in_use + 9, NULL, 10)
+                                                              + (size_t) strtoull(free_blocks + 7, NULL, 10);
+                p = free_blocks;
+            }
+            return result;
+        }
+    };
+
+// 第二级分配器
+// 前两个是变量参数。第一参数用于多线程环境（为true时启用thread cache），第二参数没有派上用场
+// 第三参数是内存池向操作系统申请chunk的方式，默认使用malloc
+    template <bool threads, int inst, class ChunkSource = __malloc_chunk_source>
     class __default_alloc_template {
 
     private:
@@ -52,14 +331,83 @@ namespace my_std {
             struct obj * free_list_link;
         };
 
-        // 因为有16种大小不同的内存块，所以有16个free-lists。1个free-lists保存一种大小的内存块
+        // 因为有__NFREELISTS种大小不同的内存块，所以有__NFREELISTS个free-lists。1个free-lists保存一种大小的内存块
         static obj * volatile free_list[__NFREELISTS];
 
+        // 多线程版本中chunk的大小和对齐，不小于chunk source的粒度，例如使用2MB大页时每个chunk就是2MB
+        const static size_t SEGMENT_BYTES = ChunkSource::granularity > __SEGMENT_BYTES ?
+                                            ChunkSource::granularity : __SEGMENT_BYTES;
+
         // 根据内存块的大小，选择使用第n号free-list。也就是根据内存块的大小决定哪一条链表
-        static size_t FREELIST_INDEX(size_t bytes) {
-            return (((bytes) + __ALIGN-1) / __ALIGN - 1);   // 这个处理也是很巧妙，加7除以8再减1，可以得到内存块对应的链表的标号
+        static size_t FREELIST_INDEX(size_t bytes) { return __size_class_index(bytes); }
+
+        // 第index号free-list上内存块的大小，与FREELIST_INDEX互逆
+        static size_t CLASS_SIZE(size_t index) { return __size_class_bytes(index); }
+
+        // 第index号free-list每次refill申请多少个内存块
+        // 小内存块一次20个，大内存块一次最多__REFILL_BYTES字节，但至少2个
+        static int REFILL_OBJS(size_t index) {
+            size_t n_objs = __REFILL_BYTES / CLASS_SIZE(index);
+            if (n_objs > (size_t)__REFILL_OBJS)
+                return __REFILL_OBJS;
+            return n_objs < 2 ? 2 : (int)n_objs;
+        }
+
+        // 自适应refill时批量的下限和上限
+        static int REFILL_MIN_OBJS(size_t index) {
+            int n_objs = REFILL_OBJS(index) / 4;
+            return n_objs < 1 ? 1 : n_objs;
+        }
+
+        static int REFILL_MAX_OBJS(size_t index) {
+            size_t n_objs = __REFILL_MAX_BYTES / CLASS_SIZE(index);
+            if (n_objs > (size_t)(__REFILL_OBJS * __REFILL_GROWTH))
+                n_objs = __REFILL_OBJS * __REFILL_GROWTH;
+            return n_objs < (size_t)REFILL_OBJS(index) ? REFILL_OBJS(index) : (int)n_objs;
         }
 
+        // 记录每条free-list最近refill的情况，决定下一次refill申请多少个内存块
+        // "时间"用refill的总次数epoch来衡量，所以只在refill时才需要更新，不影响allocate()/deallocate()
+        struct refill_sizer {
+            int batch[__NFREELISTS];            // 当前的批量，0表示还没有refill过
+            size_t last_refill[__NFREELISTS];   // 上一次refill时的epoch
+            size_t epoch;
+
+            // 第index号free-list要refill了，返回这一次的批量
+            int next_batch(size_t index) {
+                if (!adaptive_refill)
+                    return REFILL_OBJS(index);
+                size_t idle = ++epoch - last_refill[index];
+                last_refill[index] = epoch;
+                int n_objs = batch[index];
+                if (n_objs == 0) {
+                    n_objs = REFILL_MIN_OBJS(index);
+                }
+                else if (idle <= __REFILL_WINDOW) {
+                    n_objs *= 2;
+                    if (n_objs > REFILL_MAX_OBJS(index))
+                        n_objs = REFILL_MAX_OBJS(index);
+                }
+                else {
+                    size_t periods = idle / __REFILL_WINDOW;
+                    n_objs = periods >= 31 ? 0 : n_objs >> periods;
+                    if (n_objs < REFILL_MIN_OBJS(index))
+                        n_objs = REFILL_MIN_OBJS(index);
+                }
+                batch[index] = n_objs;
+                return n_objs;
+            }
+
+            // 当前的批量，用于决定thread cache什么时候归还、归还多少
+            int current(size_t index) const {
+                if (!adaptive_refill || batch[index] == 0)
+                    return REFILL_OBJS(index);
+                return batch[index];
+            }
+        };
+        static refill_sizer sizer;          // 单线程版本使用，多线程版本每个thread cache有自己的
+        static bool adaptive_refill;
+
         // 返回一个大小为n的内存块，并且有可能将大小为n的其他内存块加入到free-list中
         static void *refill(size_t n);
 
@@ -73,18 +421,220 @@ namespace my_std {
         static char *end_free;      // 内存池结束地址。只在chunk_alloc()中进行变化
         static size_t heap_size;    // 堆的大小
 
+        // 记录一个从系统申请来的chunk
+        struct chunk_record {
+            char* addr;
+            size_t size;
+            bool from_malloc_alloc;     // 内存不足时由第一级分配器提供，释放时要还给第一级分配器而不是ChunkSource::deallocate()
+        };
+        static chunk_record* chunks;        // 所有chunk，按起始地址从小到大排序
+        static size_t chunk_count;
+        static size_t chunk_capacity;
+
+        // 自动trim的策略，以及距离下一次检查还剩多少次回收
+        static __pool_trim_policy trim_policy;
+        static size_t trim_countdown;
+
+        // 记录一个新的chunk，保持chunks数组有序
+        static void register_chunk(char* addr, size_t size, bool from_malloc_alloc);
+
+        // 找到地址p所在的chunk的下标（二分查找）
+        static size_t find_chunk(char* p);
+
+        // 释放所有完全空闲的chunk，返回释放的字节数。调用时必须已经持有pool_lock（多线程版本）
+        static size_t release_free_chunks();
+
+        // 回收次数达到interval时检查是否需要自动trim
+        static void check_trim() {
+            trim_countdown = trim_policy.interval;
+            if (trim_policy.threshold != 0 && heap_size > trim_policy.threshold)
+                release_free_chunks();
+        }
+
+        // 把chunk开始的n_objs个大小为n的内存块串成一条以NULL结尾的链表，返回链表头
+        static obj* link_chunk(char* chunk, size_t n, int n_objs);
+
+        // 把[p, p + bytes)切成尽可能大的内存块，挂到对应的free-list上，bytes必须是__ALIGN的倍数
+        static void push_fragments(char* p, size_t bytes);
+
+#ifdef __STL_ALLOC_STATS
+        // allocate/deallocate/refill的计数器。单线程版本只有一份，多线程版本每个owner一份
+        // 每份只有一个线程写，所以用relaxed的load+store代替原子加法，编译出来就是普通的加法
+        struct class_counters {
+            std::atomic<size_t> allocate_calls[__NFREELISTS];
+            std::atomic<size_t> deallocate_calls[__NFREELISTS];
+            std::atomic<size_t> refill_calls[__NFREELISTS];
+        };
+        static class_counters counters;
+
+        static void BUMP(std::atomic<size_t>& c) {
+            c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        // 以下计数器只在chunk_alloc()和trim()中修改，多线程版本中此时已经持有pool_lock
+        static size_t chunk_alloc_calls[__NFREELISTS];
+        static size_t carved_blocks[__NFREELISTS];      // 从内存池切出、仍属于free-list或者用户的内存块个数
+        static size_t heap_high_water;
+        static size_t fragment_pushes;
+        static size_t fragment_bytes;
+        static size_t trimmed_bytes;
+#endif
+
+        // ---------------------------------------------------------------------------
+        // 以下只在多线程版本中使用
+        // 中心内存池（free_list、start_free、end_free、heap_size）以及owner链表的互斥锁
+        static std::mutex pool_lock;
+
+        // chunk的所有者。每种大小的内存块各有一个无锁归还栈，其他线程回收属于这个owner的内存块时压入对应的栈
+        // 栈顶是带标签的指针（见TAGGED_PTR），owner记录一旦创建就不会释放
+        struct thread_owner {
+            std::atomic<unsigned long long> remote_free[__NFREELISTS];
+            bool abandoned;             // 对应的线程已经退出
+            thread_owner* next;         // 所有owner串成一条链表
+#ifdef __STL_ALLOC_STATS
+            class_counters counters;    // 这个owner对应线程的计数器，线程退出后由接手的线程继续累加
+#endif
+        };
+        static thread_owner* owners;
+
+        // chunk头部，保存在每个chunk的起始位置
+        struct segment_header {
+            thread_owner* owner;
+        };
+
+        // 带标签指针的编码与解码，每次修改栈顶时标签加1
+        static obj* TAGGED_PTR(unsigned long long v) {
+            return (obj*)(uintptr_t)(v & ((1ULL << __TAG_SHIFT) - 1));
+        }
+        static unsigned long long MAKE_TAGGED(obj* p, unsigned long long old_v) {
+            return (unsigned long long)(uintptr_t)p | (((old_v >> __TAG_SHIFT) + 1) << __TAG_SHIFT);
+        }
+
+        // 根据内存块的地址找到它所在chunk的owner
+        static thread_owner* SEGMENT_OWNER(void* p) {
+            return ((segment_header*)((uintptr_t)p & ~(uintptr_t)(SEGMENT_BYTES - 1)))->owner;
+        }
+
+        // 将内存块q压入owner第index号归还栈，可以被任意线程并发调用
+        static void push_remote(thread_owner* owner, size_t index, obj* q) {
+            std::atomic<unsigned long long>& head = owner->remote_free[index];
+            unsigned long long old_head = head.load(std::memory_order_relaxed);
+            do {
+                q->free_list_link = TAGGED_PTR(old_head);
+            } while (!head.compare_exchange_weak(old_head, MAKE_TAGGED(q, old_head),
+                                                 std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        // 一次性取走owner第index号归还栈上的所有内存块，返回链表头
+        static obj* take_remote(thread_owner* owner, size_t index) {
+            std::atomic<unsigned long long>& head = owner->remote_free[index];
+            unsigned long long old_head = head.load(std::memory_order_relaxed);
+            while (TAGGED_PTR(old_head) != NULL
+                   && !head.compare_exchange_weak(old_head, MAKE_TAGGED(NULL, old_head),
+                                                  std::memory_order_acquire, std::memory_order_relaxed)) {}
+            return TAGGED_PTR(old_head);
+        }
+
+        // 新线程获取owner记录：优先接手已经退出的线程留下的记录，没有才新建
+        static thread_owner* acquire_owner();
+
+        // 线程退出时放弃owner记录：把归还栈上的内存块交给中心内存池，并标记为abandoned
+        static void abandon_owner(thread_owner* owner);
+
+        // 取走所有owner（包括已经退出的）归还栈上的内存块，放到中心内存池中。调用时必须已经持有pool_lock
+        static void drain_remote_frees();
+
+        // 汇总统计数据。调用时必须已经持有pool_lock（多线程版本）
+        static __alloc_stats_snapshot collect_stats();
+
+        // 每个线程私有的缓存，结构与中心内存池的free-lists相同，另外记录每条链表上的内存块个数
+        // 线程退出时，析构函数会把缓存中所有的内存块归还给中心内存池
+        struct thread_cache {
+            obj* free_list[__NFREELISTS];
+            size_t count[__NFREELISTS];
+            thread_owner* owner;
+            refill_sizer sizer;
+
+            thread_cache() {
+                for (int i = 0; i < __NFREELISTS; i++) {
+                    free_list[i] = NULL;
+                    count[i] = 0;
+                    sizer.batch[i] = 0;
+                    sizer.last_refill[i] = 0;
+                }
+                sizer.epoch = 0;
+                owner = acquire_owner();
+            }
+
+            ~thread_cache() {
+                for (int i = 0; i < __NFREELISTS; i++) {
+                    if (free_list[i] != NULL)
+                        flush(*this, i, count[i]);
+                }
+                abandon_owner(owner);
+            }
+        };
+
+        // 获取当前线程的thread cache，第一次调用时构造
+        static thread_cache& local_cache() {
+            static thread_local thread_cache cache;
+            return cache;
+        }
+
+        // thread cache为空时，从中心内存池批量取一批大小为n的内存块，返回其中一块，其余放入thread cache
+        static void* cache_refill(thread_cache& cache, size_t n);
+
+        // 将thread cache第index条链表上的前n_objs个内存块批量归还给中心内存池
+        static void flush(thread_cache& cache, size_t index, size_t n_objs);
+
+        // 预热时按profile在region中切分内存块并挂到free-list上，返回用掉的字节数
+        // region为NULL时只计算需要多少字节，不做任何修改
+        static size_t carve_region(char* region, const __pool_profile& profile, thread_owner* owner);
+
     public:
         // 分配内存空间
+        // 记录模式下（__STL_ALLOC_TRACE）每一次分配和回收都会被记录，见alloc_trace.h
         static void* allocate(size_t n) {
+            __ALLOC_TRACE(__alloc_trace_scope trace(__TRACE_ALLOCATE, n));
+            void* result = pool_allocate(n);
+            __ALLOC_TRACE(trace.record(result));
+            return result;
+        }
+
+        // 回收内存空间
+        static void deallocate(void *p, size_t n) {
+            __ALLOC_TRACE(__alloc_trace_scope trace(__TRACE_DEALLOCATE, n));
+            __ALLOC_TRACE(trace.record(p));
+            pool_deallocate(p, n);
+        }
+
+    private:
+        static void* pool_allocate(size_t n) {
             obj *result;
             // 保存所需要的内存块的链表的起始指针
             obj * volatile * my_free_list;
 
-            // 如果所需要申请的内存空间大小大于128Bytes，调用第一级分配器
+            // 如果所需要申请的内存空间大小大于__MAX_BYTES，调用第一级分配器
             if (n > (size_t) __MAX_BYTES) {
                 return __malloc_alloc_template<inst>::allocate(n);
             }
 
+            // 多线程版本，只在本线程的thread cache上操作，不需要加锁
+            if (threads) {
+                thread_cache& cache = local_cache();
+                size_t index = FREELIST_INDEX(n);
+                __ALLOC_STAT(BUMP(cache.owner->counters.allocate_calls[index]));
+                result = cache.free_list[index];
+                if (result != NULL) {
+                    cache.free_list[index] = result->free_list_link;
+                    --cache.count[index];
+                    return (void*)result;
+                }
+                // thread cache为空，向中心内存池批量索取
+                return cache_refill(cache, CLASS_SIZE(index));
+            }
+
+            __ALLOC_STAT(BUMP(counters.allocate_calls[FREELIST_INDEX(n)]));
             // 获取这个大小的内存块对应的链表头
             my_free_list = free_list + FREELIST_INDEX(n);
             // 将result指向第一个链表的第一个内存块
@@ -99,27 +649,113 @@ namespace my_std {
                 return (void*)result;
             }
             // 如果指针为空，说明链表中没有空闲的内存块，则需要使用refill()向内存池中索取内存块，重新填充freelist
-            void *r = refill(ROUND_UP(n));
+            // 申请的大小要上调到这条free-list对应的内存块大小
+            void *r = refill(CLASS_SIZE(FREELIST_INDEX(n)));
             return r;
         }
 
-        // 回收内存空间
-        static void deallocate(void *p, size_t n) {
+        static void pool_deallocate(void *p, size_t n) {
             obj *q = (obj*)p;
             // 指针的指针，通过他指向保存在数组中的free-list的头节点
             obj* volatile * my_free_list;
 
-            // 如果大于128，就调用第一级内存分配器
+            // 如果大于__MAX_BYTES，就调用第一级内存分配器
             if (n > (size_t)__MAX_BYTES) {
                 __malloc_alloc_template<inst>::deallocate(p, n);
                 return;
             }
 
+            // 多线程版本，如果内存块属于其他线程，压入那个线程的归还栈，不需要加锁
+            // 否则放回本线程的thread cache
+            // 如果thread cache中这种大小的内存块太多了（超过两批），则归还一批给中心内存池，避免一个线程囤积大量内存
+            if (threads) {
+                thread_cache& cache = local_cache();
+                size_t index = FREELIST_INDEX(n);
+                __ALLOC_STAT(BUMP(cache.owner->counters.deallocate_calls[index]));
+                thread_owner* owner = SEGMENT_OWNER(p);
+                if (owner != cache.owner) {
+                    push_remote(owner, index, q);
+                    return;
+                }
+                q->free_list_link = cache.free_list[index];
+                cache.free_list[index] = q;
+                size_t batch = cache.sizer.current(index);
+                if (++cache.count[index] > 2 * batch)
+                    flush(cache, index, batch);
+                return;
+            }
+
+            __ALLOC_STAT(BUMP(counters.deallocate_calls[FREELIST_INDEX(n)]));
             // 获取指向free-list链表头的指针
             my_free_list = free_list + FREELIST_INDEX(n);
             // 调整free-list
             q->free_list_link = *my_free_list;
             *my_free_list = q;
+
+            // 只有一次递减和判断，到达检查间隔时才去看是否需要自动trim
+            if (--trim_countdown == 0)
+                check_trim();
+        }
+
+    public:
+        // 将完全空闲的chunk还给操作系统，返回释放的字节数
+        // 多线程版本中，调用线程会先把自己的thread cache全部归还给中心内存池，其他线程thread cache中的内存块不会被统计为空闲
+        static size_t trim() {
+            if (threads) {
+                thread_cache& cache = local_cache();
+                for (int i = 0; i < __NFREELISTS; i++) {
+                    if (cache.free_list[i] != NULL)
+                        flush(cache, i, cache.count[i]);
+                }
+                std::lock_guard<std::mutex> guard(pool_lock);
+                drain_remote_frees();
+                return release_free_chunks();
+            }
+            return release_free_chunks();
+        }
+
+        // 设置自动trim的策略。threshold为0表示关闭自动trim
+        static void set_trim_policy(size_t threshold, size_t interval) {
+            if (threads) {
+                std::lock_guard<std::mutex> guard(pool_lock);
+                trim_policy.threshold = threshold;
+                trim_policy.interval = interval == 0 ? 1 : interval;
+                trim_countdown = trim_policy.interval;
+                return;
+            }
+            trim_policy.threshold = threshold;
+            trim_policy.interval = interval == 0 ? 1 : interval;
+            trim_countdown = trim_policy.interval;
+        }
+
+        // 当前从系统申请的内存总量
+        static size_t pool_heap_size() { return heap_size; }
+
+        // 预热：按profile为每一级内存块预先切出counts[i]个，挂到free-list上（多线程版本挂到中心内存池上）
+        // 所有内存块来自一次申请的一整块内存，prefault为true时预先触发其中所有页的缺页
+        // 返回从系统申请的字节数，申请失败时返回0，之后的分配照常按需申请。例如启动时使用上一次运行保存的统计快照：
+        //   pool::prewarm(__pool_profile::from_json(saved_json.c_str()), true);
+        static size_t prewarm(const __pool_profile& profile, bool prefault = false);
+
+        // 为大小为bytes的那一级内存块预先切出count个，相当于只有这一级的profile
+        static size_t reserve(size_t bytes, size_t count, bool prefault = false) {
+            if (bytes == 0 || bytes > (size_t)__MAX_BYTES)
+                return 0;
+            __pool_profile profile = __pool_profile();
+            profile.counts[FREELIST_INDEX(bytes)] = count;
+            return prewarm(profile, prefault);
+        }
+
+        // 打开或关闭自适应的refill批量（默认打开），应当在第一次分配之前设置
+        static void set_adaptive_refill(bool enable) { adaptive_refill = enable; }
+
+        // 返回统计数据的快照
+        static __alloc_stats_snapshot stats() {
+            if (threads) {
+                std::lock_guard<std::mutex> guard(pool_lock);
+                return collect_stats();
+            }
+            return collect_stats();
         }
 
         // 重新分配内存
@@ -127,27 +763,83 @@ namespace my_std {
     };
 
 // 对分配器的相关成员进行初始化
-    template <bool threads, int inst>
-    char *__default_alloc_template<threads, inst>::start_free = 0;
+    template <bool threads, int inst, class ChunkSource>
+    char *__default_alloc_template<threads, inst, ChunkSource>::start_free = 0;
+
+    template <bool threads, int inst, class ChunkSource>
+    char *__default_alloc_template<threads, inst, ChunkSource>::end_free = 0;
+
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::heap_size = 0;
+
+    template <bool threads, int inst, class ChunkSource>
+    std::mutex __default_alloc_template<threads, inst, ChunkSource>::pool_lock;
+
+    template <bool threads, int inst, class ChunkSource>
+    typename __default_alloc_template<threads, inst, ChunkSource>::thread_owner*
+            __default_alloc_template<threads, inst, ChunkSource>::owners = 0;
+
+#ifdef __STL_ALLOC_STATS
+    template <bool threads, int inst, class ChunkSource>
+    typename __default_alloc_template<threads, inst, ChunkSource>::class_counters
+            __default_alloc_template<threads, inst, ChunkSource>::counters;
+
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::chunk_alloc_calls[__NFREELISTS] = {0};
+
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::carved_blocks[__NFREELISTS] = {0};
+
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::heap_high_water = 0;
+
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::fragment_pushes = 0;
+
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::fragment_bytes = 0;
+
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::trimmed_bytes = 0;
+#endif
+
+    template <bool threads, int inst, class ChunkSource>
+    typename __default_alloc_template<threads, inst, ChunkSource>::chunk_record*
+            __default_alloc_template<threads, inst, ChunkSource>::chunks = 0;
 
-    template <bool threads, int inst>
-    char *__default_alloc_template<threads, inst>::end_free = 0;
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::chunk_count = 0;
 
-    template <bool threads, int inst>
-    size_t __default_alloc_template<threads, inst>::heap_size = 0;
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::chunk_capacity = 0;
 
-// 16种大小的内存块，所以有16个free-list。free-list[i]表示第i条链表的起始指针
-    template <bool threads, int inst>
-    typename __default_alloc_template<threads, inst>::obj * volatile
-            __default_alloc_template<threads, inst>::free_list[__NFREELISTS] =
-            {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+// 默认关闭自动trim，每4096次回收检查一次
+    template <bool threads, int inst, class ChunkSource>
+    __pool_trim_policy __default_alloc_template<threads, inst, ChunkSource>::trim_policy = {0, 4096};
+
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::trim_countdown = 4096;
+
+    template <bool threads, int inst, class ChunkSource>
+    typename __default_alloc_template<threads, inst, ChunkSource>::refill_sizer
+            __default_alloc_template<threads, inst, ChunkSource>::sizer = {{0}, {0}, 0};
+
+    template <bool threads, int inst, class ChunkSource>
+    bool __default_alloc_template<threads, inst, ChunkSource>::adaptive_refill = true;
+
+// __NFREELISTS种大小的内存块，所以有__NFREELISTS个free-list。free-list[i]表示第i条链表的起始指针
+// 只写出第一个0，其余的元素同样会被初始化为0
+    template <bool threads, int inst, class ChunkSource>
+    typename __default_alloc_template<threads, inst, ChunkSource>::obj * volatile
+            __default_alloc_template<threads, inst, ChunkSource>::free_list[__NFREELISTS] = {0};
 
 // 向内存池中索取内存块
 // 返回一个大小为n的内存块，同时有可能会给free-list上添加数个大小为n的内存块
-    template <bool threads, int inst>
-    void* __default_alloc_template<threads, inst>::refill(size_t n) {
-        // 默认向内存池申请20个大小为n的内存块
-        int n_objs = 20;
+    template <bool threads, int inst, class ChunkSource>
+    void* __default_alloc_template<threads, inst, ChunkSource>::refill(size_t n) {
+        // 向内存池申请一批大小为n的内存块，个数由sizer根据这种内存块最近的需求决定
+        int n_objs = sizer.next_batch(FREELIST_INDEX(n));
+        __ALLOC_STAT(BUMP(counters.refill_calls[FREELIST_INDEX(n)]));
         // chunk为向内存池申请的内存块的地址
         // n_objs为引用，所以函数返回后，n_objs为实际返回的内存块数量
         char* chunk = chunk_alloc(n, n_objs);
@@ -155,7 +847,6 @@ namespace my_std {
         // 指向free-list的头节点
         obj* volatile* my_free_list;
         obj* result;
-        obj* cur_obj, *next_obj;
 
         // 如果返回的内存块数量为1，说明内存池中没有多余的块可以返回了，则直接将这个返回的内存块给用户
         if (n_objs == 1) {
@@ -166,22 +857,26 @@ namespace my_std {
         my_free_list = free_list + FREELIST_INDEX(n);
 
         // 如果返回的内存块数量大于1，说明内存池中有多余的块，这些多余的内存块可以添加到free-list中
-        // 将第一块内存块作为result返回
+        // 将第一块内存块作为result返回，然后将剩下的内存块串成链表添加到free-list中
         result = (obj*) chunk;
+        *my_free_list = link_chunk(chunk + n, n, n_objs - 1);
+        return (void*)result;
+
+    }
 
-        // 然后将剩下的内存块添加到free-list中
-        // 实际上一个块的大小为n Bytes，而obj的大小为4 Bytes（32位系统的地址有32位，也就是4 Bytes）
-        // 这是一个很巧妙的设计。需要链接到链表时，从内存块上抠出前4 Bytes作为连接指针和连接对象
-        // 不需要时，则整一个块返回给用户使用，前4 Bytes同样是普通的内存空间
-        // 所以实际上是在一个块上划分了前4 Bytes作为obj对象，或者说将前4 Bytes解释为obj对象
-        // 但是实际上需要定位到下一个块的起始地址，还是需要将指针转换成char*（移动一次代表向后移动一个Bytes单位）
-        // 然后移动n次，相当于移动n个Bytes
-        // chunk原来就是char*，所以可以直接+n，定位到下一个块的起始地址
-        // obj中的指针指向的是下一个块的起始地址，也就是指向下一个块中前4 Bytes组成的obj对象的起始地址
-        // 也就是在内存池返回的这一大块内存中，除去第一块需要返回给用户，剩下的一大块需要组织成链表free-list
-        *my_free_list = (obj*)(chunk + n);
-        next_obj = (obj*)(chunk + n);
-        for (int i = 1; i < n_objs; i++) {
+// 将chunk开始的n_objs个大小为n的内存块串成链表
+// 实际上一个块的大小为n Bytes，而obj的大小为4 Bytes（32位系统的地址有32位，也就是4 Bytes）
+// 这是一个很巧妙的设计。需要链接到链表时，从内存块上抠出前4 Bytes作为连接指针和连接对象
+// 不需要时，则整一个块返回给用户使用，前4 Bytes同样是普通的内存空间
+// 所以实际上是在一个块上划分了前4 Bytes作为obj对象，或者说将前4 Bytes解释为obj对象
+// 但是实际上需要定位到下一个块的起始地址，还是需要将指针转换成char*（移动一次代表向后移动一个Bytes单位）
+// 然后移动n次，相当于移动n个Bytes
+    template <bool threads, int inst, class ChunkSource>
+    typename __default_alloc_template<threads, inst, ChunkSource>::obj*
+    __default_alloc_template<threads, inst, ChunkSource>::link_chunk(char *chunk, size_t n, int n_objs) {
+        obj* cur_obj, *next_obj;
+        next_obj = (obj*)chunk;
+        for (int i = 0; i < n_objs; i++) {
             cur_obj = next_obj;
             next_obj = (obj*)((char*)cur_obj + n);
             // 此时cur_obj指向最后一块
@@ -193,15 +888,396 @@ namespace my_std {
                 cur_obj->free_list_link = next_obj;
             }
         }
-        return (void*)result;
+        return (obj*)chunk;
+    }
+
+// 将一段剩余的内存切成内存块挂到free-list上
+// 128Bytes以上的内存块大小不再是连续的，所以每次切下不超过剩余大小的最大一级内存块，直到切完
+// 最后不足128Bytes的部分必然刚好是某一级内存块的大小
+    template <bool threads, int inst, class ChunkSource>
+    void __default_alloc_template<threads, inst, ChunkSource>::push_fragments(char *p, size_t bytes) {
+        while (bytes > 0) {
+            size_t index = bytes > (size_t)__MAX_BYTES ? __NFREELISTS - 1 : FREELIST_INDEX(bytes);
+            if (CLASS_SIZE(index) > bytes)
+                --index;
+            obj* volatile * my_free_list = free_list + index;
+            // 将其插入对应的free-list中
+            ((obj*) p)->free_list_link = *my_free_list;
+            *my_free_list = (obj*) p;
+            __ALLOC_STAT(++carved_blocks[index]);
+            p += CLASS_SIZE(index);
+            bytes -= CLASS_SIZE(index);
+        }
+    }
+
+// 预热时在region中切分内存块：从最大的一级开始，同一级的内存块连续排列，挂到free-list的最前面
+// 多线程版本中region由若干个SEGMENT_BYTES大小的segment组成，每个segment开头是segment_header，内存块不能跨越segment，
+// segment末尾放不下当前这一级内存块的部分切给更小的free-list
+// region为NULL时按同样的方式只计算位置，所以两次调用得到的字节数相同
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::carve_region(char *region, const __pool_profile& profile,
+                                                                             thread_owner* owner) {
+        size_t offset = 0;          // 下一个内存块在region中的位置
+        size_t segment_end = 0;     // 当前segment的末尾（多线程版本）
+        for (int i = __NFREELISTS - 1; i >= 0; i--) {
+            size_t size = CLASS_SIZE(i);
+            size_t left = profile.counts[i];
+            while (left > 0) {
+                size_t n_objs = left;
+                if (threads) {
+                    // 当前segment放不下一块，开始下一个segment
+                    if (offset + size > segment_end) {
+                        if (region != NULL) {
+                            if (segment_end > offset)
+                                push_fragments(region + offset, segment_end - offset);
+                            ((segment_header*)(region + segment_end))->owner = owner;
+                        }
+                        offset = segment_end + __SEGMENT_HEADER;
+                        segment_end += SEGMENT_BYTES;
+                    }
+                    if ((segment_end - offset) / size < n_objs)
+                        n_objs = (segment_end - offset) / size;
+                }
+                if (region != NULL) {
+                    obj* tail = (obj*)(region + offset + (n_objs - 1) * size);
+                    obj* head = link_chunk(region + offset, size, (int)n_objs);
+                    tail->free_list_link = free_list[i];
+                    free_list[i] = head;
+                    __ALLOC_STAT(carved_blocks[i] += n_objs);
+                }
+                offset += n_objs * size;
+                left -= n_objs;
+            }
+        }
+        if (threads) {
+            if (region != NULL && segment_end > offset)
+                push_fragments(region + offset, segment_end - offset);
+            return segment_end;
+        }
+        return offset;
+    }
+
+// 预热：先计算需要的字节数，一次向chunk source申请，记录为一个chunk，再切分挂到free-list上
+// 单线程版本中按粒度上调多出来的部分也切给free-list
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::prewarm(const __pool_profile& profile, bool prefault) {
+        // 第一次调用local_cache()时会加锁获取owner记录，所以要在加锁之前取得
+        thread_owner* owner = threads ? local_cache().owner : NULL;
+        size_t bytes = carve_region(NULL, profile, owner);
+        if (bytes == 0)
+            return 0;
+        bytes = (bytes + ChunkSource::granularity - 1) & ~(ChunkSource::granularity - 1);
+
+        std::unique_lock<std::mutex> guard(pool_lock, std::defer_lock);
+        if (threads)
+            guard.lock();
+        // 多线程版本按SEGMENT_BYTES对齐，这样每个segment都能通过地址找到头部的owner
+        char* region = (char*) ChunkSource::allocate(bytes, threads ? SEGMENT_BYTES : __ALIGN);
+        if (region == NULL)
+            return 0;
+        if (prefault) {
+            for (size_t offset = 0; offset < bytes; offset += __PREFAULT_STRIDE)
+                ((volatile char*)region)[offset] = 0;
+        }
+        register_chunk(region, bytes, false);
+        heap_size += bytes;
+        __ALLOC_STAT(heap_high_water = heap_size > heap_high_water ? heap_size : heap_high_water);
+        size_t used = carve_region(region, profile, owner);
+        if (used < bytes)
+            push_fragments(region + used, bytes - used);
+        return bytes;
+    }
+
+// 多线程版本：thread cache为空时，加锁从中心内存池批量取一批大小为n的内存块
+// 优先从中心内存池的free-list上摘取，如果中心的free-list也为空，则从内存池中切出一批
+// 第一块返回给用户，其余的挂到thread cache上
+    template <bool threads, int inst, class ChunkSource>
+    void* __default_alloc_template<threads, inst, ChunkSource>::cache_refill(thread_cache& cache, size_t n) {
+        size_t index = FREELIST_INDEX(n);
+        int n_objs;
+        obj* chain;
+        __ALLOC_STAT(BUMP(cache.owner->counters.refill_calls[index]));
+
+        // 先看看其他线程有没有归还属于本线程的内存块，有的话一次性全部取回，不需要加锁
+        chain = take_remote(cache.owner, index);
+        if (chain != NULL) {
+            size_t got = 0;
+            for (obj* p = chain->free_list_link; p != NULL; p = p->free_list_link)
+                ++got;
+            cache.free_list[index] = chain->free_list_link;
+            cache.count[index] += got;
+            return (void*)chain;
+        }
+
+        n_objs = cache.sizer.next_batch(index);
+        {
+            std::lock_guard<std::mutex> guard(pool_lock);
+            obj* volatile * my_free_list = free_list + index;
+            obj* head = *my_free_list;
+            if (head != NULL) {
+                // 从中心的free-list上摘下最多n_objs块，作为一整条链表取走
+                obj* tail = head;
+                int got = 1;
+                while (got < n_objs && tail->free_list_link != NULL) {
+                    tail = tail->free_list_link;
+                    ++got;
+                }
+                *my_free_list = tail->free_list_link;
+                tail->free_list_link = NULL;
+                n_objs = got;
+                chain = head;
+            }
+            else {
+                // 中心的free-list为空，直接从内存池中切出一批，n_objs为实际切出的个数
+                char* chunk = chunk_alloc(n, n_objs);
+                chain = link_chunk(chunk, n, n_objs);
+            }
+        }
+        // 不需要再持有锁，剩下的内存块挂到本线程的thread cache上
+        cache.free_list[index] = chain->free_list_link;
+        cache.count[index] += n_objs - 1;
+        return (void*)chain;
+    }
+
+// 多线程版本：将thread cache第index条链表上的前n_objs个内存块归还给中心内存池
+// 先在锁外把要归还的一段链表找出来，加锁后只需要一次拼接
+    template <bool threads, int inst, class ChunkSource>
+    void __default_alloc_template<threads, inst, ChunkSource>::flush(thread_cache& cache, size_t index, size_t n_objs) {
+        obj* head = cache.free_list[index];
+        obj* tail = head;
+        for (size_t i = 1; i < n_objs; i++)
+            tail = tail->free_list_link;
+        cache.free_list[index] = tail->free_list_link;
+        cache.count[index] -= n_objs;
+
+        std::lock_guard<std::mutex> guard(pool_lock);
+        obj* volatile * my_free_list = free_list + index;
+        tail->free_list_link = *my_free_list;
+        *my_free_list = head;
+
+        // 多线程版本在批量归还时（已经持有锁）检查是否需要自动trim
+        if (--trim_countdown == 0)
+            check_trim();
+    }
+
+// 新线程获取owner记录
+// 优先接手已经退出的线程留下的记录，这样那些chunk上之后归还的内存块还能被重新使用，owner记录的个数也不会无限增长
+    template <bool threads, int inst, class ChunkSource>
+    typename __default_alloc_template<threads, inst, ChunkSource>::thread_owner*
+    __default_alloc_template<threads, inst, ChunkSource>::acquire_owner() {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        for (thread_owner* owner = owners; owner != NULL; owner = owner->next) {
+            if (owner->abandoned) {
+                owner->abandoned = false;
+                return owner;
+            }
+        }
+        thread_owner* owner = (thread_owner*) __malloc_alloc_template<inst>::allocate(sizeof(thread_owner));
+        for (int i = 0; i < __NFREELISTS; i++) {
+            new (&owner->remote_free[i]) std::atomic<unsigned long long>(0);
+            __ALLOC_STAT(new (&owner->counters.allocate_calls[i]) std::atomic<size_t>(0));
+            __ALLOC_STAT(new (&owner->counters.deallocate_calls[i]) std::atomic<size_t>(0));
+            __ALLOC_STAT(new (&owner->counters.refill_calls[i]) std::atomic<size_t>(0));
+        }
+        owner->abandoned = false;
+        owner->next = owners;
+        owners = owner;
+        return owner;
+    }
+
+// 线程退出时放弃owner记录
+// 之后仍可能有其他线程把内存块压入这个记录的归还栈，这些内存块会在trim()或者下一个接手的线程refill时被取回
+    template <bool threads, int inst, class ChunkSource>
+    void __default_alloc_template<threads, inst, ChunkSource>::abandon_owner(thread_owner* owner) {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        for (int i = 0; i < __NFREELISTS; i++) {
+            obj* chain = take_remote(owner, i);
+            while (chain != NULL) {
+                obj* next = chain->free_list_link;
+                chain->free_list_link = free_list[i];
+                free_list[i] = chain;
+                chain = next;
+            }
+        }
+        owner->abandoned = true;
+    }
+
+// 取走所有owner归还栈上的内存块，放到中心内存池的free-list上
+// 归还栈支持多个线程同时取，所以即使owner还在运行也是安全的
+    template <bool threads, int inst, class ChunkSource>
+    void __default_alloc_template<threads, inst, ChunkSource>::drain_remote_frees() {
+        for (thread_owner* owner = owners; owner != NULL; owner = owner->next) {
+            for (int i = 0; i < __NFREELISTS; i++) {
+                obj* chain = take_remote(owner, i);
+                while (chain != NULL) {
+                    obj* next = chain->free_list_link;
+                    chain->free_list_link = free_list[i];
+                    free_list[i] = chain;
+                    chain = next;
+                }
+            }
+        }
+    }
+
+// 汇总统计数据
+// 多线程版本需要把所有owner的计数器加起来；挂在free-list上的内存块个数 = 切出来的个数 - 正在使用的个数
+    template <bool threads, int inst, class ChunkSource>
+    __alloc_stats_snapshot __default_alloc_template<threads, inst, ChunkSource>::collect_stats() {
+        __alloc_stats_snapshot result = __alloc_stats_snapshot();
+        result.heap_size = heap_size;
+        result.chunk_count = chunk_count;
+        for (int i = 0; i < __NFREELISTS; i++)
+            result.classes[i].block_size = CLASS_SIZE(i);
+        result.large = __malloc_alloc_template<inst>::stats();
+#ifdef __STL_ALLOC_STATS
+        result.enabled = true;
+        result.heap_high_water = heap_high_water;
+        result.fragment_pushes = fragment_pushes;
+        result.fragment_bytes = fragment_bytes;
+        result.trimmed_bytes = trimmed_bytes;
+        for (int i = 0; i < __NFREELISTS; i++) {
+            __alloc_class_stats& c = result.classes[i];
+            if (threads) {
+                for (thread_owner* owner = owners; owner != NULL; owner = owner->next) {
+                    c.allocate_calls += owner->counters.allocate_calls[i].load(std::memory_order_relaxed);
+                    c.deallocate_calls += owner->counters.deallocate_calls[i].load(std::memory_order_relaxed);
+                    c.refill_calls += owner->counters.refill_calls[i].load(std::memory_order_relaxed);
+                }
+            }
+            else {
+                c.allocate_calls = counters.allocate_calls[i].load(std::memory_order_relaxed);
+                c.deallocate_calls = counters.deallocate_calls[i].load(std::memory_order_relaxed);
+                c.refill_calls = counters.refill_calls[i].load(std::memory_order_relaxed);
+            }
+            c.chunk_alloc_calls = chunk_alloc_calls[i];
+            c.in_use = c.allocate_calls - c.deallocate_calls;
+            c.free_blocks = carved_blocks[i] - c.in_use;
+        }
+#endif
+        return result;
+    }
+
+// 记录新申请的chunk，插入到chunks数组中合适的位置，保持按地址排序
+// chunks数组本身直接使用第一级分配器管理，不占用内存池
+    template <bool threads, int inst, class ChunkSource>
+    void __default_alloc_template<threads, inst, ChunkSource>::register_chunk(char *addr, size_t size, bool from_malloc_alloc) {
+        if (chunk_count == chunk_capacity) {
+            size_t new_capacity = chunk_capacity == 0 ? 16 : 2 * chunk_capacity;
+            chunks = (chunk_record*) __malloc_alloc_template<inst>::reallocate(chunks,
+                    chunk_capacity * sizeof(chunk_record), new_capacity * sizeof(chunk_record));
+            chunk_capacity = new_capacity;
+        }
+        size_t pos = chunk_count;
+        while (pos > 0 && chunks[pos-1].addr > addr) {
+            chunks[pos] = chunks[pos-1];
+            --pos;
+        }
+        chunks[pos].addr = addr;
+        chunks[pos].size = size;
+        chunks[pos].from_malloc_alloc = from_malloc_alloc;
+        ++chunk_count;
+    }
+
+// 二分查找，找到最后一个起始地址不大于p的chunk，p必然落在这个chunk中
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::find_chunk(char *p) {
+        size_t lo = 0, hi = chunk_count;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (chunks[mid].addr <= p)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+// 释放所有完全空闲的chunk
+// 1. 遍历所有free-list以及内存池中剩余的部分，统计每个chunk上空闲的字节数
+// 2. 空闲字节数等于chunk大小的chunk，说明上面的内存块全部都空闲，可以释放
+// 3. 把属于这些chunk的内存块从free-list上摘下来，然后将chunk还给操作系统
+    template <bool threads, int inst, class ChunkSource>
+    size_t __default_alloc_template<threads, inst, ChunkSource>::release_free_chunks() {
+        if (chunk_count == 0)
+            return 0;
+        size_t* free_bytes = (size_t*) calloc(chunk_count, sizeof(size_t));
+        // 连统计用的内存都申请不到，放弃这一次trim
+        if (free_bytes == NULL)
+            return 0;
+
+        for (int i = 0; i < __NFREELISTS; i++) {
+            for (obj* p = free_list[i]; p != NULL; p = p->free_list_link)
+                free_bytes[find_chunk((char*)p)] += CLASS_SIZE(i);
+        }
+        if (end_free != start_free)
+            free_bytes[find_chunk(start_free)] += end_free - start_free;
+        // 多线程版本中每个segment的头部不会分配出去，也算作空闲（预热的region由多个segment组成）
+        if (threads) {
+            for (size_t c = 0; c < chunk_count; c++)
+                free_bytes[c] += chunks[c].size / SEGMENT_BYTES * __SEGMENT_HEADER;
+        }
+
+        // 完全空闲的chunk标记为1，否则标记为0
+        size_t releasable = 0;
+        for (size_t c = 0; c < chunk_count; c++) {
+            free_bytes[c] = (free_bytes[c] == chunks[c].size);
+            releasable += free_bytes[c];
+        }
+        if (releasable == 0) {
+            free(free_bytes);
+            return 0;
+        }
 
+        // 重建free-list，跳过属于待释放chunk的内存块，保持原来的顺序
+        for (int i = 0; i < __NFREELISTS; i++) {
+            obj* kept = NULL;
+            obj* tail = NULL;
+            for (obj* p = free_list[i]; p != NULL; p = p->free_list_link) {
+                if (free_bytes[find_chunk((char*)p)]) {
+                    __ALLOC_STAT(--carved_blocks[i]);
+                    continue;
+                }
+                if (tail == NULL)
+                    kept = p;
+                else
+                    tail->free_list_link = p;
+                tail = p;
+            }
+            if (tail != NULL)
+                tail->free_list_link = NULL;
+            free_list[i] = kept;
+        }
+        // 内存池中剩余的部分也属于待释放的chunk，则内存池清空
+        if (end_free != start_free && free_bytes[find_chunk(start_free)])
+            start_free = end_free = 0;
+
+        // 释放chunk，并压缩chunks数组
+        size_t released = 0;
+        size_t kept_chunks = 0;
+        for (size_t c = 0; c < chunk_count; c++) {
+            if (free_bytes[c]) {
+                released += chunks[c].size;
+                if (chunks[c].from_malloc_alloc)
+                    __malloc_alloc_template<inst>::deallocate(chunks[c].addr, chunks[c].size);
+                else
+                    ChunkSource::deallocate(chunks[c].addr, chunks[c].size);
+            }
+            else {
+                chunks[kept_chunks++] = chunks[c];
+            }
+        }
+        chunk_count = kept_chunks;
+        heap_size -= released;
+        __ALLOC_STAT(trimmed_bytes += released);
+        free(free_bytes);
+        return released;
     }
 
 // 从内存池中取内存块到free-list中
 // 如果内存池中的内存不够了，则需要使用malloc向操作系统申请
 // 内存池的总大小是通过起始地址和终止地址的差值end_free - start_free得到的
-    template <bool threads, int inst>
-    char* __default_alloc_template<threads, inst>::chunk_alloc(size_t size, int &n_objs) {
+    template <bool threads, int inst, class ChunkSource>
+    char* __default_alloc_template<threads, inst, ChunkSource>::chunk_alloc(size_t size, int &n_objs) {
         size_t total_bytes = size * n_objs;     // free-list申请的内存块的总大小
         size_t bytes_left = end_free - start_free;      // 内存池剩余的内存空间
         char *result;
@@ -210,6 +1286,8 @@ namespace my_std {
         if (bytes_left >= total_bytes) {
             result = start_free;
             start_free += total_bytes;
+            __ALLOC_STAT(++chunk_alloc_calls[FREELIST_INDEX(size)]);
+            __ALLOC_STAT(carved_blocks[FREELIST_INDEX(size)] += n_objs);
             return result;
         }
             // 否则如果内存池中剩余的内存大小无法完全满足需求量，但是足够供应一个或一个以上的内存块
@@ -219,27 +1297,36 @@ namespace my_std {
             n_objs = bytes_left / size;
             result = start_free;
             start_free += n_objs*size;
+            __ALLOC_STAT(++chunk_alloc_calls[FREELIST_INDEX(size)]);
+            __ALLOC_STAT(carved_blocks[FREELIST_INDEX(size)] += n_objs);
             return result;
         }
             // 如果内存池中连一个内存块的大小都无法提供，需要使用malloc向操作系统申请内存空间
         else {
             // 首先如果内存池中还有一些残余的内存，将他们分配到适当的free-list中
             // 这些内存是对齐8Bytes的，对内存池的大小进行改动时，也是以8的倍数进行改动
-            // 所以剩余的内存空间大小必然是8Bytes的倍数，它也就必然是一个大小刚好为(n*8Bytes)的内存块
-            // 不需要担心出现例如10Bytes这样的内存空间被当作16Bytes的内存块放入free-list中
-            if (bytes_left > 0) {
-                obj* volatile * my_free_list = free_list + FREELIST_INDEX(bytes_left);
-                // 将其插入对应的free-list中
-                ((obj*) start_free)->free_list_link = *my_free_list;
-                *my_free_list = (obj*) start_free;
-            }
+            // 所以剩余的内存空间大小必然是8Bytes的倍数
+            __ALLOC_STAT(fragment_pushes += bytes_left > 0);
+            __ALLOC_STAT(fragment_bytes += bytes_left);
+            push_fragments(start_free, bytes_left);
+            start_free = end_free;
 
             // 分配完后，内存池的大小为0。需要使用malloc向操作系统申请更多的内存空间放入到内存池中
             // 这里的heap_size是一个动态值，随着申请内存次数的增加，heap_size也不断增加
             // 满足越来越大的内存需求
             size_t bytes_to_get = 2*total_bytes + ROUND_UP(heap_size>>4);
-            start_free = (char*) malloc(bytes_to_get);
-            // 如果堆空间不足，malloc()失败，无法申请内存空间
+            // chunk的大小上调为chunk source粒度的倍数，例如使用大页时不要浪费半个大页
+            bytes_to_get = (bytes_to_get + ChunkSource::granularity - 1) & ~(ChunkSource::granularity - 1);
+            bool from_malloc_alloc = false;
+            // 多线程版本的chunk固定为SEGMENT_BYTES大小并按它对齐，这样才能通过地址找到chunk头部的owner
+            if (threads) {
+                bytes_to_get = SEGMENT_BYTES;
+                start_free = (char*) ChunkSource::allocate(bytes_to_get, SEGMENT_BYTES);
+            }
+            else {
+                start_free = (char*) ChunkSource::allocate(bytes_to_get, __ALIGN);
+            }
+            // 如果堆空间不足，chunk source申请失败，无法申请内存空间
             if (start_free == nullptr) {
                 obj* volatile *my_free_list, *p;
                 // 则遍历free-lists，对free-lists进行调整
@@ -247,15 +1334,16 @@ namespace my_std {
                 // 那么先将这些内存块回收到内存池中
                 // 然后递归调用chunk_alloc()让内存池重新分配新增加的内存，分配合适的内存块给free-list
                 // 并将其中一块内存块返回给用户
-                for (int i = size; i <= __MAX_BYTES; i += __ALIGN) {
-                    my_free_list = free_list + FREELIST_INDEX(i);
+                for (size_t i = FREELIST_INDEX(size); i < (size_t)__NFREELISTS; i++) {
+                    my_free_list = free_list + i;
                     p = *my_free_list;
                     if (p != NULL) {
                         // 将free-list中的第一块内存块还给内存池
                         // 将下一块内存块作为free-list新的头节点
                         *my_free_list = p->free_list_link;
+                        __ALLOC_STAT(--carved_blocks[i]);
                         start_free = (char*)p;
-                        end_free = start_free + i;
+                        end_free = start_free + CLASS_SIZE(i);
                         // 递归调用chunk_alloc()让内存池重新分配新增加的内存，分配合适的内存块给free-list和用户
                         return chunk_alloc(size, n_objs);
                     }
@@ -263,17 +1351,45 @@ namespace my_std {
                 // 如果遍历完free-list后，发现真的一块内存块都不剩了
                 // 那么调用第一级分配器，看看 out of memory 机制是否能尽点力
                 // 如果第一级分配器也无能为力，会抛出异常
+                // 多线程版本需要对齐的chunk，第一级分配器无法保证对齐，只能直接抛出异常
                 end_free = nullptr;
-                start_free = (char*)__malloc_alloc_template<inst>::allocate(size);
+                if (threads)
+                    __THROW_BAD_ALLOC;
+                start_free = (char*)__malloc_alloc_template<inst>::allocate(bytes_to_get);
+                from_malloc_alloc = true;
             }
             // 如果执行到这里，说明第一级分配器的分配奏效了，或者malloc申请内存成功了，更新内存池的大小
+            // 记录这个chunk，以便之后trim()时能够将它还给操作系统
+            register_chunk(start_free, bytes_to_get, from_malloc_alloc);
             // 更新动态值heap_size
             heap_size += bytes_to_get;
+            __ALLOC_STAT(heap_high_water = heap_size > heap_high_water ? heap_size : heap_high_water);
             end_free = start_free + bytes_to_get;
+            // 多线程版本在chunk头部记录owner，即触发这次申请的线程，内存块从头部之后开始切分
+            if (threads) {
+                ((segment_header*)start_free)->owner = local_cache().owner;
+                start_free += __SEGMENT_HEADER;
+            }
             // 递归调用chunk_alloc()，重新调整内存池，并分配内存块给用户
             return chunk_alloc(size, n_objs);
         }
     }
+
+// 重新分配内存
+// 新旧大小都大于__MAX_BYTES时交给第一级分配器（很大的内存块可以通过mremap扩大，不需要拷贝）
+// 新旧大小属于同一级内存块时不需要搬动，否则申请新的内存块，拷贝之后回收旧的
+    template <bool threads, int inst, class ChunkSource>
+    void* __default_alloc_template<threads, inst, ChunkSource>::reallocate(void *p, size_t old_size, size_t new_size) {
+        if (old_size > (size_t)__MAX_BYTES && new_size > (size_t)__MAX_BYTES)
+            return __malloc_alloc_template<inst>::reallocate(p, old_size, new_size);
+        if (old_size <= (size_t)__MAX_BYTES && new_size <= (size_t)__MAX_BYTES
+            && FREELIST_INDEX(old_size) == FREELIST_INDEX(new_size))
+            return p;
+        void* result = allocate(new_size);
+        memcpy(result, p, old_size < new_size ? old_size : new_size);
+        deallocate(p, old_size);
+        return result;
+    }
 }
 
 
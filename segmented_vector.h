@@ -0,0 +1,384 @@
+//
+// 分段数组：元素地址不变的vector
+//
+
+#ifndef STL_MY_ALLOCATOR_SEGMENTED_VECTOR_H
+#define STL_MY_ALLOCATOR_SEGMENTED_VECTOR_H
+
+#include <iterator>
+#include <utility>
+#include "my_allocator.h"
+#include "my_vector.h"
+
+/*
+ * segmented_vector<T, ChunkLog2, Alloc>，元素存放在一个个固定大小的块（chunk）中，每块2^ChunkLog2个元素
+ * 块的地址记录在一个指针数组（块表）中：
+ *   map --> |__|__|__|__|...    块表，容量不够时按2倍扩大，只搬动块的指针
+ *            |  |
+ *            |  +--> |__|__|__|...|__|    2^ChunkLog2个元素
+ *            +-----> |__|__|__|...|__|
+ *
+ * 与vector相比：push_back只会申请新的块，已有的元素从不搬动，元素的引用、指针一直有效（直到被erase/pop_back）
+ * 与deque相比：块的大小是2的幂，并且第一个元素总是在0号块的开头，
+ *             第n个元素就是map[n >> ChunkLog2][n & (2^ChunkLog2 - 1)]，一次移位加一次与运算，
+ *             deque的operator[]要经过__deque_iterator::operator+=中的除法
+ * 下标本身就是稳定的句柄，可以代替指针保存在其他的表中
+ *
+ * 注意：
+ *   只能在尾端插入、删除；clear()、pop_back()不回收块，shrink_to_fit()才回收多余的块
+ *   块表扩大时迭代器会失效（迭代器记录了块表的地址），元素的引用、指针和下标不受影响
+ *   按顺序处理所有元素时，for_each()（以及for_each_segment()）按块遍历，内层循环就是普通的指针循环，比逐个下标访问快
+ */
+
+template <class T, class Ref, class Ptr, size_t ChunkLog2>
+struct __segmented_iterator {
+    typedef __segmented_iterator<T, T&, T*, ChunkLog2> iterator;
+    typedef __segmented_iterator<T, const T&, const T*, ChunkLog2> const_iterator;
+    typedef __segmented_iterator self;
+
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef Ptr pointer;
+    typedef Ref reference;
+    typedef ptrdiff_t difference_type;
+    typedef size_t size_type;
+
+    static const size_type chunk_size = size_type(1) << ChunkLog2;
+    static const size_type chunk_mask = chunk_size - 1;
+
+    T* const* map;      // 块表
+    size_type index;    // 元素的下标
+
+    __segmented_iterator() : map(0), index(0) {}
+    __segmented_iterator(T* const* m, size_type n) : map(m), index(n) {}
+    __segmented_iterator(const iterator& x) : map(x.map), index(x.index) {}
+
+    reference operator*() const { return map[index >> ChunkLog2][index & chunk_mask]; }
+    pointer operator->() const { return &(operator*()); }
+    reference operator[](difference_type n) const { return *(*this + n); }
+
+    self& operator++() { ++index; return *this; }
+    self operator++(int) { self tmp = *this; ++index; return tmp; }
+    self& operator--() { --index; return *this; }
+    self operator--(int) { self tmp = *this; --index; return tmp; }
+    self& operator+=(difference_type n) { index += n; return *this; }
+    self& operator-=(difference_type n) { index -= n; return *this; }
+    self operator+(difference_type n) const { return self(map, index + n); }
+    self operator-(difference_type n) const { return self(map, index - n); }
+    difference_type operator-(const self& x) const { return difference_type(index) - difference_type(x.index); }
+
+    bool operator==(const self& x) const { return index == x.index; }
+    bool operator!=(const self& x) const { return index != x.index; }
+    bool operator<(const self& x) const { return index < x.index; }
+    bool operator>(const self& x) const { return index > x.index; }
+    bool operator<=(const self& x) const { return index <= x.index; }
+    bool operator>=(const self& x) const { return index >= x.index; }
+};
+
+template <class T, size_t ChunkLog2 = 9, class Alloc = alloc>
+class segmented_vector : protected __alloc_holder<Alloc> {
+    static_assert(ChunkLog2 < sizeof(size_t) * 8, "chunk size must fit in size_t");
+
+public:
+    typedef T           value_type;
+    typedef value_type* pointer;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef size_t      size_type;
+    typedef ptrdiff_t   difference_type;
+    typedef Alloc       allocator_type;
+
+    typedef __segmented_iterator<T, T&, T*, ChunkLog2> iterator;
+    typedef __segmented_iterator<T, const T&, const T*, ChunkLog2> const_iterator;
+
+    static const size_type chunk_size = size_type(1) << ChunkLog2;     // 每块的元素个数
+
+    using __alloc_holder<Alloc>::get_allocator;
+
+protected:
+    typedef __alloc_holder<Alloc> alloc_base;
+    typedef simple_alloc<value_type, Alloc> chunk_allocator;
+    typedef simple_alloc<pointer, Alloc> map_allocator;
+
+    static const size_type chunk_mask = chunk_size - 1;
+
+    pointer* map;           // 块表，前chunk_count个指针指向已经申请的块
+    size_type map_size;     // 块表的容量
+    size_type chunk_count;  // 已经申请的块数，容量就是chunk_count * chunk_size
+    size_type count;        // 元素个数
+
+    // 保证至少有n个块
+    void reserve_chunks(size_type n);
+
+    // 回收chunk_count之中从第n块开始的块
+    void deallocate_chunks(size_type n) {
+        for (; chunk_count > n; --chunk_count)
+            chunk_allocator::deallocate(this->get_alloc(), map[chunk_count - 1], chunk_size);
+    }
+
+    // 在尾端留出一个元素的位置，返回它的地址
+    pointer make_room() {
+        if (count == capacity())
+            reserve_chunks(chunk_count + 1);
+        return &map[count >> ChunkLog2][count & chunk_mask];
+    }
+
+    void release() {
+        clear();
+        deallocate_chunks(0);
+        if (map != 0)
+            map_allocator::deallocate(this->get_alloc(), map, map_size);
+        map = 0;
+        map_size = 0;
+    }
+
+    void steal(segmented_vector& x) {
+        map = x.map;
+        map_size = x.map_size;
+        chunk_count = x.chunk_count;
+        count = x.count;
+        x.map = 0;
+        x.map_size = x.chunk_count = x.count = 0;
+    }
+
+public:
+    explicit segmented_vector(const Alloc& a = Alloc())
+        : alloc_base(a), map(0), map_size(0), chunk_count(0), count(0) {}
+
+    segmented_vector(size_type n, const T& value, const Alloc& a = Alloc())
+        : alloc_base(a), map(0), map_size(0), chunk_count(0), count(0) {
+        try {
+            resize(n, value);
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    explicit segmented_vector(size_type n, const Alloc& a = Alloc())
+        : alloc_base(a), map(0), map_size(0), chunk_count(0), count(0) {
+        try {
+            resize(n);
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    segmented_vector(const segmented_vector& x)
+        : alloc_base(__allocator_traits<Alloc>::select_on_container_copy_construction(x.get_alloc())),
+          map(0), map_size(0), chunk_count(0), count(0) {
+        // 拷贝某个元素时抛出异常，析构函数不会被调用，需要先销毁已经拷贝的元素、回收块和块表
+        try {
+            reserve(x.size());
+            x.for_each([this](const T& v) { push_back(v); });
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    // 移动构造，直接接管块表
+    segmented_vector(segmented_vector&& x) noexcept
+        : alloc_base(x.get_alloc()), map(0), map_size(0), chunk_count(0), count(0) {
+        steal(x);
+    }
+
+    segmented_vector& operator=(const segmented_vector& x) {
+        if (&x != this) {
+            if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment
+                && !__alloc_equal(this->get_alloc(), x.get_alloc()))
+                release();
+            __propagate_on_copy_assign(this->get_alloc(), x.get_alloc());
+            clear();
+            reserve(x.size());
+            x.for_each([this](const T& v) { push_back(v); });
+        }
+        return *this;
+    }
+
+    // 移动赋值，分配器会传播或者相等时接管块表，否则逐个移动元素
+    segmented_vector& operator=(segmented_vector&& x) {
+        if (&x == this)
+            return *this;
+        if (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+            || __alloc_equal(this->get_alloc(), x.get_alloc())) {
+            release();
+            __propagate_on_move_assign(this->get_alloc(), x.get_alloc());
+            steal(x);
+        }
+        else {
+            clear();
+            reserve(x.size());
+            x.for_each([this](T& v) { push_back(std::move(v)); });
+            x.clear();
+        }
+        return *this;
+    }
+
+    void swap(segmented_vector& x) {
+        __propagate_on_swap(this->get_alloc(), x.get_alloc());
+        std::swap(map, x.map);
+        std::swap(map_size, x.map_size);
+        std::swap(chunk_count, x.chunk_count);
+        std::swap(count, x.count);
+    }
+
+    ~segmented_vector() { release(); }
+
+    iterator begin() { return iterator(map, 0); }
+    iterator end() { return iterator(map, count); }
+    const_iterator begin() const { return const_iterator(map, 0); }
+    const_iterator end() const { return const_iterator(map, count); }
+
+    size_type size() const { return count; }
+    size_type capacity() const { return chunk_count << ChunkLog2; }
+    bool empty() const { return count == 0; }
+
+    // 移位取块号，与运算取块内的位置
+    reference operator[](size_type n) { return map[n >> ChunkLog2][n & chunk_mask]; }
+    const_reference operator[](size_type n) const { return map[n >> ChunkLog2][n & chunk_mask]; }
+    reference front() { return map[0][0]; }
+    reference back() { return (*this)[count - 1]; }
+
+    void push_back(const T& x) {
+        pointer p = make_room();
+        construct(p, x);
+        ++count;
+    }
+
+    void push_back(T&& x) {
+        pointer p = make_room();
+        construct(p, std::move(x));
+        ++count;
+    }
+
+    // 在尾端构造元素，返回它的引用，引用在元素被删除之前一直有效
+    template <class... Args>
+    reference emplace_back(Args&&... args) {
+        pointer p = make_room();
+        construct(p, std::forward<Args>(args)...);
+        ++count;
+        return *p;
+    }
+
+    void pop_back() {
+        --count;
+        destroy(&(*this)[count]);
+    }
+
+    // 保证容量至少为n，已有的元素不会搬动
+    void reserve(size_type n) {
+        reserve_chunks((n + chunk_mask) >> ChunkLog2);
+    }
+
+    // 回收没有元素的块，块表本身保持不变
+    void shrink_to_fit() {
+        deallocate_chunks((count + chunk_mask) >> ChunkLog2);
+    }
+
+    void resize(size_type new_size, const T& x) {
+        while (count > new_size)
+            pop_back();
+        reserve(new_size);
+        while (count < new_size)
+            push_back(x);
+    }
+
+    void resize(size_type new_size) {
+        while (count > new_size)
+            pop_back();
+        reserve(new_size);
+        while (count < new_size)
+            emplace_back();
+    }
+
+    // 析构所有元素，块留着给之后的push_back使用
+    void clear() {
+        for_each_segment([](T* first, T* last) { destroy(first, last); });
+        count = 0;
+    }
+
+    // 按块处理所有元素，对每块调用f(first, last)，[first, last)是这一块中的元素
+    template <class Function>
+    Function for_each_segment(Function f) {
+        size_type full = count >> ChunkLog2;
+        for (size_type i = 0; i < full; ++i)
+            f(map[i], map[i] + chunk_size);
+        if (count & chunk_mask)
+            f(map[full], map[full] + (count & chunk_mask));
+        return f;
+    }
+
+    template <class Function>
+    Function for_each_segment(Function f) const {
+        size_type full = count >> ChunkLog2;
+        for (size_type i = 0; i < full; ++i)
+            f((const T*) map[i], (const T*) map[i] + chunk_size);
+        if (count & chunk_mask)
+            f((const T*) map[full], (const T*) map[full] + (count & chunk_mask));
+        return f;
+    }
+
+    // 对每个元素调用f，内层是块内的指针循环
+    template <class Function>
+    Function for_each(Function f) {
+        for_each_segment([&f](T* first, T* last) {
+            for (; first != last; ++first)
+                f(*first);
+        });
+        return f;
+    }
+
+    template <class Function>
+    Function for_each(Function f) const {
+        for_each_segment([&f](const T* first, const T* last) {
+            for (; first != last; ++first)
+                f(*first);
+        });
+        return f;
+    }
+};
+
+template <class T, size_t ChunkLog2, class Alloc>
+void segmented_vector<T, ChunkLog2, Alloc>::reserve_chunks(size_type n) {
+    if (n <= chunk_count)
+        return;
+    // 块表不够时按2倍扩大，块表里只有指针，直接reallocate
+    if (n > map_size) {
+        size_type new_map_size = map_size == 0 ? 8 : map_size;
+        while (new_map_size < n)
+            new_map_size *= 2;
+        if (map == 0)
+            map = map_allocator::allocate(this->get_alloc(), new_map_size);
+        else
+            map = map_allocator::reallocate(this->get_alloc(), map, map_size, new_map_size);
+        map_size = new_map_size;
+    }
+    for (; chunk_count < n; ++chunk_count)
+        map[chunk_count] = chunk_allocator::allocate(this->get_alloc(), chunk_size);
+}
+
+// 分段数组的迭代器区间按块处理：[first, last)拆成若干个块内的指针区间，内层不再经过移位和与运算
+template <class T, class Ref, class Ptr, size_t ChunkLog2, class Function>
+Function for_each(__segmented_iterator<T, Ref, Ptr, ChunkLog2> first,
+                  __segmented_iterator<T, Ref, Ptr, ChunkLog2> last, Function f) {
+    typedef __segmented_iterator<T, Ref, Ptr, ChunkLog2> iter;
+    while (first.index < last.index) {
+        size_t chunk = first.index >> ChunkLog2;
+        size_t end = (chunk + 1) << ChunkLog2;
+        if (end > last.index)
+            end = last.index;
+        Ptr p = first.map[chunk] + (first.index & iter::chunk_mask);
+        Ptr stop = p + (end - first.index);
+        for (; p != stop; ++p)
+            f(*p);
+        first.index = end;
+    }
+    return f;
+}
+
+#endif //STL_MY_ALLOCATOR_SEGMENTED_VECTOR_H
@@ -0,0 +1,290 @@
+//
+// 基于位图的slab分配器，可以替代第二级分配器
+//
+
+#ifndef STL_MY_ALLOCATOR_SLAB_ALLOC_H
+#define STL_MY_ALLOCATOR_SLAB_ALLOC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
+#include <atomic>
+#include "second_level_alloc.h"
+
+namespace my_std {
+    /*
+ * slab分配器，接口与第二级分配器相同，可以直接作为容器的Alloc模板参数，例如
+ *   typedef __slab_alloc_template<false, 0> slab_alloc;
+ *   rb_tree<int, int, identity<int>, less<int>, slab_alloc> t;
+ * 大小分级与第二级分配器相同（见__size_class_index），大于__MAX_BYTES的交给第一级分配器
+ *
+ * 第二级分配器的free-list是侵入式的链表，运行一段时间之后，链表上相邻的内存块可能来自完全不同的chunk，
+ * 同一个容器的节点会分散到很多页上，而且只要chunk上还有一个内存块在使用，整个chunk就无法还给系统
+ * slab分配器把每一级内存块放在若干个slab中，slab的大小是2的幂（至少一页4KB，并且至少能放下7个内存块），按自己的大小对齐，
+ * 开头是slab的头部，其中的位图（bitmap）记录每一个内存块是否空闲：
+ * |__头部（位图等）__|__内存块0__|__内存块1__|......|__内存块capacity-1__|
+ * 分配时用ctz（count trailing zeros）找到位图中最低的空闲位，回收时只需要把地址的低位清零就能找到所在的slab
+ *
+ * 每一级有一个当前slab，分配都在当前slab上进行，当前slab满了之后，选择其他slab中最满的一个作为新的当前slab
+ * （按使用率分成__SLAB_LEVELS档，每一档一个链表，从最满的一档中取），这样存活的内存块集中在少数几个slab上，
+ * 不满的slab会逐渐变空，完全空闲的slab每一级只缓存一个，多余的立刻还给系统，trim()把缓存的和空闲的当前slab也还给系统
+ *
+ * 第一参数为true时，每一级内存块有自己的互斥锁，可以在多线程中使用；为false时只能在单线程中使用
+ * 第二参数与其他分配器一样，用来生成互相独立的slab分配器
+ */
+
+    const static size_t __SLAB_MIN_BYTES = 4096;      // slab的最小大小，一页
+    const static size_t __SLAB_MIN_OBJS = 8;          // slab的大小至少是内存块大小的多少倍
+    const static size_t __SLAB_HEADER = 128;          // slab头部的大小，第一个内存块从这里开始
+    const static size_t __SLAB_MAX_OBJS = 512;        // 一个slab最多容纳的内存块个数，也就是位图的位数
+    const static int __SLAB_LEVELS = 4;               // 按使用率把不满的slab分成几档
+
+    template <bool threads, int inst>
+    class __slab_alloc_template {
+    private:
+        const static size_t BITMAP_WORDS = __SLAB_MAX_OBJS / 64;
+
+        // slab的头部
+        struct slab {
+            slab* prev;             // 同一档的slab串成双向链表
+            slab* next;
+            uint32_t used;          // 已经分配出去的内存块个数
+            uint32_t capacity;      // 内存块的总个数
+            int level;              // 所在的档，-1表示不在任何链表上（当前slab、已满的slab、缓存的空slab）
+            uint64_t free_bits[BITMAP_WORDS];   // 位为1表示对应的内存块空闲
+        };
+
+        static_assert(sizeof(slab) <= __SLAB_HEADER, "slab header does not fit in __SLAB_HEADER");
+
+        // 每一级内存块的slab
+        struct size_class {
+            slab* current;                      // 当前分配的slab
+            slab* partial[__SLAB_LEVELS];       // 不满的slab，按使用率分档
+            slab* empty;                        // 缓存的一个空slab
+        };
+
+        static size_class classes[__NFREELISTS];
+        static std::mutex class_lock[__NFREELISTS];      // 多线程版本中每一级一把锁
+        static std::atomic<size_t> heap_size;            // 所有slab的总大小
+        static std::atomic<size_t> slab_count;
+
+        // 第index级的slab大小：不小于__SLAB_MIN_BYTES和__SLAB_MIN_OBJS个内存块的最小的2的幂
+        static size_t SLAB_BYTES(size_t index) {
+            size_t bytes = __size_class_bytes(index) * __SLAB_MIN_OBJS;
+            if (bytes < __SLAB_MIN_BYTES)
+                return __SLAB_MIN_BYTES;
+            return (size_t)1 << (__highest_bit(bytes - 1) + 1);
+        }
+
+        // 内存块p所在的slab，把地址的低位清零即可
+        static slab* SLAB_OF(void* p, size_t index) {
+            return (slab*)((uintptr_t)p & ~(uintptr_t)(SLAB_BYTES(index) - 1));
+        }
+
+        // 使用了used个内存块的slab属于哪一档
+        static int LEVEL(const slab* s) {
+            return (int)((size_t)s->used * __SLAB_LEVELS / s->capacity);
+        }
+
+        static int LOWEST_BIT(uint64_t x) {
+#if defined(__GNUC__)
+            return __builtin_ctzll(x);
+#else
+            int bit = 0;
+            while ((x & 1) == 0) {
+                x >>= 1;
+                ++bit;
+            }
+            return bit;
+#endif
+        }
+
+        static void link(size_class& c, slab* s, int level) {
+            s->level = level;
+            s->prev = NULL;
+            s->next = c.partial[level];
+            if (s->next != NULL)
+                s->next->prev = s;
+            c.partial[level] = s;
+        }
+
+        static void unlink(size_class& c, slab* s) {
+            if (s->prev != NULL)
+                s->prev->next = s->next;
+            else
+                c.partial[s->level] = s->next;
+            if (s->next != NULL)
+                s->next->prev = s->prev;
+            s->level = -1;
+        }
+
+        // 向系统申请一个新的slab，并初始化头部
+        static slab* new_slab(size_t index) {
+            size_t bytes = SLAB_BYTES(index);
+            slab* s = (slab*) __malloc_chunk_source::allocate(bytes, bytes);
+            if (s == NULL)
+                __THROW_BAD_ALLOC;
+            size_t capacity = (bytes - __SLAB_HEADER) / __size_class_bytes(index);
+            if (capacity > __SLAB_MAX_OBJS)
+                capacity = __SLAB_MAX_OBJS;
+            s->prev = s->next = NULL;
+            s->used = 0;
+            s->capacity = (uint32_t) capacity;
+            s->level = -1;
+            memset(s->free_bits, 0, sizeof(s->free_bits));
+            for (size_t i = 0; i < capacity / 64; i++)
+                s->free_bits[i] = ~(uint64_t)0;
+            if (capacity % 64 != 0)
+                s->free_bits[capacity / 64] = ((uint64_t)1 << (capacity % 64)) - 1;
+            heap_size.fetch_add(bytes, std::memory_order_relaxed);
+            slab_count.fetch_add(1, std::memory_order_relaxed);
+            return s;
+        }
+
+        static void free_slab(slab* s, size_t index) {
+            size_t bytes = SLAB_BYTES(index);
+            __malloc_chunk_source::deallocate(s, bytes);
+            heap_size.fetch_sub(bytes, std::memory_order_relaxed);
+            slab_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        // 当前slab已满，选择最满的一个不满的slab作为新的当前slab，没有的话使用缓存的空slab，或者申请一个新的
+        static slab* next_slab(size_class& c, size_t index) {
+            for (int level = __SLAB_LEVELS - 1; level >= 0; level--) {
+                slab* s = c.partial[level];
+                if (s != NULL) {
+                    unlink(c, s);
+                    return s;
+                }
+            }
+            if (c.empty != NULL) {
+                slab* s = c.empty;
+                c.empty = NULL;
+                return s;
+            }
+            return new_slab(index);
+        }
+
+        static void* class_allocate(size_t index) {
+            size_class& c = classes[index];
+            slab* s = c.current;
+            if (s == NULL || s->used == s->capacity) {
+                s = next_slab(c, index);
+                c.current = s;
+            }
+            // 当前slab一定有空闲的内存块，找到位图中最低的空闲位
+            size_t word = 0;
+            while (s->free_bits[word] == 0)
+                ++word;
+            uint64_t bits = s->free_bits[word];
+            size_t k = word * 64 + LOWEST_BIT(bits);
+            s->free_bits[word] = bits & (bits - 1);     // 清除最低的1
+            ++s->used;
+            return (char*)s + __SLAB_HEADER + k * __size_class_bytes(index);
+        }
+
+        static void class_deallocate(void* p, size_t index) {
+            size_class& c = classes[index];
+            slab* s = SLAB_OF(p, index);
+            size_t k = (size_t)((char*)p - ((char*)s + __SLAB_HEADER)) / __size_class_bytes(index);
+            s->free_bits[k / 64] |= (uint64_t)1 << (k % 64);
+            bool was_full = s->used == s->capacity;
+            --s->used;
+            // 当前slab不在链表上，不需要调整
+            if (s == c.current)
+                return;
+            if (!was_full)
+                unlink(c, s);
+            // 完全空闲的slab，缓存一个，多余的还给系统
+            if (s->used == 0) {
+                if (c.empty == NULL)
+                    c.empty = s;
+                else
+                    free_slab(s, index);
+                return;
+            }
+            link(c, s, LEVEL(s));
+        }
+
+    public:
+        static void* allocate(size_t n) {
+            if (n > (size_t)__MAX_BYTES)
+                return __malloc_alloc_template<inst>::allocate(n);
+            size_t index = __size_class_index(n);
+            if (threads) {
+                std::lock_guard<std::mutex> guard(class_lock[index]);
+                return class_allocate(index);
+            }
+            return class_allocate(index);
+        }
+
+        static void deallocate(void* p, size_t n) {
+            if (n > (size_t)__MAX_BYTES) {
+                __malloc_alloc_template<inst>::deallocate(p, n);
+                return;
+            }
+            size_t index = __size_class_index(n);
+            if (threads) {
+                std::lock_guard<std::mutex> guard(class_lock[index]);
+                class_deallocate(p, index);
+                return;
+            }
+            class_deallocate(p, index);
+        }
+
+        static void* reallocate(void* p, size_t old_size, size_t new_size) {
+            if (old_size > (size_t)__MAX_BYTES && new_size > (size_t)__MAX_BYTES)
+                return __malloc_alloc_template<inst>::reallocate(p, old_size, new_size);
+            // 同一级的内存块不需要搬动
+            if (old_size <= (size_t)__MAX_BYTES && new_size <= (size_t)__MAX_BYTES
+                && __size_class_index(old_size) == __size_class_index(new_size))
+                return p;
+            void* result = allocate(new_size);
+            memcpy(result, p, old_size < new_size ? old_size : new_size);
+            deallocate(p, old_size);
+            return result;
+        }
+
+        // 把缓存的空slab以及空闲的当前slab还给系统，返回释放的字节数
+        static size_t trim() {
+            size_t released = 0;
+            for (size_t index = 0; index < (size_t)__NFREELISTS; index++) {
+                std::unique_lock<std::mutex> guard(class_lock[index], std::defer_lock);
+                if (threads)
+                    guard.lock();
+                size_class& c = classes[index];
+                if (c.empty != NULL) {
+                    released += SLAB_BYTES(index);
+                    free_slab(c.empty, index);
+                    c.empty = NULL;
+                }
+                if (c.current != NULL && c.current->used == 0) {
+                    released += SLAB_BYTES(index);
+                    free_slab(c.current, index);
+                    c.current = NULL;
+                }
+            }
+            return released;
+        }
+
+        // 当前从系统申请的内存总量（不包括交给第一级分配器的部分）
+        static size_t pool_heap_size() { return heap_size.load(std::memory_order_relaxed); }
+
+        // 当前slab的个数
+        static size_t slabs() { return slab_count.load(std::memory_order_relaxed); }
+    };
+
+    template <bool threads, int inst>
+    typename __slab_alloc_template<threads, inst>::size_class __slab_alloc_template<threads, inst>::classes[__NFREELISTS];
+
+    template <bool threads, int inst>
+    std::mutex __slab_alloc_template<threads, inst>::class_lock[__NFREELISTS];
+
+    template <bool threads, int inst>
+    std::atomic<size_t> __slab_alloc_template<threads, inst>::heap_size(0);
+
+    template <bool threads, int inst>
+    std::atomic<size_t> __slab_alloc_template<threads, inst>::slab_count(0);
+}
+
+#endif //STL_MY_ALLOCATOR_SLAB_ALLOC_H
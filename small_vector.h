@@ -0,0 +1,570 @@
+//
+// 带内联存储的vector
+//
+
+#ifndef STL_MY_ALLOCATOR_SMALL_VECTOR_H
+#define STL_MY_ALLOCATOR_SMALL_VECTOR_H
+
+#include <type_traits>
+#include <utility>
+#include <string.h>
+#include "my_allocator.h"
+#include "my_vector.h"
+
+/*
+ * small_vector<T, N, Alloc>，接口与vector相同
+ * vector第一次push_back就要向分配器申请内存（insert_aux从容量1开始翻倍），而大多数临时的vector只有很少几个元素
+ * small_vector在对象内部预留N个元素的空间（内联存储），元素个数不超过N时完全不需要申请内存，
+ * 超过N时才和vector一样向Alloc申请一块2倍大小的内存，把元素搬过去，之后的行为与vector相同
+ * |__start__|__finish__|__end_of_storage__|__内联存储：N个元素__|
+ *      |
+ *      +--> 指向内联存储，或者指向Alloc分配的内存
+ *
+ * 注意：
+ *   元素在内联存储中时，移动构造、移动赋值、swap需要逐个移动元素，原来的迭代器会失效（vector只交换指针）
+ *   内存换到堆上之后，只有shrink_to_fit()时元素个数不超过N才会回到内联存储，clear()之后容量不变
+ *   对象本身至少占用N * sizeof(T)的空间，N应当按实际的元素个数分布来选，不宜太大
+ */
+
+template <class T, size_t N, class Alloc = alloc>
+class small_vector : protected __alloc_holder<Alloc> {
+    static_assert(N > 0, "small_vector needs at least one inline element");
+
+public:
+    typedef T           value_type;
+    typedef value_type* pointer;
+    typedef value_type* iterator;
+    typedef const value_type* const_iterator;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef size_t      size_type;
+    typedef ptrdiff_t   difference_type;
+    typedef Alloc       allocator_type;
+
+    static const size_type inline_capacity = N;     // 内联存储能容纳的元素个数
+
+    using __alloc_holder<Alloc>::get_allocator;
+
+protected:
+    typedef __alloc_holder<Alloc> alloc_base;
+    typedef simple_alloc<value_type, Alloc> data_allocator;
+
+    iterator start;
+    iterator finish;
+    iterator end_of_storage;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type inline_storage[N];    // 内联存储，没有构造的元素
+
+    // 与vector相同，元素可以按字节搬动时，堆上的内存通过data_allocator::reallocate()扩容
+    static const bool relocatable = __is_trivially_relocatable<T>::value;
+
+    iterator inline_begin() { return (iterator) inline_storage; }
+
+    // 回收堆上的内存，内联存储不需要回收
+    void deallocate() {
+        if (!is_inline())
+            data_allocator::deallocate(this->get_alloc(), start, capacity());
+    }
+
+    // 回到空的内联存储，调用之前元素需要已经析构、堆上的内存需要已经回收
+    void reset_to_inline() {
+        start = finish = inline_begin();
+        end_of_storage = start + N;
+    }
+
+    // 容量不够时，申请一块new_size个元素的内存，新元素由args构造，其余的元素移动（或者拷贝）过去
+    template <class... Args>
+    void insert_aux(iterator position, Args&&... args);
+
+    // 把容量调整为new_size（不小于size()），元素移动（或者拷贝）到新的内存上
+    void reallocate_storage(size_type new_size);
+
+    // 构造时填充n个value，与vector的fill_initialize相同
+    // 拷贝某个元素时抛出异常，析构函数不会被调用，需要先析构已经构造的元素、回收堆上的内存
+    void fill_initialize(size_type n, const T& value) {
+        reset_to_inline();
+        try {
+            insert(end(), n, value);
+        }
+        catch (...) {
+            destroy(start, finish);
+            deallocate();
+            throw;
+        }
+    }
+
+    // 接管x的元素：x在堆上时直接接管内存，在内联存储中时逐个移动，x变成空的
+    void steal(small_vector& x) {
+        if (x.is_inline()) {
+            reset_to_inline();
+            finish = __uninitialized_move_if_noexcept(x.start, x.finish, start);
+            x.clear();
+        }
+        else {
+            start = x.start;
+            finish = x.finish;
+            end_of_storage = x.end_of_storage;
+            x.reset_to_inline();
+        }
+    }
+
+public:
+    iterator begin() { return start; }
+    iterator end() { return finish; }
+    const_iterator begin() const { return start; }
+    const_iterator end() const { return finish; }
+    size_type size() const { return (size_type)(finish - start); }
+    size_type capacity() const { return (size_type)(end_of_storage - start); }
+    bool empty() const { return start == finish; }
+    reference operator[](size_type n) { return *(begin() + n); }
+    const_reference operator[](size_type n) const { return *(begin() + n); }
+
+    // 元素是否在内联存储中
+    bool is_inline() const { return start == (const_iterator) inline_storage; }
+
+    // 构造函数，与vector相同，都可以指定分配器实例
+    explicit small_vector(const Alloc& a = Alloc()) : alloc_base(a) { reset_to_inline(); }
+
+    small_vector(size_type n, const T& value, const Alloc& a = Alloc()) : alloc_base(a) {
+        fill_initialize(n, value);
+    }
+    small_vector(int n, const T& value, const Alloc& a = Alloc()) : alloc_base(a) {
+        fill_initialize((size_type) n, value);
+    }
+    small_vector(long n, const T& value, const Alloc& a = Alloc()) : alloc_base(a) {
+        fill_initialize((size_type) n, value);
+    }
+    explicit small_vector(size_type n, const Alloc& a = Alloc()) : alloc_base(a) {
+        fill_initialize(n, T());
+    }
+
+    small_vector(const small_vector& x)
+        : alloc_base(__allocator_traits<Alloc>::select_on_container_copy_construction(x.get_alloc())) {
+        reset_to_inline();
+        try {
+            assign_aux(x.start, x.finish);
+        }
+        catch (...) {
+            destroy(start, finish);
+            deallocate();
+            throw;
+        }
+    }
+
+    // 移动构造，x在堆上时直接接管内存，在内联存储中时逐个移动元素，所以只有T的移动构造不抛出异常时才是noexcept
+    small_vector(small_vector&& x) noexcept(std::is_nothrow_move_constructible<T>::value) : alloc_base(x.get_alloc()) { steal(x); }
+
+    small_vector& operator=(const small_vector& x) {
+        if (&x != this) {
+            if (__allocator_traits<Alloc>::propagate_on_container_copy_assignment
+                && !__alloc_equal(this->get_alloc(), x.get_alloc())) {
+                destroy(start, finish);
+                deallocate();
+                reset_to_inline();
+            }
+            __propagate_on_copy_assign(this->get_alloc(), x.get_alloc());
+            assign_aux(x.start, x.finish);
+        }
+        return *this;
+    }
+
+    // 移动赋值，x在堆上并且分配器会传播或者相等时接管内存，否则逐个移动元素
+    // 分配器会传播时，无论x是否在内联存储中都换成x的分配器，换之前先用原来的分配器回收自己堆上的内存
+    small_vector& operator=(small_vector&& x)
+        noexcept(std::is_nothrow_move_constructible<T>::value && __move_assign_steals<Alloc>::value) {
+        if (&x == this)
+            return *this;
+        if (!x.is_inline() && (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+                               || __alloc_equal(this->get_alloc(), x.get_alloc()))) {
+            destroy(start, finish);
+            deallocate();
+            __propagate_on_move_assign(this->get_alloc(), x.get_alloc());
+            steal(x);
+        }
+        else {
+            if (__allocator_traits<Alloc>::propagate_on_container_move_assignment
+                && !__alloc_equal(this->get_alloc(), x.get_alloc())) {
+                // x在内联存储中，元素一定放得进自己的内联存储
+                destroy(start, finish);
+                deallocate();
+                reset_to_inline();
+            }
+            else {
+                clear();
+            }
+            __propagate_on_move_assign(this->get_alloc(), x.get_alloc());
+            if (x.size() > capacity())
+                reallocate_storage(x.size());
+            finish = __uninitialized_move_if_noexcept(x.start, x.finish, start);
+            x.clear();
+        }
+        return *this;
+    }
+
+    // 两个都在堆上时只交换指针，否则通过移动交换元素
+    void swap(small_vector& x) {
+        if (&x == this)
+            return;
+        if (!is_inline() && !x.is_inline()) {
+            __propagate_on_swap(this->get_alloc(), x.get_alloc());
+            std::swap(start, x.start);
+            std::swap(finish, x.finish);
+            std::swap(end_of_storage, x.end_of_storage);
+            return;
+        }
+        small_vector tmp(std::move(x));
+        x = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    ~small_vector() {
+        destroy(start, finish);
+        deallocate();
+    }
+
+    reference front() { return *begin(); }
+    reference back() { return *(end() - 1); }
+
+    void push_back(const T& x) {
+        if (finish != end_of_storage) {
+            construct(finish, x);
+            ++finish;
+        }
+        else
+            insert_aux(end(), x);
+    }
+
+    void push_back(T&& x) {
+        if (finish != end_of_storage) {
+            construct(finish, std::move(x));
+            ++finish;
+        }
+        else
+            insert_aux(end(), std::move(x));
+    }
+
+    template <class... Args>
+    void emplace_back(Args&&... args) {
+        if (finish != end_of_storage) {
+            construct(finish, std::forward<Args>(args)...);
+            ++finish;
+        }
+        else
+            insert_aux(end(), std::forward<Args>(args)...);
+    }
+
+    // 与vector::emplace()相同
+    template <class... Args>
+    iterator emplace(iterator position, Args&&... args) {
+        const size_type elems_before = (size_type)(position - start);
+        if (finish == end_of_storage) {
+            insert_aux(position, std::forward<Args>(args)...);
+        }
+        else if (position == finish) {
+            construct(finish, std::forward<Args>(args)...);
+            ++finish;
+        }
+        else {
+            T x_copy(std::forward<Args>(args)...);
+            construct(finish, std::move(*(finish - 1)));
+            ++finish;
+            std::move_backward(position, finish - 2, finish - 1);
+            *position = std::move(x_copy);
+        }
+        return start + elems_before;
+    }
+
+    iterator insert(iterator position, const T& x) { return emplace(position, x); }
+    iterator insert(iterator position, T&& x) { return emplace(position, std::move(x)); }
+
+    // 在position开始的位置连续插入n个x的拷贝
+    void insert(iterator position, size_type n, const T& x);
+
+    // 在position之前插入[first, last)的元素，前向迭代器的区间容量不够时只扩容一次
+    template <class InputIterator>
+    void insert(iterator position, InputIterator first, InputIterator last) {
+        insert_dispatch(position, first, last, std::is_integral<InputIterator>());
+    }
+
+    void assign(size_type n, const T& x) {
+        clear();
+        insert(end(), n, x);
+    }
+
+    template <class InputIterator>
+    void assign(InputIterator first, InputIterator last) {
+        clear();
+        insert(end(), first, last);
+    }
+
+    // 把容量扩大到至少n个元素，n不超过内联存储时什么都不做
+    void reserve(size_type n) {
+        if (n > capacity())
+            reallocate_storage(n);
+    }
+
+    // 把容量缩小到size()，元素个数不超过N时搬回内联存储
+    void shrink_to_fit();
+
+    void pop_back() {
+        if (start != finish) {
+            --finish;
+            destroy(finish);
+        }
+    }
+
+    iterator erase(iterator first, iterator last) {
+        iterator i = std::move(last, finish, first);
+        destroy(i, finish);
+        finish = i;
+        return first;
+    }
+
+    iterator erase(iterator position) {
+        if (position + 1 != finish)
+            std::move(position + 1, finish, position);
+        --finish;
+        destroy(finish);
+        return position;
+    }
+
+    void resize(size_type new_size, const T& x) {
+        if (new_size < size())
+            erase(begin() + new_size, end());
+        else
+            insert(end(), new_size - size(), x);
+    }
+
+    void resize(size_type new_size) { resize(new_size, T()); }
+
+    void clear() { erase(begin(), end()); }
+
+    // 与vector::resize_default_init()相同，新增的元素默认初始化
+    void resize_default_init(size_type new_size) {
+        if (new_size < size()) {
+            erase(begin() + new_size, end());
+            return;
+        }
+        if (new_size > capacity())
+            reallocate_storage(size() + max(capacity(), new_size - size()));
+        finish = __uninitialized_default_n(finish, new_size - size());
+    }
+
+    // 与vector::reserve_and_write()相同，writer(p, n)直接向尾端写入最多n个元素，返回实际追加的个数
+    template <class Writer>
+    size_type reserve_and_write(size_type n, Writer writer) {
+        if (size() + n > capacity())
+            reallocate_storage(size() + max(capacity(), n));
+        iterator slots_end = __uninitialized_default_n(finish, n);
+        size_type written;
+        try {
+            written = writer(finish, n);
+        }
+        catch (...) {
+            destroy(finish, slots_end);
+            throw;
+        }
+        destroy(finish + written, slots_end);
+        finish += written;
+        return written;
+    }
+
+protected:
+    template <class Integer>
+    void insert_dispatch(iterator position, Integer n, Integer x, std::true_type) {
+        insert(position, (size_type) n, (T) x);
+    }
+
+    template <class InputIterator>
+    void insert_dispatch(iterator position, InputIterator first, InputIterator last, std::false_type) {
+        range_insert(position, first, last, typename iterator_traits<InputIterator>::iterator_category());
+    }
+
+    template <class InputIterator>
+    void range_insert(iterator position, InputIterator first, InputIterator last, input_iterator_tag) {
+        for (; first != last; ++first) {
+            position = insert(position, *first);
+            ++position;
+        }
+    }
+
+    template <class ForwardIterator>
+    void range_insert(iterator position, ForwardIterator first, ForwardIterator last, forward_iterator_tag);
+
+    // 用[first, last)替换small_vector中的元素，容量足够时复用原来的内存空间
+    void assign_aux(const_iterator first, const_iterator last) {
+        const size_type n = (size_type)(last - first);
+        if (n > capacity()) {
+            clear();
+            reallocate_storage(n);
+        }
+        if (size() >= n) {
+            iterator i = copy(first, last, start);
+            destroy(i, finish);
+        }
+        else {
+            copy(first, first + size(), start);
+            uninitialized_copy(first + size(), last, finish);
+        }
+        finish = start + n;
+    }
+};
+
+template <class T, size_t N, class Alloc>
+void small_vector<T, N, Alloc>::reallocate_storage(size_type new_size) {
+    const size_type n = size();
+    // 已经在堆上，并且元素可以按字节搬动，与vector相同交给reallocate()
+    if (relocatable && !is_inline()) {
+        start = data_allocator::reallocate(this->get_alloc(), start, capacity(), new_size);
+        finish = start + n;
+        end_of_storage = start + new_size;
+        return;
+    }
+    iterator new_start = data_allocator::allocate(this->get_alloc(), new_size);
+    iterator new_finish;
+    try {
+        new_finish = __uninitialized_move_if_noexcept(start, finish, new_start);
+    }
+    catch (...) {
+        data_allocator::deallocate(this->get_alloc(), new_start, new_size);
+        throw;
+    }
+    destroy(start, finish);
+    deallocate();
+    start = new_start;
+    finish = new_finish;
+    end_of_storage = start + new_size;
+}
+
+// 与vector::insert_aux()相同，只是容量从N开始翻倍，原来的内存在内联存储中时不需要回收
+template <class T, size_t N, class Alloc>
+template <class... Args>
+void small_vector<T, N, Alloc>::insert_aux(iterator position, Args&&... args) {
+    const size_type new_size = 2 * capacity();
+    const size_type elems_before = (size_type)(position - start);
+
+    if (relocatable && !is_inline()) {
+        T x_copy(std::forward<Args>(args)...);      // args可能引用small_vector中的元素
+        reallocate_storage(new_size);
+        position = start + elems_before;
+        memmove((void*)(position + 1), (void*)position, (size_type)(finish - position) * sizeof(T));
+        try {
+            construct(position, std::move(x_copy));
+        }
+        catch (...) {
+            memmove((void*)position, (void*)(position + 1), (size_type)(finish - position) * sizeof(T));
+            throw;
+        }
+        ++finish;
+        return;
+    }
+
+    iterator new_start = data_allocator::allocate(this->get_alloc(), new_size);
+    iterator new_finish = new_start;
+    try {
+        // 先构造新元素，args可能引用small_vector中的元素
+        construct(new_start + elems_before, std::forward<Args>(args)...);
+        new_finish = 0;
+        new_finish = __uninitialized_move_if_noexcept(start, position, new_start);
+        ++new_finish;
+        new_finish = __uninitialized_move_if_noexcept(position, finish, new_finish);
+    }
+    catch (...) {
+        if (new_finish == 0)
+            destroy(new_start + elems_before);
+        else
+            destroy(new_start, new_finish);
+        data_allocator::deallocate(this->get_alloc(), new_start, new_size);
+        throw;
+    }
+
+    destroy(start, finish);
+    deallocate();
+    start = new_start;
+    finish = new_finish;
+    end_of_storage = start + new_size;
+}
+
+template <class T, size_t N, class Alloc>
+void small_vector<T, N, Alloc>::insert(iterator position, size_type n, const T& x) {
+    if (n == 0)
+        return;
+    // 备用空间不够时先扩容（2倍，或者刚好放下新元素），再在原来的位置插入
+    if (size_type(end_of_storage - finish) < n) {
+        T x_copy = x;       // x可能就是small_vector中的元素，扩容之后就失效了
+        const size_type elems_before = (size_type)(position - start);
+        const size_type old_size = size();
+        reallocate_storage(old_size + max(capacity(), n));
+        insert(start + elems_before, n, x_copy);
+        return;
+    }
+    // 与vector::insert()的前一半相同，已经构造的位置赋值，没有构造的位置构造
+    T x_copy = x;
+    iterator old_finish = finish;
+    const size_type elems_after = (size_type)(finish - position);
+    if (elems_after > n) {
+        finish = __uninitialized_move_if_noexcept(finish - n, finish, finish);
+        std::move_backward(position, old_finish - n, old_finish);
+        fill(position, position + n, x_copy);
+    }
+    else {
+        uninitialized_fill_n(finish, n - elems_after, x_copy);
+        finish += n - elems_after;
+        finish = __uninitialized_move_if_noexcept(position, old_finish, finish);
+        fill(position, old_finish, x_copy);
+    }
+}
+
+template <class T, size_t N, class Alloc>
+template <class ForwardIterator>
+void small_vector<T, N, Alloc>::range_insert(iterator position, ForwardIterator first, ForwardIterator last,
+                                             forward_iterator_tag) {
+    if (first == last)
+        return;
+    const size_type n = (size_type) distance(first, last);
+    // 备用空间不够时先一次扩容到放得下所有新元素，再在原来的位置插入
+    if (size_type(end_of_storage - finish) < n) {
+        const size_type elems_before = (size_type)(position - start);
+        reallocate_storage(size() + max(capacity(), n));
+        position = start + elems_before;
+    }
+    iterator old_finish = finish;
+    const size_type elems_after = (size_type)(finish - position);
+    if (elems_after > n) {
+        finish = __uninitialized_move_if_noexcept(finish - n, finish, finish);
+        std::move_backward(position, old_finish - n, old_finish);
+        copy(first, last, position);
+    }
+    else {
+        ForwardIterator mid = first;
+        advance(mid, elems_after);
+        finish = uninitialized_copy(mid, last, finish);
+        finish = __uninitialized_move_if_noexcept(position, old_finish, finish);
+        copy(first, mid, position);
+    }
+}
+
+template <class T, size_t N, class Alloc>
+void small_vector<T, N, Alloc>::shrink_to_fit() {
+    if (is_inline() || finish == end_of_storage)
+        return;
+    if (size() > N) {
+        reallocate_storage(size());
+        return;
+    }
+    // 元素搬回内联存储，失败时保持原来的堆内存不变
+    iterator old_start = start, old_finish = finish, old_end_of_storage = end_of_storage;
+    reset_to_inline();
+    try {
+        finish = __uninitialized_move_if_noexcept(old_start, old_finish, start);
+    }
+    catch (...) {
+        start = old_start;
+        finish = old_finish;
+        end_of_storage = old_end_of_storage;
+        throw;
+    }
+    destroy(old_start, old_finish);
+    data_allocator::deallocate(this->get_alloc(), old_start, (size_type)(old_end_of_storage - old_start));
+}
+
+#endif //STL_MY_ALLOCATOR_SMALL_VECTOR_H
@@ -0,0 +1,403 @@
+//
+// 按列存储的vector（struct of arrays）
+//
+
+#ifndef STL_MY_ALLOCATOR_SOA_VECTOR_H
+#define STL_MY_ALLOCATOR_SOA_VECTOR_H
+
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include "my_allocator.h"
+#include "my_vector.h"
+
+/*
+ * soa_vector<Fields...>，每个字段单独存成一个连续的数组（列），而不是像vector<Record>那样按记录存放：
+ *   vector<Record>：     |__a0__b0__c0__|__a1__b1__c1__|__a2__b2__c2__|......
+ *   soa_vector<A, B, C>：|__a0__a1__a2__......|__b0__b1__b2__......|__c0__c1__c2__......|
+ * 只读一两个字段的循环（求和、过滤、统计）取到cache中的每一个字节都是需要的数据，
+ * 每一列都是普通的数组，编译器可以直接向量化，循环的瓶颈变成内存带宽
+ *
+ * 所有的列放在同一块内存中，每一列的起始地址按cache line（64Bytes）对齐（通过__aligned_alloc申请），
+ * push_back()、reserve()扩容时所有的列一起搬到新的内存块上，只需要一次分配
+ * 扩容的策略与vector默认的__vector_growth_2x相同
+ *
+ * 访问方式：
+ *   soa_vector<int, double, char> v;
+ *   v.push_back(1, 2.0, 'a');
+ *   get<1>(v[0]) = 3.0;                    // v[i]返回std::tuple<int&, double&, char&>，即一行的代理
+ *   v.get<1>(0) = 3.0;                     // 直接访问某一列的某个元素
+ *   for (double x : v.column<1>()) ...     // 某一列的连续区间，data()/size()/begin()/end()
+ * 需要指定分配器时使用basic_soa_vector<Alloc, Fields...>
+ * 分配器在拷贝赋值、移动赋值、交换时都不传播，移动赋值和交换要求两个容器的分配器相等（与vector默认的规则相同）
+ */
+
+// 某一列的连续区间
+template <class T>
+struct __soa_span {
+    T* first;
+    size_t n;
+
+    __soa_span(T* p, size_t count) : first(p), n(count) {}
+
+    T* begin() const { return first; }
+    T* end() const { return first + n; }
+    T* data() const { return first; }
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    T& operator[](size_t i) const { return first[i]; }
+};
+
+// 所有字段中最大的对齐要求
+template <class... Fields>
+struct __soa_max_align : std::integral_constant<size_t, 1> {};
+
+template <class T, class... Rest>
+struct __soa_max_align<T, Rest...>
+    : std::integral_constant<size_t, (alignof(T) > __soa_max_align<Rest...>::value ? alignof(T) : __soa_max_align<Rest...>::value)> {};
+
+// 所有字段的移动构造函数都不抛出异常（或者字段不能拷贝，只能移动）时为true
+// 扩容时所有的列一起决定是移动还是拷贝，否则某一列拷贝失败时，前面已经移动过的列无法恢复
+template <class... Fields>
+struct __soa_nothrow_move : std::true_type {};
+
+template <class T, class... Rest>
+struct __soa_nothrow_move<T, Rest...>
+    : std::integral_constant<bool, (std::is_nothrow_move_constructible<T>::value || !std::is_copy_constructible<T>::value)
+                                   && __soa_nothrow_move<Rest...>::value> {};
+
+template <class Alloc, class... Fields>
+class basic_soa_vector : protected __alloc_holder<my_std::__aligned_alloc<Alloc, my_std::__CACHE_LINE_SIZE> > {
+    static_assert(sizeof...(Fields) > 0, "soa_vector needs at least one field");
+    static_assert(__soa_max_align<Fields...>::value <= my_std::__CACHE_LINE_SIZE,
+                  "soa_vector aligns columns to cache lines, fields cannot require more");
+
+public:
+    typedef size_t                          size_type;
+    typedef std::tuple<Fields...>           value_type;
+    typedef std::tuple<Fields&...>          reference;          // 一行的代理，每个字段一个引用
+    typedef std::tuple<const Fields&...>    const_reference;
+    typedef Alloc                           allocator_type;
+
+    // 第I列的元素类型
+    template <size_t I>
+    using field_type = typename std::tuple_element<I, value_type>::type;
+
+    Alloc get_allocator() const { return this->get_alloc().inner(); }
+
+protected:
+    typedef my_std::__aligned_alloc<Alloc, my_std::__CACHE_LINE_SIZE> column_alloc;
+    typedef __alloc_holder<column_alloc> alloc_base;
+    typedef simple_alloc<char, column_alloc> data_allocator;
+    typedef std::tuple<Fields*...> column_pointers;
+    typedef std::index_sequence_for<Fields...> indices;
+    typedef int swallow[];          // 展开参数包时用来依次求值
+
+    column_pointers columns;        // 每一列的起始地址
+    char* block;                    // 所有列所在的内存块
+    size_type count;                // 行数
+    size_type cap;                  // 每一列能容纳的元素个数
+
+    static const size_t FIELDS = sizeof...(Fields);
+
+    // 一行所有字段的大小之和
+    static size_t row_bytes() {
+        const size_t sizes[] = {sizeof(Fields)...};
+        size_t bytes = 0;
+        for (size_t i = 0; i < FIELDS; i++)
+            bytes += sizes[i];
+        return bytes;
+    }
+
+    // 容量为n时每一列在内存块中的偏移，返回内存块的字节数；每一列都从cache line的边界开始
+    static size_t layout(size_type n, size_t* offsets) {
+        const size_t sizes[] = {sizeof(Fields)...};
+        size_t bytes = 0;
+        for (size_t i = 0; i < FIELDS; i++) {
+            offsets[i] = bytes;
+            bytes = (bytes + n * sizes[i] + my_std::__CACHE_LINE_SIZE - 1) & ~(my_std::__CACHE_LINE_SIZE - 1);
+        }
+        return bytes;
+    }
+
+    template <size_t... I>
+    static column_pointers make_columns(char* b, const size_t* offsets, std::index_sequence<I...>) {
+        return column_pointers((Fields*)(b + offsets[I])...);
+    }
+
+    // 申请容量为n的内存块，cols为其中每一列的起始地址
+    char* allocate_block(size_type n, column_pointers& cols) {
+        size_t offsets[FIELDS];
+        char* b = data_allocator::allocate(this->get_alloc(), layout(n, offsets));
+        cols = make_columns(b, offsets, indices());
+        return b;
+    }
+
+    void deallocate_block(char* b, size_type n) {
+        if (b != NULL) {
+            size_t offsets[FIELDS];
+            data_allocator::deallocate(this->get_alloc(), b, layout(n, offsets));
+        }
+    }
+
+    // 在cols的第i行用args构造一行，每个字段由对应的一个参数构造；某个字段构造失败时析构这一行已经构造的字段
+    template <class... Args, size_t... I>
+    static void construct_row(const column_pointers& cols, size_type i, std::index_sequence<I...>, Args&&... args) {
+        size_t done = 0;
+        try {
+            (void) swallow{0, (construct(std::get<I>(cols) + i, std::forward<Args>(args)), ++done, 0)...};
+        }
+        catch (...) {
+            (void) swallow{0, (I < done ? destroy(std::get<I>(cols) + i) : (void) 0, 0)...};
+            throw;
+        }
+    }
+
+    template <size_t... I>
+    static void destroy_row(const column_pointers& cols, size_type i, std::index_sequence<I...>) {
+        (void) swallow{0, (destroy(std::get<I>(cols) + i), 0)...};
+    }
+
+    // 析构cols中前k列的前n个元素
+    template <size_t... I>
+    static void destroy_columns(const column_pointers& cols, size_type n, size_t k, std::index_sequence<I...>) {
+        (void) swallow{0, (I < k ? destroy(std::get<I>(cols), std::get<I>(cols) + n) : (void) 0, 0)...};
+    }
+
+    // 把[first, last)搬到result开始的未初始化空间上，失败时析构已经构造的元素
+    // 所有字段都满足__soa_nothrow_move时移动，否则能拷贝的列一律拷贝，这样出现异常时原来的元素都不受影响
+    template <class T>
+    static void relocate_column(T* first, T* last, T* result) {
+        typedef typename std::conditional<__soa_nothrow_move<Fields...>::value || !std::is_copy_constructible<T>::value,
+                                          T&&, const T&>::type source_type;
+        T* cur = result;
+        try {
+            for (; first != last; ++first, ++cur)
+                construct(cur, static_cast<source_type>(*first));
+        }
+        catch (...) {
+            destroy(result, cur);
+            throw;
+        }
+    }
+
+    // 把from每一列的前n个元素搬到to中（见relocate_column），失败时析构已经搬过去的列
+    template <size_t... I>
+    static void move_columns(const column_pointers& from, size_type n, const column_pointers& to,
+                             std::index_sequence<I...>) {
+        size_t done = 0;
+        try {
+            (void) swallow{0, (relocate_column(std::get<I>(from), std::get<I>(from) + n, std::get<I>(to)), ++done, 0)...};
+        }
+        catch (...) {
+            destroy_columns(to, n, done, indices());
+            throw;
+        }
+    }
+
+    // 把x每一列的元素拷贝到to中，失败时析构已经拷贝的列
+    template <size_t... I>
+    static void copy_columns(const basic_soa_vector& x, const column_pointers& to, std::index_sequence<I...>) {
+        size_t done = 0;
+        try {
+            (void) swallow{0, (uninitialized_copy(std::get<I>(x.columns), std::get<I>(x.columns) + x.count,
+                                                  std::get<I>(to)), ++done, 0)...};
+        }
+        catch (...) {
+            destroy_columns(to, x.count, done, indices());
+            throw;
+        }
+    }
+
+    // 换成新的内存块，原来的元素析构，原来的内存块回收
+    void adopt(char* new_block, const column_pointers& new_columns, size_type new_cap) {
+        destroy_columns(columns, count, FIELDS, indices());
+        deallocate_block(block, cap);
+        block = new_block;
+        columns = new_columns;
+        cap = new_cap;
+    }
+
+    template <size_t... I>
+    reference row(size_type i, std::index_sequence<I...>) { return reference(std::get<I>(columns)[i]...); }
+
+    template <size_t... I>
+    const_reference row(size_type i, std::index_sequence<I...>) const {
+        return const_reference(std::get<I>(columns)[i]...);
+    }
+
+    void steal(basic_soa_vector& x) {
+        columns = x.columns;
+        block = x.block;
+        count = x.count;
+        cap = x.cap;
+        x.columns = column_pointers();
+        x.block = NULL;
+        x.count = x.cap = 0;
+    }
+
+public:
+    size_type size() const { return count; }
+    size_type capacity() const { return cap; }
+    bool empty() const { return count == 0; }
+
+    // 第i行
+    reference operator[](size_type i) { return row(i, indices()); }
+    const_reference operator[](size_type i) const { return row(i, indices()); }
+    reference front() { return (*this)[0]; }
+    reference back() { return (*this)[count - 1]; }
+
+    // 第I列第i行的元素
+    template <size_t I>
+    field_type<I>& get(size_type i) { return std::get<I>(columns)[i]; }
+
+    template <size_t I>
+    const field_type<I>& get(size_type i) const { return std::get<I>(columns)[i]; }
+
+    // 第I列，起始地址按cache line对齐
+    template <size_t I>
+    __soa_span<field_type<I> > column() { return __soa_span<field_type<I> >(std::get<I>(columns), count); }
+
+    template <size_t I>
+    __soa_span<const field_type<I> > column() const {
+        return __soa_span<const field_type<I> >(std::get<I>(columns), count);
+    }
+
+    explicit basic_soa_vector(const Alloc& a = Alloc())
+        : alloc_base(column_alloc(a)), columns(), block(NULL), count(0), cap(0) {}
+
+    basic_soa_vector(const basic_soa_vector& x)
+        : alloc_base(column_alloc(__allocator_traits<Alloc>::select_on_container_copy_construction(x.get_allocator()))),
+          columns(), block(NULL), count(0), cap(0) {
+        if (x.count == 0)
+            return;
+        column_pointers new_columns;
+        char* new_block = allocate_block(x.count, new_columns);
+        try {
+            copy_columns(x, new_columns, indices());
+        }
+        catch (...) {
+            deallocate_block(new_block, x.count);
+            throw;
+        }
+        block = new_block;
+        columns = new_columns;
+        count = cap = x.count;
+    }
+
+    // 移动构造，直接接管x的内存块；声明为noexcept，vector<soa_vector<...>>扩容时才会移动而不是拷贝
+    basic_soa_vector(basic_soa_vector&& x) noexcept : alloc_base(x.get_alloc()) { steal(x); }
+
+    basic_soa_vector& operator=(const basic_soa_vector& x) {
+        if (&x != this) {
+            clear();
+            reserve(x.count);
+            copy_columns(x, columns, indices());
+            count = x.count;
+        }
+        return *this;
+    }
+
+    // 移动赋值，分配器会传播或者两个分配器相等时直接接管x的内存块，否则逐个移动元素（与vector相同）
+    basic_soa_vector& operator=(basic_soa_vector&& x) noexcept(__move_assign_steals<column_alloc>::value) {
+        if (&x == this)
+            return *this;
+        if (__allocator_traits<column_alloc>::propagate_on_container_move_assignment
+            || __alloc_equal(this->get_alloc(), x.get_alloc())) {
+            clear();
+            deallocate_block(block, cap);
+            __propagate_on_move_assign(this->get_alloc(), x.get_alloc());
+            steal(x);
+        }
+        else {
+            clear();
+            reserve(x.count);
+            move_columns(x.columns, x.count, columns, indices());
+            count = x.count;
+            x.clear();
+        }
+        return *this;
+    }
+
+    void swap(basic_soa_vector& x) {
+        std::swap(columns, x.columns);
+        std::swap(block, x.block);
+        std::swap(count, x.count);
+        std::swap(cap, x.cap);
+    }
+
+    ~basic_soa_vector() {
+        destroy_columns(columns, count, FIELDS, indices());
+        deallocate_block(block, cap);
+    }
+
+    // 把每一列的容量扩大到至少n个元素，所有的列一起搬到一块新的内存上
+    void reserve(size_type n) {
+        if (n <= cap)
+            return;
+        column_pointers new_columns;
+        char* new_block = allocate_block(n, new_columns);
+        try {
+            move_columns(columns, count, new_columns, indices());
+        }
+        catch (...) {
+            deallocate_block(new_block, n);
+            throw;
+        }
+        adopt(new_block, new_columns, n);
+    }
+
+    // 在尾端添加一行，每个字段由对应的一个参数构造
+    // 容量不够时先在新的内存块上构造新的一行，args可能引用容器中的元素，这时原来的元素还没有被移走
+    template <class... Args>
+    void emplace_back(Args&&... args) {
+        static_assert(sizeof...(Args) == FIELDS, "emplace_back needs one argument per field");
+        if (count != cap) {
+            construct_row(columns, count, indices(), std::forward<Args>(args)...);
+            ++count;
+            return;
+        }
+        const size_type new_cap = __vector_growth_2x::next_capacity(count, count + 1, row_bytes());
+        column_pointers new_columns;
+        char* new_block = allocate_block(new_cap, new_columns);
+        try {
+            construct_row(new_columns, count, indices(), std::forward<Args>(args)...);
+        }
+        catch (...) {
+            deallocate_block(new_block, new_cap);
+            throw;
+        }
+        try {
+            move_columns(columns, count, new_columns, indices());
+        }
+        catch (...) {
+            destroy_row(new_columns, count, indices());
+            deallocate_block(new_block, new_cap);
+            throw;
+        }
+        adopt(new_block, new_columns, new_cap);
+        ++count;
+    }
+
+    void push_back(const Fields&... values) { emplace_back(values...); }
+    void push_back(const value_type& x) { push_back_tuple(x, indices()); }
+
+    void pop_back() {
+        --count;
+        destroy_row(columns, count, indices());
+    }
+
+    void clear() {
+        destroy_columns(columns, count, FIELDS, indices());
+        count = 0;
+    }
+
+protected:
+    template <size_t... I>
+    void push_back_tuple(const value_type& x, std::index_sequence<I...>) { emplace_back(std::get<I>(x)...); }
+};
+
+template <class... Fields>
+using soa_vector = basic_soa_vector<alloc, Fields...>;
+
+#endif //STL_MY_ALLOCATOR_SOA_VECTOR_H